@@ -0,0 +1,726 @@
+/*
+ * stegfs ~ a steganographic file system for unix-like systems
+ * Copyright © 2007-2020, albinoloverats ~ Software Development
+ * email: stegfs@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * the block and key functions are static, so rather than export them just
+ * to be timed the file system itself is built in to the benchmark
+ */
+#include "stegfs.c"
+
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <time.h>
+
+#include "common/error.h"
+
+
+#define BENCH_NAME "stegfs-bench"
+
+#define BENCH_SIZE   128   /* default image size (MB) */
+#define BENCH_SEED   1     /* default seed */
+#define BENCH_KEYS   8     /* keys derived */
+#define BENCH_BLOCKS 4096  /* blocks written and read */
+#define BENCH_ASSIGN 4096  /* blocks assigned at each fill level */
+#define BENCH_FILES  8     /* files stat’d */
+#define BENCH_STAT   65536 /* size of each file stat’d */
+
+#define BENCH_PATH "/bench/files"
+#define BENCH_PASS "password"
+
+typedef struct
+{
+	enum gcry_cipher_algos cipher;
+	enum gcry_cipher_modes mode;
+	enum gcry_md_algos hash;
+	enum gcry_mac_algos mac;
+	uint32_t duplicates;
+	uint32_t stripes;
+	uint32_t features;
+	size_t blocksize;
+	uint64_t size;
+	uint64_t seed;
+	const char *dir;
+}
+bench_args_t;
+
+static const unsigned FILL_LEVELS[] = { 0, 50, 90, 99 };
+
+static const struct
+{
+	uint64_t size;
+	size_t count;
+}
+FILE_SIZES[] =
+{
+	{ 4 * KILOBYTE,   8 },
+	{ 256 * KILOBYTE, 4 },
+	{ 2 * MEGABYTE,   2 }
+};
+
+static uint64_t bench_now(void);
+static void bench_seed(uint64_t);
+static uint64_t bench_random(void);
+static void bench_bytes(uint8_t *, size_t);
+static int bench_compare(const void *, const void *);
+static void bench_report(const char * const restrict, uint64_t *, size_t, uint64_t);
+static void bench_file(stegfs_file_t *, const char * const restrict);
+static void bench_file_free(stegfs_file_t *);
+
+static bool bench_run(const bench_args_t * const restrict);
+static bool bench_sanity(void);
+static void bench_keys(void);
+static void bench_blocks(void);
+static void bench_assign(void);
+static void bench_stat(void);
+static void bench_files(void);
+
+static void print_usage(void);
+static void print_help(void);
+
+static char *extract_option(int, char **, int *, const char * const restrict, const char * const restrict);
+
+static uint64_t random_state;
+
+int main(int argc, char **argv)
+{
+	setlocale(LC_ALL, "");
+	init_crypto();
+	errno = EXIT_SUCCESS;
+
+	bench_args_t a = { DEFAULT_CIPHER, DEFAULT_MODE, DEFAULT_HASH, DEFAULT_MAC, COPIES_DEFAULT, 1, FEATURE_NONE, SIZE_BYTE_BLOCK, BENCH_SIZE, BENCH_SEED, "/dev/shm" };
+	bool cipher = false, mode = false, hash = false, mac = false, all = false;
+	/*
+	 * parse commandline arguments
+	 */
+	for (int i = 1; i < argc; i++)
+	{
+		char *x = NULL;
+		if (!strcmp("--help", argv[i]) || !strcmp("-h", argv[i]))
+		{
+			print_help();
+			return EXIT_SUCCESS;
+		}
+		else if (!strcmp("--all", argv[i]) || !strcmp("-A", argv[i]))
+			all = true;
+		else if (!strcmp("--index", argv[i]) || !strcmp("-i", argv[i]))
+			a.features |= FEATURE_INDEX;
+		else if (!strcmp("--ecc", argv[i]) || !strcmp("-e", argv[i]))
+			a.features |= FEATURE_ECC;
+		else if (!strcmp("--compress", argv[i]) || !strcmp("-Z", argv[i]))
+			a.features |= FEATURE_COMPRESS;
+		else if ((x = extract_option(argc, argv, &i, "-c", "--cipher")))
+		{
+			if ((a.cipher = cipher_id_from_name(x)) == GCRY_CIPHER_NONE)
+				die("unsupported cipher %s", x);
+			cipher = true;
+		}
+		else if ((x = extract_option(argc, argv, &i, "-m", "--mode")))
+		{
+			if ((a.mode = mode_id_from_name(x)) == GCRY_CIPHER_MODE_NONE)
+				die("unsupported mode %s", x);
+			mode = true;
+		}
+		else if ((x = extract_option(argc, argv, &i, "-s", "--hash")))
+		{
+			if ((a.hash = hash_id_from_name(x)) == GCRY_MD_NONE)
+				die("unsupported hash %s", x);
+			hash = true;
+		}
+		else if ((x = extract_option(argc, argv, &i, "-a", "--mac")))
+		{
+			if ((a.mac = mac_id_from_name(x)) == GCRY_MAC_NONE)
+				die("unsupported mac %s", x);
+			mac = true;
+		}
+		else if ((x = extract_option(argc, argv, &i, "-x", "--duplicates")))
+			a.duplicates = strtol(x, NULL, 0);
+		else if ((x = extract_option(argc, argv, &i, "-k", "--stripes")))
+			a.stripes = strtol(x, NULL, 0);
+		else if ((x = extract_option(argc, argv, &i, "-B", "--block-size")))
+			a.blocksize = strtol(x, NULL, 0);
+		else if ((x = extract_option(argc, argv, &i, "-z", "--size")))
+			a.size = strtoull(x, NULL, 0);
+		else if ((x = extract_option(argc, argv, &i, "-S", "--seed")))
+			a.seed = strtoull(x, NULL, 0);
+		else if ((x = extract_option(argc, argv, &i, "-t", "--directory")))
+		{
+			a.dir = x;
+			continue;
+		}
+		else
+		{
+			print_usage();
+			return EXIT_FAILURE;
+		}
+		free(x);
+	}
+	if (a.duplicates <= 0 || a.duplicates > COPIES_MAX)
+		die("unsupported value for file duplication %" PRIu32, a.duplicates);
+	if (a.stripes > 1)
+	{
+		if (a.stripes >= a.duplicates || a.duplicates > ECC_STRIPES_MAX)
+			die("unsupported number of stripes %" PRIu32, a.stripes);
+		a.features |= FEATURE_STRIPE;
+	}
+	if (a.blocksize < SIZE_BYTE_BLOCK || a.blocksize > SIZE_BYTE_BLOCK_MAX || (a.blocksize & (a.blocksize - 1)))
+		die("unsupported block size %zu", a.blocksize);
+	if (!a.size)
+		die("unsupported image size %" PRIu64, a.size);
+	a.size *= MEGABYTE;
+
+	printf(_("%s: %" PRIu64 " MB image in %s, %zu byte blocks, %" PRIu32 " copies, seed %" PRIu64 "\n"), BENCH_NAME, a.size / MEGABYTE, a.dir, a.blocksize, a.duplicates, a.seed);
+	/*
+	 * the chosen (or default) algorithms on their own, then each one
+	 * that wasn’t chosen changed in turn; or with --all every
+	 * combination of cipher, mode and hash
+	 */
+	bench_run(&a);
+	const char **ciphers = list_of_ciphers();
+	const char **modes = list_of_modes();
+	const char **hashes = list_of_hashes();
+	const char **macs = list_of_macs();
+	if (all)
+	{
+		bench_args_t b = a;
+		for (unsigned i = 0; ciphers[i]; i++)
+			for (unsigned j = 0; modes[j]; j++)
+				for (unsigned k = 0; hashes[k]; k++)
+				{
+					b.cipher = cipher ? a.cipher : cipher_id_from_name(ciphers[i]);
+					b.mode = mode ? a.mode : mode_id_from_name(modes[j]);
+					b.hash = hash ? a.hash : hash_id_from_name(hashes[k]);
+					/* fixed algorithms only go round once */
+					if ((cipher && i) || (mode && j) || (hash && k))
+						continue;
+					if (b.cipher != a.cipher || b.mode != a.mode || b.hash != a.hash)
+						bench_run(&b);
+				}
+		return EXIT_SUCCESS;
+	}
+	for (unsigned i = 0; !cipher && ciphers[i]; i++)
+	{
+		bench_args_t b = a;
+		if ((b.cipher = cipher_id_from_name(ciphers[i])) != a.cipher)
+			bench_run(&b);
+	}
+	for (unsigned i = 0; !mode && modes[i]; i++)
+	{
+		bench_args_t b = a;
+		if ((b.mode = mode_id_from_name(modes[i])) != a.mode)
+			bench_run(&b);
+	}
+	for (unsigned i = 0; !hash && hashes[i]; i++)
+	{
+		bench_args_t b = a;
+		if ((b.hash = hash_id_from_name(hashes[i])) != a.hash)
+			bench_run(&b);
+	}
+	for (unsigned i = 0; !mac && macs[i]; i++)
+	{
+		bench_args_t b = a;
+		if ((b.mac = mac_id_from_name(macs[i])) != a.mac)
+			bench_run(&b);
+	}
+	return EXIT_SUCCESS;
+}
+
+static bool bench_run(const bench_args_t * const restrict a)
+{
+	printf("\n%s / %s / %s / %s\n", cipher_name_from_id(a->cipher), mode_name_from_id(a->mode), hash_name_from_id(a->hash), mac_name_from_id(a->mac));
+	/* not every cipher can be used in every mode */
+	gcry_cipher_hd_t c;
+	gcry_mac_hd_t m;
+	if (gcry_cipher_open(&c, a->cipher, a->mode, 0))
+	{
+		printf(_("  cipher can’t be used in this mode\n"));
+		return false;
+	}
+	gcry_cipher_close(c);
+	if (gcry_mac_open(&m, a->mac, 0, NULL))
+	{
+		printf(_("  MAC isn’t available\n"));
+		return false;
+	}
+	gcry_mac_close(m);
+
+	char *image = NULL;
+	asprintf(&image, "%s/%s-XXXXXX", a->dir, BENCH_NAME);
+	int fd = mkstemp(image);
+	if (fd < 0 || ftruncate(fd, a->size))
+		die("could not create image in %s", a->dir);
+	close(fd);
+	/*
+	 * paranoid mode needs no superblock; set the version afterwards so
+	 * keys and MACs are done the same as on a file system made now
+	 */
+	if (stegfs_init(image, true, a->cipher, a->mode, a->hash, a->mac, a->duplicates, a->stripes, a->features, a->blocksize, false) != STEGFS_INIT_OKAY)
+		die("could not open image %s", image);
+	file_system.version = VERSION_202X_XX;
+	stegfs_cache_limit(UINT64_MAX, 0); /* keep everything written to be read */
+	/* like mkstegfs, start with random data */
+	bench_seed(a->seed);
+	bench_bytes(file_system.memory, file_system.size);
+
+	bool okay = bench_sanity();
+	if (okay)
+	{
+		printf("  %-21s %12s %10s %11s %11s %11s %11s\n", _("operation"), _("ops/s"), _("MB/s"), _("p50 µs"), _("p90 µs"), _("p99 µs"), _("max µs"));
+		bench_keys();
+		bench_blocks();
+		bench_assign();
+		bench_stat();
+		bench_files();
+	}
+	else
+		printf(_("  doesn’t work: a file didn’t read back as written\n"));
+
+	stegfs_deinit();
+	unlink(image);
+	free(image);
+	return okay;
+}
+
+/*
+ * write a file and read it back, so nothing is timed which doesn’t work
+ */
+static bool bench_sanity(void)
+{
+	char p[] = BENCH_PATH "/sanity:" BENCH_PASS;
+	size_t z = file_system.datasize * 3;
+	uint8_t *data = malloc(z);
+	bench_bytes(data, z);
+
+	stegfs_file_create(p, true);
+	stegfs_cache_t *c = stegfs_cache_exists(p, NULL);
+	c->file->data = malloc(z);
+	memcpy(c->file->data, data, z);
+	c->file->size = z;
+	bool okay = stegfs_file_write(c->file);
+	if (okay)
+	{
+		free(c->file->data);
+		c->file->data = NULL;
+		okay = stegfs_file_read(c->file) && c->file->size == z && !memcmp(c->file->data, data, z);
+	}
+	free(data);
+
+	stegfs_file_t file;
+	bench_file(&file, p);
+	stegfs_file_delete(&file);
+	bench_file_free(&file);
+	return okay;
+}
+
+static void bench_keys(void)
+{
+	uint64_t *t = calloc(BENCH_KEYS, sizeof( uint64_t ));
+	uint64_t *u = calloc(BENCH_KEYS, sizeof( uint64_t ));
+	uint64_t *v = calloc(BENCH_KEYS, sizeof( uint64_t ));
+	for (size_t i = 0; i < BENCH_KEYS; i++)
+	{
+		char p[PATH_MAX];
+		snprintf(p, sizeof p, "%s/key-%zu:%s", BENCH_PATH, i, BENCH_PASS);
+		stegfs_file_t file;
+		bench_file(&file, p);
+
+		uint64_t s = bench_now();
+		gcry_cipher_hd_t cipher = init_cipher(&file, 0);
+		t[i] = bench_now() - s;
+
+		s = bench_now();
+		init_iv(cipher, &file, 1);
+		u[i] = bench_now() - s;
+		gcry_cipher_close(cipher);
+
+		s = bench_now();
+		gcry_mac_hd_t mac = init_mac(&file, 0);
+		v[i] = bench_now() - s;
+		gcry_mac_close(mac);
+		bench_file_free(&file);
+	}
+	bench_report("init_cipher", t, BENCH_KEYS, 0);
+	bench_report("init_iv", u, BENCH_KEYS, 0);
+	bench_report("init_mac", v, BENCH_KEYS, 0);
+	free(t);
+	free(u);
+	free(v);
+	return;
+}
+
+/*
+ * write then read back a chain of blocks, with one handle, as a file does
+ */
+static void bench_blocks(void)
+{
+	char p[] = BENCH_PATH "/blocks:" BENCH_PASS;
+	stegfs_file_t file;
+	bench_file(&file, p);
+	gcry_cipher_hd_t cipher = init_cipher(&file, 0);
+
+	/* no more than a quarter of the file system (with large blocks) */
+	size_t n = file_system.size / file_system.blocksize / 4;
+	if (n > BENCH_BLOCKS)
+		n = BENCH_BLOCKS;
+	uint64_t *bid = calloc(n, sizeof( uint64_t ));
+	for (size_t i = 0; i < n; i++)
+		bid[i] = block_assign(&file);
+
+	uint64_t *t = calloc(n, sizeof( uint64_t ));
+	stegfs_block_t block;
+	memset(&block, 0x00, sizeof block);
+	for (size_t i = 0; i < n; i++)
+	{
+		bench_bytes(block.data, file_system.datasize);
+		block.next = htonll(i + 1 < n ? bid[i + 1] : 0);
+		uint64_t s = bench_now();
+		block_write(bid[i], &block, cipher, file.path);
+		t[i] = bench_now() - s;
+	}
+	bench_report("block_write", t, n, (uint64_t)n * file_system.datasize);
+
+	init_iv(cipher, &file, 0);
+	size_t failed = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		uint64_t s = bench_now();
+		failed += !block_read(bid[i], &block, cipher, file.path);
+		t[i] = bench_now() - s;
+	}
+	bench_report("block_read", t, n, (uint64_t)n * file_system.datasize);
+	if (failed)
+		printf(_("  %zu blocks didn’t read back\n"), failed);
+
+	gcry_cipher_close(cipher);
+	for (size_t i = 0; i < n; i++)
+		block_release(bid[i]);
+	bench_file_free(&file);
+	free(bid);
+	free(t);
+	return;
+}
+
+/*
+ * the fuller the file system, the more blocks have to be tried before
+ * one is found that’s free; the blocks which fill it are chosen from the
+ * seed, but those assigned aren’t (block_assign uses nonces)
+ */
+static void bench_assign(void)
+{
+	char p[] = BENCH_PATH "/assign:" BENCH_PASS;
+	stegfs_file_t file;
+	bench_file(&file, p);
+	uint64_t total = file_system.size / file_system.blocksize;
+	uint64_t *fill = calloc(total, sizeof( uint64_t ));
+	uint64_t *t = calloc(BENCH_ASSIGN, sizeof( uint64_t ));
+	uint64_t filled = 0;
+	for (size_t l = 0; l < sizeof FILL_LEVELS / sizeof FILL_LEVELS[0]; l++)
+	{
+		while (blocks_used < total * FILL_LEVELS[l] / 100)
+		{
+			uint64_t b = bench_random() % total;
+			if (b && block_claim(b, NULL))
+				fill[filled++] = b;
+		}
+		size_t failed = 0;
+		for (size_t i = 0; i < BENCH_ASSIGN; i++)
+		{
+			uint64_t s = bench_now();
+			uint64_t b = block_assign(&file);
+			t[i] = bench_now() - s;
+			if (b)
+				block_release(b);
+			else
+				failed++;
+		}
+		char name[32];
+		snprintf(name, sizeof name, "block_assign %u%%", FILL_LEVELS[l]);
+		bench_report(name, t, BENCH_ASSIGN, 0);
+		if (failed)
+			printf(_("  %zu blocks couldn’t be assigned\n"), failed);
+	}
+	for (uint64_t i = 0; i < filled; i++)
+		block_release(fill[i]);
+	bench_file_free(&file);
+	free(fill);
+	free(t);
+	return;
+}
+
+/*
+ * a full stat of a file which isn’t cached, as when it’s first opened,
+ * and the inode only stat used to list a directory
+ */
+static void bench_stat(void)
+{
+	char p[PATH_MAX];
+	for (size_t i = 0; i < BENCH_FILES; i++)
+	{
+		snprintf(p, sizeof p, "%s/stat-%zu:%s", BENCH_PATH, i, BENCH_PASS);
+		stegfs_file_create(p, true);
+		stegfs_cache_t *c = stegfs_cache_exists(p, NULL);
+		c->file->data = malloc(BENCH_STAT);
+		bench_bytes(c->file->data, BENCH_STAT);
+		c->file->size = BENCH_STAT;
+		stegfs_file_write(c->file);
+	}
+
+	uint64_t *t = calloc(BENCH_FILES, sizeof( uint64_t ));
+	uint64_t *u = calloc(BENCH_FILES, sizeof( uint64_t ));
+	for (size_t i = 0; i < BENCH_FILES; i++)
+	{
+		snprintf(p, sizeof p, "%s/stat-%zu:%s", BENCH_PATH, i, BENCH_PASS);
+		stegfs_file_t file;
+		bench_file(&file, p);
+		uint64_t s = bench_now();
+		stegfs_file_stat(&file);
+		t[i] = bench_now() - s;
+		bench_file_free(&file);
+
+		bench_file(&file, p);
+		s = bench_now();
+		stegfs_file_stat_meta(&file);
+		u[i] = bench_now() - s;
+		bench_file_free(&file);
+	}
+	bench_report("stegfs_file_stat", t, BENCH_FILES, 0);
+	bench_report("stegfs_file_stat_meta", u, BENCH_FILES, 0);
+
+	for (size_t i = 0; i < BENCH_FILES; i++)
+	{
+		snprintf(p, sizeof p, "%s/stat-%zu:%s", BENCH_PATH, i, BENCH_PASS);
+		stegfs_file_t file;
+		bench_file(&file, p);
+		stegfs_file_delete(&file);
+		bench_file_free(&file);
+	}
+	free(t);
+	free(u);
+	return;
+}
+
+/*
+ * whole files written then read; the plaintext is dropped before each read
+ * so it has to come from the blocks
+ */
+static void bench_files(void)
+{
+	char p[PATH_MAX];
+	for (size_t f = 0; f < sizeof FILE_SIZES / sizeof FILE_SIZES[0]; f++)
+	{
+		uint64_t z = FILE_SIZES[f].size;
+		size_t n = FILE_SIZES[f].count;
+		/* leave plenty of room, as blocks are placed at random */
+		if (file_blocks(z) * file_system.copies * n * 2 > file_system.size / file_system.blocksize)
+		{
+			printf(_("  image too small for %zu files of %" PRIu64 " KB\n"), n, z / KILOBYTE);
+			continue;
+		}
+		uint64_t *t = calloc(n, sizeof( uint64_t ));
+		uint8_t *first = malloc(z);
+		size_t failed = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			snprintf(p, sizeof p, "%s/file-%" PRIu64 "-%zu:%s", BENCH_PATH, z, i, BENCH_PASS);
+			stegfs_file_create(p, true);
+			stegfs_cache_t *c = stegfs_cache_exists(p, NULL);
+			c->file->data = malloc(z);
+			bench_bytes(c->file->data, z);
+			if (!i)
+				memcpy(first, c->file->data, z);
+			c->file->size = z;
+			uint64_t s = bench_now();
+			failed += !stegfs_file_write(c->file);
+			t[i] = bench_now() - s;
+		}
+		char name[32];
+		snprintf(name, sizeof name, "write %" PRIu64 " KB", z / KILOBYTE);
+		bench_report(name, t, n, z * n);
+		if (failed)
+			printf(_("  %zu files couldn’t be written\n"), failed);
+
+		failed = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			snprintf(p, sizeof p, "%s/file-%" PRIu64 "-%zu:%s", BENCH_PATH, z, i, BENCH_PASS);
+			stegfs_cache_t *c = stegfs_cache_exists(p, NULL);
+			stegfs_cache_open(c, BENCH_PASS);
+			free(c->file->data);
+			c->file->data = NULL;
+			uint64_t s = bench_now();
+			bool read = stegfs_file_read(c->file);
+			t[i] = bench_now() - s;
+			failed += !read || (!i && memcmp(c->file->data, first, z));
+			stegfs_cache_close(c);
+		}
+		snprintf(name, sizeof name, "read %" PRIu64 " KB", z / KILOBYTE);
+		bench_report(name, t, n, z * n);
+		if (failed)
+			printf(_("  %zu files didn’t read back\n"), failed);
+
+		/* make room for the next size */
+		for (size_t i = 0; i < n; i++)
+		{
+			snprintf(p, sizeof p, "%s/file-%" PRIu64 "-%zu:%s", BENCH_PATH, z, i, BENCH_PASS);
+			stegfs_file_t file;
+			bench_file(&file, p);
+			stegfs_file_delete(&file);
+			bench_file_free(&file);
+		}
+		free(first);
+		free(t);
+	}
+	return;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/*
+ * splitmix64: not for anything secret, but the same seed always gives the
+ * same image and file contents
+ */
+static void bench_seed(uint64_t seed)
+{
+	random_state = seed;
+	return;
+}
+
+static uint64_t bench_random(void)
+{
+	uint64_t z = (random_state += 0x9e3779b97f4a7c15llu);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9llu;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebllu;
+	return z ^ (z >> 31);
+}
+
+static void bench_bytes(uint8_t *b, size_t z)
+{
+	for (size_t i = 0; i < z; i += sizeof( uint64_t ))
+	{
+		uint64_t r = bench_random();
+		memcpy(b + i, &r, z - i < sizeof r ? z - i : sizeof r);
+	}
+	return;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * print the rate and latency percentiles of n operations (which between
+ * them handled z bytes, if any); the times are sorted in place
+ */
+static void bench_report(const char * const restrict name, uint64_t *t, size_t n, uint64_t z)
+{
+	if (!n)
+		return;
+	uint64_t total = 0;
+	for (size_t i = 0; i < n; i++)
+		total += t[i];
+	qsort(t, n, sizeof( uint64_t ), bench_compare);
+	double seconds = total ? total / 1e9 : 1e-9;
+	char rate[16] = "-";
+	if (z)
+		snprintf(rate, sizeof rate, "%.2f", z / seconds / MEGABYTE);
+	printf("  %-21s %12.1f %10s %10.1f %10.1f %10.1f %10.1f\n", name, n / seconds, rate,
+			t[(n - 1) * 50 / 100] / 1e3, t[(n - 1) * 90 / 100] / 1e3, t[(n - 1) * 99 / 100] / 1e3, t[n - 1] / 1e3);
+	return;
+}
+
+/*
+ * fill in a file from /path/file:password, as the FUSE operations do
+ */
+static void bench_file(stegfs_file_t *file, const char * const restrict p)
+{
+	memset(file, 0x00, sizeof( stegfs_file_t ));
+	const char *s = strrchr(p, PASSWORD_SEPARATOR);
+	const char *n = strrchr(p, DIR_SEPARATOR_CHAR);
+	file->path = strndup(p, n - p);
+	file->name = strndup(n + 1, s - n - 1);
+	file->pass = strdup(s + 1);
+	return;
+}
+
+static void bench_file_free(stegfs_file_t *file)
+{
+	stegfs_file_release(file);
+	free(file->path);
+	free(file->name);
+	free(file->pass);
+	return;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, _("Usage:\n"));
+	fprintf(stderr, _("  %s [options]\n"), BENCH_NAME);
+	return;
+}
+
+static void print_help(void)
+{
+	print_usage();
+	fprintf(stderr, "\n");
+	fprintf(stderr, _("Time the file system’s key, block and file functions on a throw-away\n"));
+	fprintf(stderr, _("image; by default each cipher, mode, hash and MAC in turn (any which\n"));
+	fprintf(stderr, _("are given stay fixed). File and image contents come from the seed, but\n"));
+	fprintf(stderr, _("where blocks are placed doesn’t, just as it doesn’t when mounted.\n"));
+	fprintf(stderr, "\n");
+	fprintf(stderr, _("Options:\n"));
+	fprintf(stderr, _("  -h, --help                 Display this message\n"));
+	fprintf(stderr, _("  -c, --cipher=<algorithm>   Only this cipher\n"));
+	fprintf(stderr, _("  -m, --mode=<mode>          Only this encryption mode\n"));
+	fprintf(stderr, _("  -s, --hash=<algorithm>     Only this hash\n"));
+	fprintf(stderr, _("  -a, --mac=<mac>            Only this MAC\n"));
+	fprintf(stderr, _("  -A, --all                  Every combination of cipher, mode and hash\n"));
+	fprintf(stderr, _("                             (this takes hours)\n"));
+	fprintf(stderr, _("  -x, --duplicates=<#>       Number of times each file is duplicated\n"));
+	fprintf(stderr, _("  -k, --stripes=<#>          Split each file across this many of the duplicates\n"));
+	fprintf(stderr, _("  -B, --block-size=<#>       The block size (a power of 2)\n"));
+	fprintf(stderr, _("  -i, --index                Keep block lists in index blocks\n"));
+	fprintf(stderr, _("  -e, --ecc                  Add error correcting parity to each block\n"));
+	fprintf(stderr, _("  -Z, --compress             Compress file data\n"));
+	fprintf(stderr, _("  -z, --size=<MB>            Size of the image (default %d)\n"), BENCH_SIZE);
+	fprintf(stderr, _("  -S, --seed=<#>             Seed for the image and file contents\n"));
+	fprintf(stderr, _("  -t, --directory=<dir>      Where to make the image (default /dev/shm)\n"));
+	return;
+}
+
+/*
+ * the value of an option, given as either -o value or --option=value
+ */
+static char *extract_option(int argc, char **argv, int *i, const char * const restrict s, const char * const restrict l)
+{
+	if (!strcmp(s, argv[*i]))
+		return *i + 1 < argc ? strdup(argv[++(*i)]) : NULL;
+	size_t z = strlen(l);
+	if (!strncmp(l, argv[*i], z) && argv[*i][z] == '=')
+		return strdup(argv[*i] + z + 1);
+	return NULL;
+}
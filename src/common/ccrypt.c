@@ -24,6 +24,9 @@
 #include <stdbool.h>
 
 #include <gcrypt.h>
+#if GCRYPT_VERSION_NUMBER < 0x010600
+	#include <pthread.h>
+#endif
 
 #include "common.h"
 #include "non-gnu.h"
@@ -39,6 +42,10 @@ static const char *correct_twofish256(const char * const restrict);
 
 static bool algorithm_is_duplicate(const char * const restrict);
 
+#if GCRYPT_VERSION_NUMBER < 0x010600
+/* older versions of libgcrypt need to be told how to lock between threads */
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+#endif
 
 typedef struct
 {
@@ -65,6 +72,9 @@ extern void init_crypto(void)
 	/*
 	 * initialise GNU Crypt library
 	 */
+#if GCRYPT_VERSION_NUMBER < 0x010600
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+#endif
 	if (!gcry_check_version(GCRYPT_VERSION))
 		die(_("Could not find GNU Crypt library"));
 	gcry_control(GCRYCTL_SUSPEND_SECMEM_WARN);
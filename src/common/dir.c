@@ -82,3 +82,31 @@ extern char *dir_get_path(const char * const restrict path)
 	free(p);
 	return strdup(DIR_SEPARATOR);
 }
+
+extern bool dir_view(dir_view_t *view, const char * const path, const char ext)
+{
+	size_t length = strlen(path);
+	if (length > UINT16_MAX)
+		return false;
+	view->path = path;
+	view->parts = 0;
+	const char *last = NULL;
+	for (const char *ptr = path; (ptr = strchr(ptr, DIR_SEPARATOR_CHAR)); )
+	{
+		if (view->parts == DIR_VIEW_DEPTH)
+			return false;
+		last = ptr++;
+		view->part[view->parts].offset = ptr - path;
+		view->part[view->parts].length = strchrnul(ptr, DIR_SEPARATOR_CHAR) - ptr;
+		view->parts++;
+	}
+	const char *file = last ? last + 1 : path;
+	view->dir.offset = 0;
+	view->dir.length = !last ? 0 : (last == path ? 1 : last - path);
+	const char *pass = ext ? strrchr(file, ext) : NULL;
+	view->name.offset = file - path;
+	view->name.length = (pass ? pass : path + length) - file;
+	view->pass.offset = pass ? (size_t)(pass + 1 - path) : length;
+	view->pass.length = pass ? path + length - pass - 1 : 0;
+	return true;
+}
@@ -26,14 +26,15 @@
  * \author  albinoloverats ~ Software Development
  * \date    2009-2020
  * \brief   Directory parsing functions
- * \note    These functions all return newly allocated strings
+ * \note    The dir_get_ functions all return newly allocated strings
  *
  * Collection of functions to parse directory hierarchies and extract the
  * names of each leaf along the tree, from the root all the way to the file
- * name and password
+ * name and password; dir_view does the same without allocating anything
  */
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 #include "common.h"
 
@@ -45,6 +46,8 @@
 	#define DIR_SEPARATOR_CHAR '\\'
 #endif
 
+#define DIR_VIEW_DEPTH 128 /*!< Deepest path dir_view can tokenise */
+
 #define path_equals(X, Y)       (X && Y && !strcmp(X, Y))
 #define path_starts_with(X, Y)  (X && Y && !strncmp(X, Y, strlen(X)))
 
@@ -55,6 +58,50 @@
 #define dir_get_name_2(A, B)  dir_get_name_aux(A, B)
 #define dir_get_name(...) CONCAT(dir_get_name_, DIR_GET_NAME_ARGS_COUNT(__VA_ARGS__))(__VA_ARGS__)
 
+#define dir_span_ptr(V, S)   ((V)->path + (S).offset)
+#define dir_span_dupa(V, S)  strndupa(dir_span_ptr(V, S), (S).length)
+
+/*!
+ * \brief  Where one element of a path is, without copying it
+ */
+typedef struct
+{
+	uint16_t offset; /*!< Offset from the start of the path */
+	uint16_t length; /*!< Length of the element */
+}
+dir_span_t;
+
+/*!
+ * \brief  A tokenised view of a path
+ *
+ * The spans index into the original path, which must outlive the view.
+ * Element n is the same as dir_get_part(path, n + 1); the directory,
+ * name and password spans match dir_get_path, dir_get_name and
+ * dir_get_pass.
+ */
+typedef struct
+{
+	const char *path;                 /*!< The path being viewed */
+	uint16_t    parts;                /*!< Number of elements (dir_get_deep) */
+	dir_span_t  part[DIR_VIEW_DEPTH]; /*!< Each element, from the root down */
+	dir_span_t  dir;                  /*!< The path less the name */
+	dir_span_t  name;                 /*!< The name less the password */
+	dir_span_t  pass;                 /*!< The password (empty if none) */
+}
+dir_view_t;
+
+/*!
+ * \brief         Tokenise /path/file:password in a single pass
+ * \param[out] v  The view to fill in
+ * \param[in]  p  Path: /path/file:password
+ * \param[in]  e  Password separator
+ * \return        False if the path is too deep or too long to view
+ *
+ * Split the path into spans without allocating any memory; use
+ * dir_span_ptr to find an element or dir_span_dupa for a (stack) copy
+ */
+extern bool dir_view(dir_view_t *v, const char * const p, const char e) __attribute__((nonnull(1, 2)));
+
 /*!
  * \brief         Extract the name part of the /path/file:password
  * \param[in]  p  Path: /path/file.extension
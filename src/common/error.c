@@ -77,11 +77,9 @@ extern void die(const char * const restrict s, ...)
 		char **sym = backtrace_symbols(bt, c);
 		if (sym)
 		{
+			/* the strings are part of the same allocation */
 			for (int i = 0; i < c; i++)
-			{
 				fprintf(stderr, "%s\n", sym[i]);
-				free(sym[i]);
-			}
 			free(sym);
 		}
 #endif
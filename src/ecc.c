@@ -0,0 +1,407 @@
+/*
+ * stegfs ~ a steganographic file system for unix-like systems
+ * Copyright © 2007-2020, albinoloverats ~ Software Development
+ * email: stegfs@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define ECC_X86
+#endif
+
+#include "ecc.h"
+
+#define GF_POLY 0x11D /* x⁸ + x⁴ + x³ + x² + 1 */
+
+static void gf_madd_scalar(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t);
+#ifdef ECC_X86
+static void gf_madd_ssse3(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t);
+static void gf_madd_avx2(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t);
+#endif
+static bool ecc_correct_one(uint8_t *, size_t, size_t, const uint8_t *, unsigned *);
+static uint8_t gf_inv(uint8_t);
+static uint8_t gf_cauchy(unsigned, unsigned, unsigned);
+
+static uint8_t gf_exp[2 * ECC_STRIDE];
+static uint8_t gf_log[ECC_STRIDE];
+static uint8_t gf_mul[ECC_STRIDE][ECC_STRIDE];
+/* products with each of the low and high nibbles, for the vector kernels */
+static uint8_t gf_nibble[ECC_STRIDE][2][16] __attribute__((aligned(16)));
+/* the generator polynomial (roots α⁰ to α⁵), without its leading 1 */
+static uint8_t gf_gen[ECC_PARITY];
+
+/*
+ * dst = a × c + b, over as many codewords as there are bytes; dst may be
+ * either a or b
+ */
+static void (*gf_madd)(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t) = gf_madd_scalar;
+
+/*
+ * blocks smaller than 4KB have fewer codewords than fit in a vector, and
+ * the table lookups are quicker
+ */
+#define gf_kernel(N) ((N) < 16 ? gf_madd_scalar : gf_madd)
+
+extern void ecc_init(void)
+{
+	if (gf_exp[0])
+		return;
+	for (unsigned i = 0, x = 1; i < ECC_SYMBOLS; i++)
+	{
+		gf_exp[i] = gf_exp[i + ECC_SYMBOLS] = x;
+		gf_log[x] = i;
+		if ((x <<= 1) & ECC_STRIDE)
+			x ^= GF_POLY;
+	}
+	for (unsigned a = 1; a < ECC_STRIDE; a++)
+		for (unsigned b = 1; b < ECC_STRIDE; b++)
+			gf_mul[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+	for (unsigned c = 0; c < ECC_STRIDE; c++)
+		for (unsigned i = 0; i < 16; i++)
+		{
+			gf_nibble[c][0][i] = gf_mul[c][i];
+			gf_nibble[c][1][i] = gf_mul[c][i << 4];
+		}
+	/* multiply out (x - α⁰)(x - α¹)…(x - α⁵), highest power first */
+	uint8_t g[ECC_PARITY + 1] = { 1 };
+	for (unsigned i = 0; i < ECC_PARITY; i++)
+		for (unsigned j = i + 1; j > 0; j--)
+			g[j] ^= gf_mul[g[j - 1]][gf_exp[i]];
+	memcpy(gf_gen, g + 1, sizeof gf_gen);
+#ifdef ECC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		gf_madd = gf_madd_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		gf_madd = gf_madd_ssse3;
+#endif
+	return;
+}
+
+/*
+ * NB byte k × n + c of a block is symbol k of codeword c, so symbol k of
+ * every codeword is a run of n bytes, and each step of the encoder (and
+ * of computing syndromes) is one call to the kernel
+ */
+extern void ecc_encode(uint8_t *block, size_t z)
+{
+	size_t n = z / ECC_STRIDE;
+	void (*madd)(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t) = gf_kernel(n);
+	uint8_t reg[ECC_PARITY][ECC_STRIDE];
+	uint8_t fb[ECC_STRIDE];
+	memset(reg, 0x00, sizeof reg);
+	/* the registers are a ring; h is the one holding the highest power */
+	for (unsigned k = 0, h = 0; k < ECC_DATA; k++, h = (h + 1) % ECC_PARITY)
+	{
+		const uint8_t *m = block + k * n;
+		for (size_t c = 0; c < n; c++)
+			fb[c] = m[c] ^ reg[h][c];
+		for (unsigned j = 0; j < ECC_PARITY - 1; j++)
+		{
+			uint8_t *r = reg[(h + 1 + j) % ECC_PARITY];
+			madd(r, fb, gf_gen[j], r, n);
+		}
+		memset(reg[h], 0x00, n);
+		madd(reg[h], fb, gf_gen[ECC_PARITY - 1], reg[h], n);
+	}
+	/* after ECC_DATA steps the ring is back where it started */
+	for (unsigned j = 0; j < ECC_PARITY; j++)
+		memcpy(block + (ECC_DATA + j) * n, reg[(ECC_DATA + j) % ECC_PARITY], n);
+	return;
+}
+
+static void ecc_syndromes(const uint8_t * const restrict block, size_t n, uint8_t s[ECC_PARITY][ECC_STRIDE])
+{
+	void (*madd)(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t) = gf_kernel(n);
+	memset(s, 0x00, ECC_PARITY * ECC_STRIDE);
+	for (unsigned k = 0; k < ECC_SYMBOLS; k++)
+		for (unsigned i = 0; i < ECC_PARITY; i++)
+			madd(s[i], s[i], gf_exp[i], block + k * n, n);
+	return;
+}
+
+extern bool ecc_check(const uint8_t * const restrict block, size_t z)
+{
+	size_t n = z / ECC_STRIDE;
+	uint8_t s[ECC_PARITY][ECC_STRIDE];
+	ecc_syndromes(block, n, s);
+	for (unsigned i = 0; i < ECC_PARITY; i++)
+		for (size_t c = 0; c < n; c++)
+			if (s[i][c])
+				return false;
+	return true;
+}
+
+extern int ecc_correct(uint8_t *block, size_t z)
+{
+	size_t n = z / ECC_STRIDE;
+	uint8_t s[ECC_PARITY][ECC_STRIDE];
+	ecc_syndromes(block, n, s);
+	unsigned fixed = 0;
+	bool failed = false;
+	for (size_t c = 0; c < n; c++)
+	{
+		uint8_t t[ECC_PARITY];
+		bool clean = true;
+		for (unsigned i = 0; i < ECC_PARITY; i++)
+			if ((t[i] = s[i][c]))
+				clean = false;
+		if (!clean && !ecc_correct_one(block, n, c, t, &fixed))
+			failed = true;
+	}
+	return failed ? -1 : (int)fixed;
+}
+
+/*
+ * correct one codeword from its syndromes: Berlekamp-Massey finds the
+ * error locator, a Chien search its roots, and Forney the values
+ */
+static bool ecc_correct_one(uint8_t *block, size_t n, size_t c, const uint8_t *s, unsigned *fixed)
+{
+	uint8_t lambda[ECC_PARITY + 1] = { 1 };
+	uint8_t prev[ECC_PARITY + 1] = { 1 };
+	unsigned l = 0;
+	unsigned m = 1;
+	uint8_t b = 1;
+	for (unsigned r = 0; r < ECC_PARITY; r++)
+	{
+		uint8_t d = s[r];
+		for (unsigned i = 1; i <= l; i++)
+			d ^= gf_mul[lambda[i]][s[r - i]];
+		if (!d)
+		{
+			m++;
+			continue;
+		}
+		uint8_t f = gf_exp[gf_log[d] + ECC_SYMBOLS - gf_log[b]];
+		uint8_t t[ECC_PARITY + 1];
+		memcpy(t, lambda, sizeof t);
+		for (unsigned i = 0; i + m <= ECC_PARITY; i++)
+			lambda[i + m] ^= gf_mul[f][prev[i]];
+		if (2 * l <= r)
+		{
+			l = r + 1 - l;
+			memcpy(prev, t, sizeof prev);
+			b = d;
+			m = 1;
+		}
+		else
+			m++;
+	}
+	if (l > ECC_PARITY / 2)
+		return false;
+
+	/* Ω(x) = S(x)Λ(x) mod x⁶ */
+	uint8_t omega[ECC_PARITY] = { 0 };
+	for (unsigned i = 0; i < ECC_PARITY; i++)
+		for (unsigned j = 0; j <= i && j <= l; j++)
+			omega[i] ^= gf_mul[lambda[j]][s[i - j]];
+
+	unsigned pos[ECC_PARITY / 2];
+	uint8_t val[ECC_PARITY / 2];
+	unsigned found = 0;
+	for (unsigned k = 0; k < ECC_SYMBOLS; k++)
+	{
+		/* symbol k is the coefficient of x^e, so X = αᵉ */
+		unsigned e = ECC_SYMBOLS - 1 - k;
+		unsigned inv = (ECC_SYMBOLS - e) % ECC_SYMBOLS;
+		uint8_t sum = 0;
+		for (unsigned i = 0; i <= l; i++)
+			sum ^= gf_mul[lambda[i]][gf_exp[(inv * i) % ECC_SYMBOLS]];
+		if (sum)
+			continue;
+		if (found == l)
+			return false;
+		uint8_t num = 0;
+		for (unsigned i = 0; i < ECC_PARITY; i++)
+			num ^= gf_mul[omega[i]][gf_exp[(inv * i) % ECC_SYMBOLS]];
+		/* Λ′(x) only has the odd powers of Λ(x) */
+		uint8_t den = 0;
+		for (unsigned i = 1; i <= l; i += 2)
+			den ^= gf_mul[lambda[i]][gf_exp[(inv * (i - 1)) % ECC_SYMBOLS]];
+		if (!den)
+			return false;
+		pos[found] = k;
+		val[found] = num ? gf_mul[gf_exp[e]][gf_exp[gf_log[num] + ECC_SYMBOLS - gf_log[den]]] : 0;
+		found++;
+	}
+	if (found != l)
+		return false;
+	for (unsigned i = 0; i < found; i++)
+		block[pos[i] * n + c] ^= val[i];
+	*fixed += found;
+	return true;
+}
+
+/*
+ * parity stripe i is the sum of each data stripe j times 1 / (xᵢ + yⱼ),
+ * with xᵢ = k + i and yⱼ = j all different; every square matrix taken from
+ * the rows of the identity (for the data stripes) and these is invertible
+ */
+extern void ecc_stripe_encode(uint8_t *p, const uint8_t * const *d, unsigned k, unsigned i, size_t z)
+{
+	void (*madd)(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t) = gf_kernel(z);
+	memset(p, 0x00, z);
+	for (unsigned j = 0; j < k; j++)
+		madd(p, d[j], gf_cauchy(k, i, j), p, z);
+	return;
+}
+
+extern bool ecc_stripe_decode(uint8_t **s, unsigned k, unsigned m, uint64_t h, size_t z)
+{
+	void (*madd)(uint8_t *, const uint8_t *, uint8_t, const uint8_t *, size_t) = gf_kernel(z);
+	uint64_t data = k < ECC_STRIPES_MAX ? (UINT64_C(1) << k) - 1 : UINT64_MAX;
+	if ((h & data) == data)
+		return true;
+	/* the first k stripes which can be used, data before parity */
+	unsigned use[ECC_STRIPES_MAX];
+	unsigned n = 0;
+	for (unsigned i = 0; i < k + m && n < k; i++)
+		if (h & (UINT64_C(1) << i))
+			use[n++] = i;
+	if (n < k)
+		return false;
+	/* invert the rows of the encoding matrix for those stripes */
+	uint8_t a[ECC_STRIPES_MAX][ECC_STRIPES_MAX];
+	uint8_t b[ECC_STRIPES_MAX][ECC_STRIPES_MAX];
+	memset(b, 0x00, sizeof b);
+	for (unsigned r = 0; r < k; r++)
+	{
+		for (unsigned j = 0; j < k; j++)
+			a[r][j] = use[r] < k ? use[r] == j : gf_cauchy(k, use[r] - k, j);
+		b[r][r] = 1;
+	}
+	for (unsigned c = 0; c < k; c++)
+	{
+		unsigned r = c;
+		while (!a[r][c])
+			r++;
+		if (r != c)
+			for (unsigned j = 0; j < k; j++)
+			{
+				uint8_t t = a[r][j];
+				a[r][j] = a[c][j];
+				a[c][j] = t;
+				t = b[r][j];
+				b[r][j] = b[c][j];
+				b[c][j] = t;
+			}
+		uint8_t f = gf_inv(a[c][c]);
+		for (unsigned j = 0; j < k; j++)
+		{
+			a[c][j] = gf_mul[f][a[c][j]];
+			b[c][j] = gf_mul[f][b[c][j]];
+		}
+		for (r = 0; r < k; r++)
+			if (r != c && a[r][c])
+			{
+				f = a[r][c];
+				for (unsigned j = 0; j < k; j++)
+				{
+					a[r][j] ^= gf_mul[f][a[c][j]];
+					b[r][j] ^= gf_mul[f][b[c][j]];
+				}
+			}
+	}
+	/* each missing data stripe is then a sum of the ones being used */
+	for (unsigned i = 0; i < k; i++)
+	{
+		if (h & (UINT64_C(1) << i))
+			continue;
+		memset(s[i], 0x00, z);
+		for (unsigned r = 0; r < k; r++)
+			if (b[i][r])
+				madd(s[i], s[use[r]], b[i][r], s[i], z);
+	}
+	return true;
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[ECC_SYMBOLS - gf_log[a]];
+}
+
+static uint8_t gf_cauchy(unsigned k, unsigned i, unsigned j)
+{
+	return gf_inv((k + i) ^ j);
+}
+
+static void gf_madd_scalar(uint8_t *dst, const uint8_t *a, uint8_t c, const uint8_t *b, size_t n)
+{
+	const uint8_t *row = gf_mul[c];
+	for (size_t i = 0; i < n; i++)
+		dst[i] = row[a[i]] ^ b[i];
+	return;
+}
+
+#ifdef ECC_X86
+/*
+ * a product in GF(2⁸) is the sum of the products with each nibble, so
+ * two 16 entry tables (and a byte shuffle) multiply a whole vector
+ */
+__attribute__((target("ssse3")))
+static void gf_madd_ssse3(uint8_t *dst, const uint8_t *a, uint8_t c, const uint8_t *b, size_t n)
+{
+	const __m128i lo = _mm_load_si128((const __m128i *)gf_nibble[c][0]);
+	const __m128i hi = _mm_load_si128((const __m128i *)gf_nibble[c][1]);
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	size_t i = 0;
+	for (; i + sizeof( __m128i ) <= n; i += sizeof( __m128i ))
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+				_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(y, _mm_loadu_si128((const __m128i *)(b + i))));
+	}
+	gf_madd_scalar(dst + i, a + i, c, b + i, n - i);
+	return;
+}
+
+__attribute__((target("avx2")))
+static void gf_madd_avx2(uint8_t *dst, const uint8_t *a, uint8_t c, const uint8_t *b, size_t n)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf_nibble[c][0]));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf_nibble[c][1]));
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	size_t i = 0;
+	for (; i + sizeof( __m256i ) <= n; i += sizeof( __m256i ))
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+				_mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(y, _mm256_loadu_si256((const __m256i *)(b + i))));
+	}
+	/*
+	 * finish with the same instructions as the SSSE3 kernel, but inline
+	 * (switching between AVX and SSE encodings is costly)
+	 */
+	if (i + sizeof( __m128i ) <= n)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_xor_si128(_mm_shuffle_epi8(_mm256_castsi256_si128(lo), _mm_and_si128(x, _mm256_castsi256_si128(mask))),
+				_mm_shuffle_epi8(_mm256_castsi256_si128(hi), _mm_and_si128(_mm_srli_epi64(x, 4), _mm256_castsi256_si128(mask))));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(y, _mm_loadu_si128((const __m128i *)(b + i))));
+		i += sizeof( __m128i );
+	}
+	gf_madd_scalar(dst + i, a + i, c, b + i, n - i);
+	return;
+}
+#endif
@@ -0,0 +1,114 @@
+/*
+ * stegfs ~ a steganographic file system for unix-like systems
+ * Copyright © 2007-2020, albinoloverats ~ Software Development
+ * email: stegfs@albinoloverats.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _STEGFS_ECC_H_
+#define _STEGFS_ECC_H_
+
+/*!
+ * \file    ecc.h
+ * \author  albinoloverats ~ Software Development
+ * \date    2020
+ * \brief   Reed-Solomon error correction of file system blocks
+ *
+ * Each block is split in to one RS(255,249) codeword per 256 bytes. The
+ * codewords are interleaved byte by byte, so the data they protect is
+ * kept together at the start of the block (and a run of damaged bytes is
+ * shared between codewords); the parity follows it, and the last byte of
+ * every 256 is unused.
+ *
+ * The same field also gives the parity stripes of striped files: each is
+ * a different sum of multiples of the data stripes (a Cauchy matrix), so
+ * any k of the k data and m parity stripes are enough to rebuild the
+ * rest.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ECC_SYMBOLS 0xFF /*!< Bytes in a codeword */
+#define ECC_PARITY  0x06 /*!< Parity bytes in a codeword (corrects 3 bytes) */
+#define ECC_DATA    (ECC_SYMBOLS - ECC_PARITY) /*!< Data bytes in a codeword */
+#define ECC_STRIDE  0x0100 /*!< Bytes of block per codeword */
+
+#define ECC_PAYLOAD(Z) ((Z) / ECC_STRIDE * ECC_DATA) /*!< Bytes of a block which are protected */
+
+#define ECC_STRIPES_MAX 0x40 /*!< Most stripes (data and parity) in a row */
+
+/*!
+ * \brief         Build the Galois field tables and pick the fastest kernel
+ *
+ * Must be called before any other ecc_ function; calling it again does
+ * nothing.
+ */
+extern void ecc_init(void);
+
+/*!
+ * \brief         Compute the parity of a block
+ * \param[in]  b  The block
+ * \param[in]  z  The size of the block (a multiple of ECC_STRIDE)
+ *
+ * Write the parity of the first ECC_PAYLOAD(z) bytes of the block
+ * straight after them.
+ */
+extern void ecc_encode(uint8_t *b, size_t z);
+
+/*!
+ * \brief         Check whether a block is undamaged
+ * \param[in]  b  The block
+ * \param[in]  z  The size of the block
+ * \returns       Whether the data and parity agree
+ */
+extern bool ecc_check(const uint8_t * const restrict b, size_t z);
+
+/*!
+ * \brief         Correct the damaged bytes of a block
+ * \param[in]  b  The block
+ * \param[in]  z  The size of the block
+ * \returns       The number of bytes corrected, or -1 if any codeword had
+ *                too many to correct (the others are still corrected)
+ */
+extern int ecc_correct(uint8_t *b, size_t z);
+
+/*!
+ * \brief         Compute a parity stripe
+ * \param[out] p  The parity stripe
+ * \param[in]  d  The data stripes
+ * \param[in]  k  The number of data stripes
+ * \param[in]  i  Which parity stripe (from 0)
+ * \param[in]  z  The length of each stripe
+ */
+extern void ecc_stripe_encode(uint8_t *p, const uint8_t * const *d, unsigned k, unsigned i, size_t z);
+
+/*!
+ * \brief         Rebuild the missing data stripes of a row
+ * \param[in]  s  The data stripes followed by the parity stripes
+ * \param[in]  k  The number of data stripes
+ * \param[in]  m  The number of parity stripes
+ * \param[in]  h  Which stripes can be used (bit i for stripe i)
+ * \param[in]  z  The length of each stripe
+ * \returns       Whether there were enough stripes
+ *
+ * The data stripes which can't be used are overwritten with what they
+ * should be; at most ECC_STRIPES_MAX stripes in all.
+ */
+extern bool ecc_stripe_decode(uint8_t **s, unsigned k, unsigned m, uint64_t h, size_t z);
+
+#endif /* _STEGFS_ECC_H_ */
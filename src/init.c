@@ -50,7 +50,7 @@ extern args_t init(int argc, char **argv, char **fuse)
 		exit(EXIT_FAILURE);
 	}
 
-	args_t a = { NULL, NULL, DEFAULT_CIPHER, DEFAULT_MODE, DEFAULT_HASH, DEFAULT_MAC, COPIES_DEFAULT, 0, false, false, false, false, false, false };
+	args_t a = { NULL, NULL, DEFAULT_CIPHER, DEFAULT_MODE, DEFAULT_HASH, DEFAULT_MAC, COPIES_DEFAULT, 1, FEATURE_NONE, SIZE_BYTE_BLOCK, 0, CACHE_BUDGET_DEFAULT, CACHE_TTL_DEFAULT, false, false, false, false, false, false };
 	/*
 	 * parse commandline arguments
 	 */
@@ -130,8 +130,50 @@ extern args_t init(int argc, char **argv, char **fuse)
 			if (a.duplicates <= 0 || a.duplicates > COPIES_MAX)
 				die("unsupported value for file duplication %d", a.duplicates);
 		}
+		else if (!strncmp("--stripes", argv[i], 9) || !strcmp("-k", argv[i]))
+		{
+			char *s = strchr(argv[i], '=');
+			s = s ? s + 1 : argv[(++i)];
+			if ((a.stripes = strtol(s, NULL, 0)) <= 0)
+				die("unsupported number of stripes %s", s);
+		}
+		else if (!strcmp("--index", argv[i]) || !strcmp("-i", argv[i]))
+			a.features |= FEATURE_INDEX;
+		else if (!strcmp("--ecc", argv[i]) || !strcmp("-e", argv[i]))
+			a.features |= FEATURE_ECC;
+		else if (!strcmp("--compress", argv[i]) || !strcmp("-Z", argv[i]))
+			a.features |= FEATURE_COMPRESS;
+		else if (!strcmp("--file-copies", argv[i]) || !strcmp("-X", argv[i]))
+			a.features |= FEATURE_COPIES;
+		else if (!strncmp("--block-size", argv[i], 12) || !strcmp("-B", argv[i]))
+		{
+			char *s = strchr(argv[i], '=');
+			s = s ? s + 1 : argv[(++i)];
+			switch ((a.blocksize = strtoul(s, NULL, 0) * KILOBYTE))
+			{
+				case SIZE_BYTE_BLOCK:          /* 2 KiB, the original size */
+				case SIZE_BYTE_BLOCK * 2:      /* 4 KiB, a page */
+				case SIZE_BYTE_BLOCK * 8:      /* 16 KiB */
+				case SIZE_BYTE_BLOCK_MAX:      /* 64 KiB, for large files */
+					break;
+				default:
+					die("unsupported block size %s KiB", s);
+			}
+		}
 		else if (is_stegfs() && (!strcmp("--show_bloc", argv[i]) || !strcmp("-b", argv[i])))
 			a.show_bloc = true;
+		else if (is_stegfs() && (!strncmp("--cache-size", argv[i], 12) || !strcmp("-C", argv[i])))
+		{
+			char *s = strchr(argv[i], '=');
+			s = s ? s + 1 : argv[(++i)];
+			a.cache_size = strtoull(s, NULL, 0);
+		}
+		else if (is_stegfs() && (!strncmp("--cache-ttl", argv[i], 11) || !strcmp("-T", argv[i])))
+		{
+			char *s = strchr(argv[i], '=');
+			s = s ? s + 1 : argv[(++i)];
+			a.cache_ttl = strtoull(s, NULL, 0);
+		}
 		else if (!is_stegfs() && (!strcmp("--size", argv[i]) || !strcmp("-z", argv[i])))
 		{
 			char *s = NULL;
@@ -187,11 +229,6 @@ extern args_t init(int argc, char **argv, char **fuse)
 				case S_IFLNK:
 				case S_IFREG:
 					a.fs = strdup(argv[i]);
-					if (is_stegfs() && fuse)
-					{
-						fuse[j] = "-s";
-						j++;
-					}
 					break;
 				case S_IFDIR:
 					a.mount = strdup(argv[i]);
@@ -213,6 +250,13 @@ extern args_t init(int argc, char **argv, char **fuse)
 			}
 		}
 	}
+	/* striped files need at least two data stripes, and some parity */
+	if (a.stripes > 1)
+	{
+		if (a.stripes >= a.duplicates)
+			die("unsupported number of stripes %d for %d duplicates", a.stripes, a.duplicates);
+		a.features |= FEATURE_STRIPE;
+	}
 
 	return a;
 }
@@ -259,8 +303,19 @@ static void print_help(void)
 	fprintf(stderr, _("  -a, --mac=<mac>            The MAC algorithm to use\n"));
 	fprintf(stderr, _("  -p, --paranoid             Enable paranoia mode\n"));
 	fprintf(stderr, _("  -x, --duplicates=<#>       Number of times each file should be duplicated\n"));
+	fprintf(stderr, _("  -k, --stripes=<#>          Split each file across this many of the duplicates,\n"));
+	fprintf(stderr, _("                             the rest holding parity\n"));
+	fprintf(stderr, _("  -i, --index                Use index blocks to list where file data is\n"));
+	fprintf(stderr, _("  -e, --ecc                  Add parity to each block to correct damaged bytes\n"));
+	fprintf(stderr, _("  -Z, --compress             Compress file data before it's encrypted\n"));
+	fprintf(stderr, _("  -X, --file-copies          Let each file have its own number of duplicates\n"));
+	fprintf(stderr, _("  -B, --block-size=<KiB>     Block size: 2, 4, 16 or 64 (default: %d)\n"), SIZE_BYTE_BLOCK / KILOBYTE);
 	if (is_stegfs())
+	{
 		fprintf(stderr, _("  -b, --show_bloc            Expose the /bloc/ in-use block list directory\n"));
+		fprintf(stderr, _("  -C, --cache-size=<MB>      Memory to keep closed files in (default: %d)\n"), CACHE_BUDGET_DEFAULT);
+		fprintf(stderr, _("  -T, --cache-ttl=<seconds>  How long to keep closed files (default: %d)\n"), CACHE_TTL_DEFAULT);
+	}
 	else
 	{
 		fprintf(stderr, _("  -z, --size=<size>          Desired file system size, required when creating\n"));
@@ -276,6 +331,8 @@ static void print_help(void)
 	{
 		fprintf(stderr, _("  • It doesn't matter which order the file system and mount point are specified\n"));
 		fprintf(stderr, _("    as stegfs will figure that out. All other options are passed to FUSE.\n"));
+		fprintf(stderr, _("  • The kernel’s caching can be tuned with -o entry_timeout=<seconds>,\n"));
+		fprintf(stderr, _("    attr_timeout=<seconds> and negative_timeout=<seconds>.\n"));
 	}
 	fprintf(stderr, _("  • If you’re feeling extra paranoid you can now disable to stegfs file\n"));
 	fprintf(stderr, _("    system header. This will also disable the checks when mounting and thus\n"));
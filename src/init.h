@@ -46,8 +46,13 @@ typedef struct
 	enum gcry_md_algos     hash;   /*!< The encryption mode selected by the user */
 	enum gcry_mac_algos    mac;    /*!< The MAC alogrithm selected by the user */
 	uint8_t duplicates;            /*!< Number of duplicates of each file */
+	uint8_t stripes;               /*!< Number of those which hold a share of the data (1 if each holds all of it) */
+	uint32_t features;             /*!< Optional format features */
+	uint32_t blocksize;            /*!< File system block size in bytes */
 
 	uint64_t size;                 /*!< File system size (mkfs) */
+	uint64_t cache_size;           /*!< Memory for idle cached files, in MB */
+	uint64_t cache_ttl;            /*!< Seconds idle files stay cached */
 
 	bool show_bloc:1;              /*!< Expose /bloc/ block list */
 	bool paranoid:1;               /*!< Paranoid mode */
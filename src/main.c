@@ -22,21 +22,33 @@
 #include <errno.h>
 #include <error.h>
 
-#define FUSE_USE_VERSION 27
-#include <fuse.h>
+#ifdef USE_FUSE3
+	#define FUSE_USE_VERSION 31
+#else
+	#define FUSE_USE_VERSION 27
+#endif
+#include <fuse_lowlevel.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <stdbool.h>
 
 #include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <sys/statvfs.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
 
 #include <gcrypt.h>
 
@@ -47,125 +59,406 @@
 #include "init.h"
 
 
+/*
+ * how long the kernel may keep names and attributes before asking again
+ * (the same as the high-level FUSE API); failed look-ups are kept for as
+ * long as stegfs remembers them; each can be changed with a mount option
+ */
+#define TIMEOUT_ENTRY    1.0
+#define TIMEOUT_ATTR     1.0
+#define TIMEOUT_NEGATIVE NEGATIVE_TTL
+
+/*
+ * the largest read or write the kernel is asked to send at once (the
+ * FUSE 2 library can only take 128 KiB, so will lower it)
+ */
+#define MAX_REQUEST 0x100000 /* 1 MiB */
+
+/*
+ * files are written by a pool of threads once they’re closed, unless more
+ * than this much plaintext is already waiting (then it’s written inline);
+ * files which are kept open are written when they’ve had changes waiting
+ * for a while, or sooner if others’ changes reach the limit (which makes
+ * their writers wait)
+ */
+#define WRITERS      2
+#define WRITE_BEHIND (64 * MEGABYTE)
+#define WRITE_BACK   30 /* seconds */
+
+/*
+ * idle cached files have every copy checked (and any which are damaged
+ * written again) by a low priority thread, which reads no faster than
+ * this, gives way to anything waiting for the namespace, and leaves each
+ * file for a while once it’s been checked
+ */
+#define SCRUB_RATE  (4 * MEGABYTE) /* bytes a second */
+#define SCRUB_AGAIN 3600           /* seconds */
+#define SCRUB_IDLE  1              /* seconds to wait when there’s nothing to check */
+#define SCRUB_NICE  19
+
+#define NODE_CHUNK  4096  /* nodes allocated at a time */
+#define NODE_CHUNKS 65536 /* most chunks of nodes */
+
+/*
+ * the kernel refers to files and directories by node id; each node is the
+ * name something was looked up by (a file’s password is part of its name)
+ * and the cache element that resolved to
+ */
+typedef struct
+{
+	char           *path;       /* full path, including any password */
+	stegfs_cache_t *cache;      /* cache element (NULL once dropped, or for /bloc/ entries) */
+	uint64_t        lookups;    /* references held by the kernel; 0 if unused */
+	uint64_t        generation; /* times the id has been used */
+	fuse_ino_t      parent;     /* node of the containing directory */
+	fuse_ino_t      sibling;    /* next node for the same element (or next unused id) */
+	uint64_t        writers;    /* open handles which may write */
+	int             error;      /* why writing the file last failed (until reported) */
+}
+node_t;
+
+/*
+ * each open of a file gets a handle (kept in the file info the kernel
+ * passes back with every request on it) so the file needn’t be found by
+ * name again, and so that separate opens of one file are kept apart
+ */
+typedef struct
+{
+	fuse_ino_t  ino;   /* node the file was opened through */
+	node_t     *node;
+	char       *pass;  /* password the plaintext was decrypted with */
+	bool        write; /* opened for writing */
+	bool        dirty; /* written to (or created) through this handle */
+}
+handle_t;
+
+/*
+ * a released file waiting to be written; the element is only compared
+ * with what the path finds once the namespace is locked, as it may have
+ * been dropped in the meantime
+ */
+typedef struct write_job_t
+{
+	struct write_job_t *next;
+	char               *path;       /* full path, including the password */
+	stegfs_cache_t     *cache;
+	fuse_ino_t          ino;        /* node to report a failure to */
+	uint64_t            generation;
+	uint64_t            bytes;      /* plaintext waiting to be written */
+	time_t              due;        /* when to write it (0 as soon as possible) */
+	bool                released;   /* the file was closed (not just changed) */
+	bool                busy;       /* being written */
+}
+write_job_t;
+
+typedef struct
+{
+	double entry;    /* seconds the kernel may keep a name */
+	double attr;     /* seconds the kernel may keep attributes */
+	double negative; /* seconds the kernel may remember a name doesn’t exist */
+}
+timeout_t;
+
+/*
+ * names to invalidate once the current request has been answered (the
+ * kernel may be waiting on the answer with the directory locked)
+ */
+typedef struct
+{
+	fuse_ino_t  ino;
+	fuse_ino_t  parent;
+	char       *path;
+}
+node_invalid_t;
+
 /*
  * standard file system functions (used by fuse)
  */
-static int fuse_stegfs_statfs(const char *, struct statvfs *);
-static int fuse_stegfs_getattr(const char *, struct stat *);
-static int fuse_stegfs_mkdir(const char *, mode_t);
-static int fuse_stegfs_rmdir(const char *);
-static int fuse_stegfs_readdir(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
-static int fuse_stegfs_unlink(const char *);
-static int fuse_stegfs_read(const char *, char *, size_t, off_t , struct fuse_file_info *);
-static int fuse_stegfs_write(const char *, const char *, size_t, off_t , struct fuse_file_info *);
-static int fuse_stegfs_open(const char *, struct fuse_file_info *);
-static int fuse_stegfs_release(const char *, struct fuse_file_info *);
-static int fuse_stegfs_truncate(const char *, off_t);
-static int fuse_stegfs_ftruncate(const char *, off_t, struct fuse_file_info *);
+static void fuse_stegfs_statfs(fuse_req_t, fuse_ino_t);
+static void fuse_stegfs_lookup(fuse_req_t, fuse_ino_t, const char *);
+static void fuse_stegfs_forget(fuse_req_t, fuse_ino_t, unsigned long);
+static void fuse_stegfs_forget_multi(fuse_req_t, size_t, struct fuse_forget_data *);
+static void fuse_stegfs_getattr(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+static void fuse_stegfs_setattr(fuse_req_t, fuse_ino_t, struct stat *, int, struct fuse_file_info *);
+static void fuse_stegfs_mkdir(fuse_req_t, fuse_ino_t, const char *, mode_t);
+static void fuse_stegfs_rmdir(fuse_req_t, fuse_ino_t, const char *);
+static void fuse_stegfs_readdir(fuse_req_t, fuse_ino_t, size_t, off_t, struct fuse_file_info *);
+#ifdef USE_FUSE3
+static void fuse_stegfs_readdirplus(fuse_req_t, fuse_ino_t, size_t, off_t, struct fuse_file_info *);
+#endif
+static void fuse_stegfs_unlink(fuse_req_t, fuse_ino_t, const char *);
+static void fuse_stegfs_read(fuse_req_t, fuse_ino_t, size_t, off_t, struct fuse_file_info *);
+static void fuse_stegfs_write_buf(fuse_req_t, fuse_ino_t, struct fuse_bufvec *, off_t, struct fuse_file_info *);
+static void fuse_stegfs_open(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+static void fuse_stegfs_release(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
 #ifdef STEGFS_FALLOCATE
-static int fuse_stegfs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
+static void fuse_stegfs_fallocate(fuse_req_t, fuse_ino_t, int, off_t, off_t, struct fuse_file_info *);
 #endif
-static int fuse_stegfs_create(const char *, mode_t, struct fuse_file_info *);
-static int fuse_stegfs_mknod(const char *, mode_t, dev_t);
+static void fuse_stegfs_create(fuse_req_t, fuse_ino_t, const char *, mode_t, struct fuse_file_info *);
+static void fuse_stegfs_mknod(fuse_req_t, fuse_ino_t, const char *, mode_t, dev_t);
+static void fuse_stegfs_init(void *, struct fuse_conn_info *);
 static void fuse_stegfs_destroy(void *);
+static void fuse_stegfs_getxattr(fuse_req_t, fuse_ino_t, const char *, size_t);
+static void fuse_stegfs_setxattr(fuse_req_t, fuse_ino_t, const char *, const char *, size_t, int);
+static void fuse_stegfs_listxattr(fuse_req_t, fuse_ino_t, size_t);
+static void fuse_stegfs_readlink(fuse_req_t, fuse_ino_t);
+static void fuse_stegfs_flush(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+static void fuse_stegfs_fsync(fuse_req_t, fuse_ino_t, int, struct fuse_file_info *);
+/*
+ * the bodies of functions which are also used by others; the namespace
+ * must already be locked (exclusively for writing and unlinking)
+ */
+static int read_locked(stegfs_cache_t *, char *, size_t, off_t);
+static int write_locked(fuse_ino_t, struct fuse_bufvec *, off_t);
+static int unlink_locked(const char *);
+static int truncate_locked(fuse_ino_t, off_t);
+static int release_handle(handle_t *);
+static void readdir_page(fuse_req_t, fuse_ino_t, size_t, off_t, bool);
+/*
+ * node id functions
+ */
+static node_t *node_get(fuse_ino_t);
+static fuse_ino_t node_alloc(void);
+static void node_bind(fuse_ino_t, stegfs_cache_t *);
+static bool node_lookup(fuse_ino_t, const char *, stegfs_cache_t *, struct fuse_entry_param *);
+static void node_forget(fuse_ino_t, uint64_t);
+static stegfs_cache_t *node_cache(fuse_ino_t);
+static char *node_path(fuse_ino_t, const char *);
+static void node_dropped(stegfs_cache_t *);
+static void node_notify(const char *);
+static void node_deinit(void);
+/*
+ * open file handle functions
+ */
+static handle_t *handle_new(fuse_ino_t, node_t *, bool);
+static handle_t *handle_get(const struct fuse_file_info *);
+static void handle_free(handle_t *);
+
+/*
+ * background writer functions
+ */
+static void writer_init(void);
+static bool writer_queue(const handle_t *, stegfs_cache_t *, time_t);
+static bool writer_pending(const stegfs_cache_t *);
+static void writer_settle(void);
+static int writer_wait(const handle_t *, const stegfs_cache_t *, bool);
+static void writer_throttle(const stegfs_cache_t *);
+static void *writer_main(void *);
+static void writer_run(write_job_t *);
+static void writer_deinit(void);
+
 /*
- * empty functions; required by fuse, but not used by stegfs
- */
-static int fuse_stegfs_readlink(const char *, char *, size_t);
-static int fuse_stegfs_utime(const char *, struct utimbuf *);
-static int fuse_stegfs_chmod(const char *, mode_t);
-static int fuse_stegfs_chown(const char *, uid_t, gid_t);
-static int fuse_stegfs_flush(const char *, struct fuse_file_info *);
-
-static struct fuse_operations fuse_stegfs_functions =
-{
-	.statfs    = fuse_stegfs_statfs,
-	.getattr   = fuse_stegfs_getattr,
-	.mkdir     = fuse_stegfs_mkdir,
-	.rmdir     = fuse_stegfs_rmdir,
-	.readdir   = fuse_stegfs_readdir,
-	.unlink    = fuse_stegfs_unlink,
-	.read      = fuse_stegfs_read,
-	.write     = fuse_stegfs_write,
-	.open      = fuse_stegfs_open,
-	.release   = fuse_stegfs_release,
-	.truncate  = fuse_stegfs_truncate,
-	.ftruncate = fuse_stegfs_ftruncate,
+ * background scrub functions
+ */
+static void scrub_init(void);
+static void *scrub_main(void *);
+static void scrub_deinit(void);
+
+static struct fuse_lowlevel_ops fuse_stegfs_functions =
+{
+	.statfs       = fuse_stegfs_statfs,
+	.lookup       = fuse_stegfs_lookup,
+	.forget       = fuse_stegfs_forget,
+	.forget_multi = fuse_stegfs_forget_multi,
+	.getattr      = fuse_stegfs_getattr,
+	.setattr      = fuse_stegfs_setattr,
+	.mkdir        = fuse_stegfs_mkdir,
+	.rmdir        = fuse_stegfs_rmdir,
+	.readdir      = fuse_stegfs_readdir,
+#ifdef USE_FUSE3
+	.readdirplus  = fuse_stegfs_readdirplus,
+#endif
+	.unlink       = fuse_stegfs_unlink,
+	.read         = fuse_stegfs_read,
+	.write_buf    = fuse_stegfs_write_buf,
+	.open         = fuse_stegfs_open,
+	.release      = fuse_stegfs_release,
 #ifdef STEGFS_FALLOCATE
-	.fallocate = fuse_stegfs_fallocate,
+	.fallocate    = fuse_stegfs_fallocate,
 #endif
-	.create    = fuse_stegfs_create,
-	.mknod     = fuse_stegfs_mknod,
-	.destroy   = fuse_stegfs_destroy,
-	.readlink  = fuse_stegfs_readlink,
-	/*
-	 * empty functions; required by fuse, but not used by stegfs
-	 */
-	.utime     = fuse_stegfs_utime,
-	.chmod     = fuse_stegfs_chmod,
-	.chown     = fuse_stegfs_chown,
-	.flush     = fuse_stegfs_flush
+	.create       = fuse_stegfs_create,
+	.mknod        = fuse_stegfs_mknod,
+	.init         = fuse_stegfs_init,
+	.destroy      = fuse_stegfs_destroy,
+	.readlink     = fuse_stegfs_readlink,
+	.getxattr     = fuse_stegfs_getxattr,
+	.setxattr     = fuse_stegfs_setxattr,
+	.listxattr    = fuse_stegfs_listxattr,
+	.flush        = fuse_stegfs_flush,
+	.fsync        = fuse_stegfs_fsync
+};
+
+/*
+ * nodes are never moved once allocated, so can be used without holding
+ * the lock, which only guards the allocation, reference counts and the
+ * links between nodes and cache elements
+ */
+static node_t *nodes[NODE_CHUNKS];
+static fuse_ino_t node_next = FUSE_ROOT_ID;
+static fuse_ino_t node_unused = 0;
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread node_invalid_t *node_invalid = NULL;
+static __thread size_t node_invalids = 0;
+
+static timeout_t timeout = { TIMEOUT_ENTRY, TIMEOUT_ATTR, TIMEOUT_NEGATIVE };
+
+/* the same names as the options of the high-level FUSE API */
+static const struct fuse_opt timeout_options[] =
+{
+	{ "entry_timeout=%lf",    offsetof(timeout_t, entry),    0 },
+	{ "attr_timeout=%lf",     offsetof(timeout_t, attr),     0 },
+	{ "negative_timeout=%lf", offsetof(timeout_t, negative), 0 },
+	FUSE_OPT_END
 };
 
+/*
+ * jobs are queued in the order files were released; the lock is taken
+ * after the namespace (and node) locks, never before
+ */
+static write_job_t *writer_jobs = NULL;
+static uint64_t writer_bytes = 0;
+static uint64_t writer_written = 0;
+static uint64_t writer_failed = 0;
+static pthread_t writer_thread[WRITERS];
+static unsigned writer_threads = 0;
+static bool writer_stop = false;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_done = PTHREAD_COND_INITIALIZER;
+
+static pthread_t scrub_thread;
+static bool scrub_running = false;
+static bool scrub_stop = false;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wake = PTHREAD_COND_INITIALIZER;
+
+#ifdef USE_FUSE3
+static struct fuse_session *channel = NULL; /* notifications go through the session */
+#else
+static struct fuse_chan *channel = NULL;
+#endif
+
 extern bool is_stegfs(void)
 {
 	return true;
 }
 
-static int fuse_stegfs_statfs(const char *path, struct statvfs *stvbuf)
+static void fuse_stegfs_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	errno = EXIT_SUCCESS;
-
-	(void)path;
+	(void)ino;
 
+	stegfs_lock(false);
 	stegfs_t file_system = stegfs_info();
+	stegfs_unlock();
+
+	struct statvfs stvbuf;
+	memset(&stvbuf, 0x00, sizeof stvbuf);
+	stvbuf.f_bsize   = file_system.blocksize;
+	stvbuf.f_frsize  = file_system.datasize;
+	stvbuf.f_blocks  = (file_system.size / file_system.blocksize) - 1;
+	stvbuf.f_bfree   = stvbuf.f_blocks - file_system.blocks.used;
+	stvbuf.f_bavail  = stvbuf.f_bfree;
+	stvbuf.f_files   = stvbuf.f_blocks;
+	stvbuf.f_ffree   = stvbuf.f_bfree;
+	stvbuf.f_favail  = stvbuf.f_bfree;
+	stvbuf.f_fsid    = HASH_MAGIC_2;
+	stvbuf.f_flag    = ST_NOSUID;
+	stvbuf.f_namemax = SYM_LENGTH;
+
+	fuse_reply_statfs(req, &stvbuf);
+}
 
-	stvbuf->f_bsize   = SIZE_BYTE_BLOCK;
-	stvbuf->f_frsize  = SIZE_BYTE_DATA;
-	stvbuf->f_blocks  = (file_system.size / SIZE_BYTE_BLOCK) - 1;
-	stvbuf->f_bfree   = stvbuf->f_blocks - file_system.blocks.used;
-	stvbuf->f_bavail  = stvbuf->f_bfree;
-	stvbuf->f_files   = stvbuf->f_blocks;
-	stvbuf->f_ffree   = stvbuf->f_bfree;
-	stvbuf->f_favail  = stvbuf->f_bfree;
-	stvbuf->f_fsid    = HASH_MAGIC_2;
-	stvbuf->f_flag    = ST_NOSUID;
-	stvbuf->f_namemax = SYM_LENGTH;
+/*
+ * directories have no inode, so their number is derived from their path
+ */
+static ino_t stat_directory_ino(const stegfs_t *file_system, const char *path)
+{
+	ino_t ino = 0;
+	size_t hash_length = gcry_md_get_algo_dlen(file_system->hash);
+	uint8_t *hash_buffer = gcry_malloc_secure(hash_length);
+	gcry_md_hash_buffer(file_system->hash, hash_buffer, path, strlen(path));
+	memcpy(&ino, hash_buffer, sizeof ino);
+	gcry_free(hash_buffer);
+	return ino % (file_system->size / file_system->blocksize);
+}
 
-	return -errno;
+/*
+ * common attributes for root/files/directories
+ */
+static void stat_common(fuse_req_t req, struct stat *stbuf)
+{
+	memset(stbuf, 0x00, sizeof( struct stat ));
+	stbuf->st_dev   = (dev_t)HASH_MAGIC_2;
+	stbuf->st_uid   = fuse_req_ctx(req)->uid;
+	stbuf->st_gid   = fuse_req_ctx(req)->gid;
+	stbuf->st_atime = time(NULL);
+	stbuf->st_ctime = stbuf->st_atime;
+	stbuf->st_mtime = stbuf->st_atime;
+	return;
 }
 
-static int fuse_stegfs_getattr(const char *path, struct stat *stbuf)
+static void stat_file(const stegfs_t *file_system, const stegfs_file_t *file, struct stat *stbuf)
 {
-	errno = EXIT_SUCCESS;
+	for (unsigned i = 0; i < file_system->copies; i++)
+		if (file->inodes[i])
+		{
+			stbuf->st_ino = (ino_t)(file->inodes[i] % (file_system->size / file_system->blocksize));
+			break;
+		}
+	/* it makes little sense (right now) to set this to anything else */
+	stbuf->st_mode    = S_IFREG | S_IRUSR | S_IWUSR;
+	stbuf->st_nlink   = 1;
+	stbuf->st_ctime   = file->time;
+	stbuf->st_mtime   = file->time;
+	stbuf->st_size    = file->size;
+	stbuf->st_blksize = file_system->datasize;
+	lldiv_t d = lldiv(stbuf->st_size, stbuf->st_blksize);
+	stbuf->st_blocks = d.quot + (d.rem > 0);
+	return;
+}
 
-	stegfs_t file_system = stegfs_info();
-	char *f = dir_get_name(path, PASSWORD_SEPARATOR); /* used to check for symlink */
-	/* common attributes for root/files/directories */
-	stbuf->st_dev     = (dev_t)HASH_MAGIC_2;
-	stbuf->st_ino     = 0;
-	stbuf->st_mode    = 0;//S_IFDIR | 0700;
-	stbuf->st_nlink   = 0;
-	stbuf->st_uid     = fuse_get_context()->uid;
-	stbuf->st_gid     = fuse_get_context()->gid;
-	stbuf->st_atime   = time(NULL);
-	stbuf->st_ctime   = time(NULL);
-	stbuf->st_mtime   = time(NULL);
-	stbuf->st_size    = 0;
-	stbuf->st_blksize = 0;
-
-	if (path_equals(DIR_SEPARATOR, path))
+/*
+ * fill in the attributes of a cached file or directory; used by getattr,
+ * lookup and readdir so listing a directory needs no further lookups
+ */
+static void stat_cached(fuse_req_t req, const stegfs_t *file_system, stegfs_cache_t *c, struct stat *stbuf)
+{
+	stat_common(req, stbuf);
+	if (c->file)
+		stat_file(file_system, c->file, stbuf);
+	else if (file_system->show_bloc && path_equals(PATH_BLOC, c->path))
+	{
+		stbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR;
+		stbuf->st_ino  = stat_directory_ino(file_system, c->path);
+		stbuf->st_size = file_system->datasize;
+	}
+	else
 	{
 		stbuf->st_mode  = S_IFDIR | S_IRWXU;
-		stbuf->st_nlink = 2;
-		for (uint64_t i = 0; i < file_system.cache.ents; i++)
-			if (file_system.cache.child[i] && !file_system.cache.child[i]->file)
-				stbuf->st_nlink++;
+		stbuf->st_nlink = 2 + c->ents - c->holes - c->files;
+		/* other threads may be listing the same directory */
+		ino_t ino = __atomic_load_n(&c->ino, __ATOMIC_RELAXED);
+		if (!ino)
+			__atomic_store_n(&c->ino, ino = stat_directory_ino(file_system, c->path), __ATOMIC_RELAXED);
+		stbuf->st_ino  = ino;
+		stbuf->st_size = file_system->datasize;
 	}
-	else if (file_system.show_bloc && path_equals(PATH_BLOC, path))
-		/* if path == /bloc/ */
-		stbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR;
-	else if (file_system.show_bloc && path_starts_with(PATH_BLOC, path))
+	return;
+}
+
+/*
+ * find the attributes (and cache element) of a path, reading its inode if
+ * it isn’t already cached; the namespace must be locked, and may be held
+ * exclusively on return
+ */
+static int stat_path(fuse_req_t req, const stegfs_t *file_system, const char *path, struct stat *stbuf, stegfs_cache_t **c)
+{
+	dir_view_t view;
+	stat_common(req, stbuf);
+	*c = NULL;
+
+	if (file_system->show_bloc && path_starts_with(PATH_BLOC DIR_SEPARATOR, path))
 	{
 		/*
 		 * if we’re looking at files in /bloc/ treat them as blocks (as
@@ -175,476 +468,1847 @@ static int fuse_stegfs_getattr(const char *path, struct stat *stbuf)
 		stbuf->st_mode  = S_IFLNK | S_IRUSR;
 		stbuf->st_nlink = 1;
 
-		char *b = dir_get_name(path, PASSWORD_SEPARATOR);
-		uint64_t ino = strtol(b, NULL, 0);
-		char *f = file_system.blocks.file[ino];
+		uint64_t ino = strtol(strrchr(path, DIR_SEPARATOR_CHAR) + 1, NULL, 0);
+		if (ino >= file_system->size / file_system->blocksize)
+			return errno = ENOENT, -errno;
+		stbuf->st_ino = ino;
+		char *f = file_system->blocks.file[ino];
 		if (f)
 			stbuf->st_size = strlen(f);
-		free(b);
 	}
+	else if ((*c = stegfs_cache_exists(path, NULL)))
+		stat_cached(req, file_system, *c, stbuf);
+	else if (stegfs_negative_exists(path))
+		return errno = ENOENT, -errno; /* recently looked for, and not found */
+	else if (!dir_view(&view, path, PASSWORD_SEPARATOR))
+		return errno = ENAMETOOLONG, -errno;
 	else
 	{
-		stegfs_cache_t c;
-		memset(&c, 0x00, sizeof c);
-		if (stegfs_cache_exists(path, &c))
+		stegfs_file_t file;
+		memset(&file, 0x00, sizeof file);
+		file.path = dir_span_dupa(&view, view.dir);
+		file.name = dir_span_dupa(&view, view.name);
+		file.pass = dir_span_dupa(&view, view.pass);
+		if (stegfs_file_stat_meta(&file))
 		{
-			if (c.file)
-			{
-				for (unsigned i = 0; i < file_system.copies; i++)
-					if (c.file->inodes[i])
-					{
-						stbuf->st_ino = (ino_t)(c.file->inodes[i] % (file_system.size / SIZE_BYTE_BLOCK));
-						break;
-					}
-				/* it makes little sense (right now) to set this to anything else */
-				stbuf->st_mode  = S_IFREG | S_IRUSR | S_IWUSR;
-				stbuf->st_ctime = c.file->time;
-				stbuf->st_mtime = c.file->time;
-				stbuf->st_size  = c.file->size;
-			}
-			else
-			{
-				stbuf->st_mode  = S_IFDIR | S_IRWXU;
-				stbuf->st_nlink = 2;
-				for (uint64_t i = 0; i < c.ents; i++)
-					if (c.child[i] && !c.child[i]->file)
-						stbuf->st_nlink++;
-			}
+			stat_file(file_system, &file, stbuf);
+			/*
+			 * the inode could be read alongside other threads, but
+			 * adding it to the cache needs the namespace to itself
+			 * (by which time another thread may have added it)
+			 */
+			stegfs_unlock();
+			stegfs_lock(true);
+			if (!(*c = stegfs_cache_exists(path, NULL)))
+				*c = stegfs_cache_add(NULL, &file);
+			errno = EXIT_SUCCESS;
 		}
 		else
 		{
-			stegfs_file_t file;
-			memset(&file, 0x00, sizeof file);
-			file.path = dir_get_path(path);
-			file.name = dir_get_name(path, PASSWORD_SEPARATOR);
-			file.pass = dir_get_pass(path);
-			if (stegfs_file_stat(&file))
-			{
-				for (unsigned i = 0; i < file_system.copies; i++)
-					if (file.inodes[i])
-					{
-						stbuf->st_ino = (ino_t)(file.inodes[i] % (file_system.size / SIZE_BYTE_BLOCK));
-						break;
-					}
-				stbuf->st_mode  = S_IFREG | S_IRUSR | S_IWUSR;
-				stbuf->st_ctime = file.time;
-				stbuf->st_mtime = file.time;
-				stbuf->st_size  = file.size;
-			}
-			else
-				errno = ENOENT;
-			free(file.path);
-			free(file.name);
-			free(file.pass);
+			stegfs_negative_add(path);
+			errno = ENOENT;
 		}
+		stegfs_file_release(&file);
 	}
-	if (stbuf->st_mode & S_IFREG)
+
+	return -errno;
+}
+
+static void fuse_stegfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	errno = EXIT_SUCCESS;
+
+	struct fuse_entry_param e;
+	memset(&e, 0x00, sizeof e);
+	char *path = node_path(parent, name);
+	if (!path)
 	{
-		stbuf->st_nlink = 1;
-		stbuf->st_blksize = SIZE_BYTE_DATA;
-		lldiv_t d = lldiv(stbuf->st_size, stbuf->st_blksize);
-		stbuf->st_blocks = d.quot + (d.rem > 0);
+		fuse_reply_err(req, errno);
+		return;
 	}
-	else if (stbuf->st_mode & S_IFDIR)
+
+	stegfs_lock(false);
+	stegfs_t file_system = stegfs_info();
+	stegfs_cache_t *c = NULL;
+	if (!stat_path(req, &file_system, path, &e.attr, &c))
+		/* directories are named by their path alone */
+		node_lookup(parent, c && !c->file ? c->path : path, c, &e);
+	stegfs_unlock();
+	free(path);
+
+	if (errno == ENOENT)
 	{
-		size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
-		uint8_t *hash_buffer = gcry_malloc_secure(hash_length);
-		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, strlen(path));
-		memcpy(&(stbuf->st_ino), hash_buffer, sizeof stbuf->st_ino);
-		gcry_free(hash_buffer);
-		stbuf->st_ino %= (file_system.size / SIZE_BYTE_BLOCK);
-		stbuf->st_size = SIZE_BYTE_DATA;
+		/* let the kernel remember the name doesn’t exist */
+		e.ino = 0;
+		e.entry_timeout = timeout.negative;
+		fuse_reply_entry(req, &e);
 	}
-	free(f);
+	else if (errno)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_entry(req, &e);
+}
 
-	return -errno;
+static void fuse_stegfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void fuse_stegfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++)
+		node_forget(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
 }
 
-static int fuse_stegfs_mkdir(const char *path, mode_t mode)
+static void fuse_stegfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
-	(void)mode;
+	(void)info;
+
+	struct stat stbuf;
+	node_t *n = node_get(ino);
+	if (!n)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
 
-	stegfs_cache_add(path, NULL);
+	stegfs_lock(false);
+	stegfs_t file_system = stegfs_info();
+	stegfs_cache_t *c = NULL;
+	if ((c = node_cache(ino)))
+		stat_cached(req, &file_system, c, &stbuf);
+	else
+		stat_path(req, &file_system, n->path, &stbuf, &c);
+	stegfs_unlock();
 
-	return -errno;
+	if (errno)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_attr(req, &stbuf, timeout.attr);
 }
 
-static int fuse_stegfs_rmdir(const char *path)
+static void fuse_stegfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
+	/*
+	 * only the size can be changed; modes, owners and timestamps are
+	 * not used by stegfs
+	 */
+	node_t *n = node_get(ino);
+	if (!n)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	if (!(to_set & FUSE_SET_ATTR_SIZE))
+	{
+		fuse_reply_err(req, ENOTSUP);
+		return;
+	}
+
+	struct stat stbuf;
+	stegfs_lock(true);
 	stegfs_t file_system = stegfs_info();
-	if (file_system.show_bloc && path_equals(path, PATH_BLOC))
-		return errno = EBUSY, -errno;
+	stegfs_cache_t *c = NULL;
+	int r = truncate_locked(ino, attr->st_size);
+	if (!r && (c = node_cache(ino)))
+		stat_cached(req, &file_system, c, &stbuf);
+	handle_t *h = handle_get(info);
+	if (!r && h)
+	{
+		h->dirty = true; /* truncated through an open file */
+		if (c && c->file)
+			writer_queue(h, c, time(NULL) + WRITE_BACK);
+	}
+	errno = r ? -r : c ? EXIT_SUCCESS : ENOENT;
+	stegfs_unlock();
+
+	if (errno)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_attr(req, &stbuf, timeout.attr);
+	node_notify(n->path);
+}
+
+static void fuse_stegfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	errno = EXIT_SUCCESS;
 
+	(void)mode;
+
+	struct fuse_entry_param e;
+	memset(&e, 0x00, sizeof e);
+	char *path = node_path(parent, name);
+	if (!path)
+	{
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	stegfs_lock(true);
+	stegfs_t file_system = stegfs_info();
 	stegfs_cache_t *c = NULL;
-	if ((c = stegfs_cache_exists(path, NULL)))
+	if (!(c = stegfs_cache_add(path, NULL)) || c->file)
+		errno = c ? EEXIST : ENAMETOOLONG;
+	else if (node_lookup(parent, c->path, c, &e))
+		stat_cached(req, &file_system, c, &e.attr);
+	stegfs_unlock();
+	free(path);
+
+	if (errno)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void fuse_stegfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	errno = EXIT_SUCCESS;
+
+	char *path = node_path(parent, name);
+	if (!path)
 	{
-		if (c->file)
-			errno = ENOTDIR;
-		else
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	stegfs_lock(true);
+	stegfs_t file_system = stegfs_info();
+	if (file_system.show_bloc && path_equals(path, PATH_BLOC))
+		errno = EBUSY;
+	else
+	{
+		stegfs_cache_t *c = NULL;
+		if ((c = stegfs_cache_exists(path, NULL)))
 		{
-			bool empty = true;
-			for (uint64_t i = 0; i < c->ents; i++)
-				if (c->child[i]->name)
-					empty = false;
-			if (!empty)
-				errno = ENOTEMPTY;
+			if (c->file)
+				errno = ENOTDIR;
 			else
-				stegfs_cache_remove(path);
+			{
+				bool empty = true;
+				for (uint64_t i = 0; i < c->ents; i++)
+					if (c->child[i])
+						empty = false;
+				if (!empty)
+					errno = ENOTEMPTY;
+				else
+					stegfs_cache_remove(path);
+			}
 		}
 	}
+	stegfs_unlock();
 
-	return -errno;
+	fuse_reply_err(req, errno);
+	node_notify(path);
+	free(path);
 }
 
-static int fuse_stegfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info)
+/*
+ * add an entry to a page of directory entries, if there’s room; with
+ * readdirplus a cached child is looked up too, as the kernel will later
+ * forget it, but only once it’s known to fit
+ */
+static bool readdir_add(fuse_req_t req, char *buf, size_t size, size_t *used, const char *name, const struct stat *stbuf, off_t next, bool plus, fuse_ino_t parent, stegfs_cache_t *c)
 {
-	errno = EXIT_SUCCESS;
+#ifdef USE_FUSE3
+	if (plus)
+	{
+		struct fuse_entry_param e;
+		memset(&e, 0x00, sizeof e);
+		e.attr = *stbuf;
+		/* an entry takes the same room whatever it holds */
+		if (fuse_add_direntry_plus(req, NULL, 0, name, &e, next) > size - *used)
+			return false;
+		/*
+		 * . and .. (and blocks in /bloc/) have no node id, so the
+		 * kernel looks them up itself, as it would if a node couldn’t
+		 * be had for a child
+		 */
+		if (c && !node_lookup(parent, c->path, c, &e))
+			errno = EXIT_SUCCESS;
+		*used += fuse_add_direntry_plus(req, buf + *used, size - *used, name, &e, next);
+		return true;
+	}
+#else
+	(void)plus;
+	(void)parent;
+	(void)c;
+#endif
+	size_t l = fuse_add_direntry(req, buf + *used, size - *used, name, stbuf, next);
+	if (l > size - *used)
+		return false;
+	*used += l;
+	return true;
+}
 
-	(void)offset;
+static void fuse_stegfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info)
+{
 	(void)info;
 
-	filler(buf,  ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	readdir_page(req, ino, size, offset, false);
+}
+
+#ifdef USE_FUSE3
+static void fuse_stegfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info)
+{
+	(void)info;
 
-	stegfs_t file_system = stegfs_info();
+	readdir_page(req, ino, size, offset, true);
+}
+#endif
+
+static void readdir_page(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, bool plus)
+{
+	errno = EXIT_SUCCESS;
 
-	if (path_equals(DIR_SEPARATOR, path))
+	/*
+	 * entries are returned a page at a time: each entry carries the
+	 * offset of the next, and the page ends once it’s full; offsets 0
+	 * and 1 are . and .., after which come the children (whose positions
+	 * are stable, deletions leave holes)
+	 */
+	char *buf = malloc(size);
+	size_t used = 0;
+	stegfs_lock(false);
+	stegfs_t file_system = stegfs_info();
+	stegfs_cache_t *c = node_cache(ino);
+	struct stat st;
+	off_t o = offset;
+	if (!buf || !c || c->file)
 	{
-		for (uint64_t i = 0; i < file_system.cache.ents; i++)
-			if (file_system.cache.child[i]->name)
-				filler(buf, file_system.cache.child[i]->name, NULL, 0);
+		errno = !buf ? ENOMEM : c ? ENOTDIR : ENOENT;
+		goto done;
 	}
-	else if (file_system.show_bloc && path_equals(PATH_BLOC, path))
+	stat_cached(req, &file_system, c, &st);
+	if (o == 0 && !readdir_add(req, buf, size, &used, ".", &st, ++o, plus, ino, NULL))
+		goto done;
+	if (o == 1 && !readdir_add(req, buf, size, &used, "..", &st, ++o, plus, ino, NULL))
+		goto done;
+
+	if (file_system.show_bloc && path_equals(PATH_BLOC, c->path))
 	{
-		for (uint64_t i = 0; i < file_system.size / SIZE_BYTE_BLOCK; i++)
+		stat_common(req, &st);
+		st.st_mode = S_IFLNK | S_IRUSR;
+		for (uint64_t i = o - 2; i < file_system.size / file_system.blocksize; i++)
 			if (file_system.blocks.in_use[i])
 			{
 				char b[21] = { 0x0 }; // max digits for UINT64_MAX
 				snprintf(b, sizeof b, "%ju", i);
-				filler(buf, b, NULL, 0);
+				st.st_ino = i;
+				if (!readdir_add(req, buf, size, &used, b, &st, i + 3, plus, ino, NULL))
+					break;
 			}
+		goto done;
 	}
+
+	for (uint64_t i = o - 2; i < c->ents; i++)
+		if (c->child[i])
+		{
+			/*
+			 * every cached child has at least had its inode read, so
+			 * its attributes can be given without another lookup
+			 */
+			stat_cached(req, &file_system, c->child[i], &st);
+			if (!readdir_add(req, buf, size, &used, c->child[i]->name, &st, i + 3, plus, ino, c->child[i]))
+				break;
+		}
+
+done:
+	stegfs_unlock();
+	if (errno)
+		fuse_reply_err(req, errno);
 	else
+		fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void fuse_stegfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	errno = EXIT_SUCCESS;
+
+	char *path = node_path(parent, name);
+	if (!path)
 	{
-		stegfs_cache_t c;
-		memset(&c, 0x00, sizeof c);
-		if (stegfs_cache_exists(path, &c))
-			for (uint64_t i = 0; i < c.ents; i++)
-				if (c.child[i]->name)
-					filler(buf, c.child[i]->name, NULL, 0);
+		fuse_reply_err(req, errno);
+		return;
 	}
 
-	return -errno;
+	stegfs_lock(true);
+	unlink_locked(path);
+	stegfs_unlock();
+
+	fuse_reply_err(req, errno);
+	node_notify(path);
+	free(path);
 }
 
-static int fuse_stegfs_unlink(const char *path)
+static int unlink_locked(const char *path)
 {
-	errno = EXIT_SUCCESS;
+	dir_view_t view;
+	if (!dir_view(&view, path, PASSWORD_SEPARATOR))
+		return errno = ENAMETOOLONG, -errno;
 
 	stegfs_file_t file;
 	memset(&file, 0x00, sizeof file);
-	file.path = dir_get_path(path);
-	file.name = dir_get_name(path, PASSWORD_SEPARATOR);
-	file.pass = dir_get_pass(path);
+	file.path = dir_span_dupa(&view, view.dir);
+	file.name = dir_span_dupa(&view, view.name);
+	file.pass = dir_span_dupa(&view, view.pass);
 
 	stegfs_file_delete(&file);
-
-	free(file.path);
-	free(file.name);
-	free(file.pass);
+	stegfs_file_release(&file);
 
 	return -errno;
 }
 
-static int fuse_stegfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info)
+static void fuse_stegfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
-	(void)info;
+	(void)ino;
 
-	stegfs_cache_t *c = NULL;
-	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
+	handle_t *h = handle_get(info);
+	if (!h)
+	{
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+	/*
+	 * reply straight from the decrypted file data rather than a copy of
+	 * it, which means keeping the locks until the reply has been sent so
+	 * the data can’t be changed, reread or evicted in the meantime
+	 */
+	stegfs_lock(false);
+	stegfs_cache_t *c = node_cache(h->ino);
+	if (c && c->file && c->file->pass && h->pass && strcmp(c->file->pass, h->pass))
+		/* opened with another password since, which replaced the plaintext */
+		fuse_reply_err(req, ESTALE);
+	else if (c && c->file)
+	{
+		stegfs_file_lock(c->file);
+		struct fuse_bufvec buf = FUSE_BUFVEC_INIT(0);
+		if ((uint64_t)offset < c->file->size)
+		{
+			buf.buf[0].size = (uint64_t)offset + size > c->file->size ? c->file->size - offset : size;
+			buf.buf[0].mem = c->file->data + offset;
+		}
+		fuse_reply_data(req, &buf, 0);
+		stegfs_file_unlock(c->file);
+	}
+	else
+		fuse_reply_err(req, ENOENT);
+	stegfs_unlock();
+}
+
+static int read_locked(stegfs_cache_t *c, char *buf, size_t size, off_t offset)
+{
+	if (c && c->file)
 	{
-		if ((unsigned)(offset + size) > c->file->size)
+		/* another thread may be reading the file in to the cache */
+		stegfs_file_lock(c->file);
+		if ((uint64_t)offset >= c->file->size)
+			size = 0;
+		else if ((uint64_t)offset + size > c->file->size)
 			size = c->file->size - offset;
-		memcpy(buf, c->file->data + offset, size);
+		if (size)
+			memcpy(buf, c->file->data + offset, size);
+		stegfs_file_unlock(c->file);
 		return size;
 	}
 
 	return errno = ENOENT, -errno;
 }
 
-static int fuse_stegfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info)
+static void fuse_stegfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
-	(void)info;
+	(void)ino;
 
-	/*
-	 * if the file is cached (has been read/written to already) then
-	 * just buffer this data until it’s released/flushed
-	 */
-	while (true)
+	handle_t *h = handle_get(info);
+	if (!h || !h->write)
 	{
-		stegfs_cache_t *c = NULL;
-		if ((c = stegfs_cache_exists(path, NULL)) && c->file)
-		{
-			if (!stegfs_file_will_fit(c->file))
-				return -errno;
-			if (!c->file->write)
-				return errno = EBADF, -errno;
-			c->file->size = c->file->size > size + offset ? c->file->size : size + offset;
-			c->file->data = realloc(c->file->data, c->file->size);
-			c->file->time = time(NULL);
-			memcpy(c->file->data + offset, buf, size);
-			return size;
-		}
-		else if (c && !c->file)
-			return errno = EISDIR, -errno;
-		/*
-		 * the file wasn’t found, so create it and try again, it should
-		 * then fail if the file cannot fit, as at this point all that’s
-		 * happening is increasing the cached buffer
-		 */
-		stegfs_file_create(path, true);
+		fuse_reply_err(req, EBADF);
+		return;
 	}
+	stegfs_lock(true);
+	stegfs_cache_t *c = NULL;
+	int r = write_locked(h->ino, buf, offset);
+	if (r > 0)
+	{
+		h->dirty = true;
+		if ((c = node_cache(h->ino)))
+			writer_queue(h, c, time(NULL) + WRITE_BACK);
+	}
+	stegfs_unlock();
 
-	return errno = EIO, -errno;
+	if (r < 0)
+		fuse_reply_err(req, -r);
+	else
+		fuse_reply_write(req, r);
+	node_notify(NULL);
+	writer_throttle(c);
 }
 
-static int fuse_stegfs_open(const char *path, struct fuse_file_info *info)
+static int write_locked(fuse_ino_t ino, struct fuse_bufvec *buf, off_t offset)
 {
-	errno = EXIT_SUCCESS;
-
-	(void)info;
-
+	/*
+	 * the file should be cached (it’s been created or opened) but if it
+	 * has since gone, create it again; it should then fail if the file
+	 * cannot fit, as at this point all that’s happening is increasing
+	 * the cached buffer, which is kept until it’s released/flushed
+	 */
 	stegfs_cache_t *c = NULL;
-	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
+	if (!(c = node_cache(ino)))
 	{
-		c->file->pass = dir_get_pass(path);
-		if (!stegfs_file_read(c->file))
-			errno = EACCES;
-		/* TODO use the fields in info for something meaningful */
+		stegfs_file_create(node_get(ino)->path, true);
+		if (!(c = node_cache(ino)))
+			return errno = ENOENT, -errno;
 	}
-
-	return -errno;
+	if (!c->file)
+		return errno = EISDIR, -errno;
+	if (!stegfs_file_will_fit(c->file, false))
+		return -errno;
+	if (!c->file->write)
+		return errno = EBADF, -errno;
+	size_t size = fuse_buf_size(buf);
+	if (c->file->size < size + offset)
+	{
+		c->file->data = realloc(c->file->data, size + offset);
+		/* writing past the end leaves a hole, which reads as zeros */
+		if ((uint64_t)offset > c->file->size)
+			memset(c->file->data + c->file->size, 0x00, offset - c->file->size);
+		c->file->size = size + offset;
+	}
+	c->file->time = time(NULL);
+	/*
+	 * the data may still be in the kernel’s pipe (if it was spliced) in
+	 * which case it’s read directly in to place
+	 */
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = c->file->data + offset;
+	ssize_t r = fuse_buf_copy(&dst, buf, 0);
+	if (r < 0)
+		return errno = -r, r;
+	return r;
 }
 
-static int fuse_stegfs_flush(const char *path, struct fuse_file_info *info)
+static void fuse_stegfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
-	(void)info;
+	node_t *n = node_get(ino);
+	if (!n)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
 
+	/*
+	 * opening only needs a shared lock, so different files can be read
+	 * (and decrypted) at the same time; the file’s own lock keeps two
+	 * threads from reading the same one at once
+	 */
+	handle_t *h = NULL;
 	stegfs_cache_t *c = NULL;
-	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
-		if (stegfs_file_will_fit(c->file))
-			errno = EXIT_SUCCESS;
+	bool hit = false;
+again:
+	stegfs_lock(false);
+	if (!(c = node_cache(ino)))
+		errno = ENOENT;
+	else if (!c->file)
+		errno = EISDIR;
+	else
+	{
+		char *pass = dir_get_pass(n->path);
+		stegfs_file_lock(c->file);
+		if ((hit = stegfs_cache_open(c, pass)))
+			free(pass); /* still have the plaintext */
+		else if (writer_pending(c))
+		{
+			/*
+			 * reading the file again would lose changes which are still
+			 * waiting to be written, so wait for them first
+			 */
+			free(pass);
+			stegfs_cache_close(c);
+			stegfs_file_unlock(c->file);
+			stegfs_unlock();
+			writer_wait(NULL, c, true);
+			goto again;
+		}
+		else
+		{
+			free(c->file->pass);
+			c->file->pass = pass;
+			if (!stegfs_file_read(c->file))
+			{
+				/* open failed, so there won’t be a release */
+				free(c->file->pass);
+				c->file->pass = NULL;
+				stegfs_cache_close(c);
+				errno = EACCES;
+			}
+		}
+		stegfs_file_unlock(c->file);
+		if (!errno && !(h = handle_new(ino, n, (info->flags & O_ACCMODE) != O_RDONLY)))
+		{
+			stegfs_cache_close(c);
+			errno = ENOMEM;
+		}
+	}
+	stegfs_unlock();
 
-	return -errno;
+	/*
+	 * plaintext which was still cached is what the kernel was given last
+	 * time (every change since has been written through this node) so it
+	 * can keep the pages it has; otherwise the file was read again and
+	 * they’re dropped
+	 */
+	info->keep_cache = hit;
+	info->fh = (uintptr_t)h;
+
+	if (errno)
+		fuse_reply_err(req, errno);
+	else if (fuse_reply_open(req, info) == -ENOENT)
+	{
+		/* the open was interrupted, so there won’t be a release */
+		release_handle(h);
+		node_notify(NULL);
+	}
 }
 
-static int fuse_stegfs_truncate(const char *path, off_t offset)
+static void fuse_stegfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
-	return fuse_stegfs_ftruncate(path, offset, NULL);
+	(void)ino;
+
+	handle_t *h = handle_get(info);
+	if (!h)
+	{
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+	/*
+	 * a close waits for the file’s earlier releases to have been written,
+	 * and reports if they couldn’t be
+	 */
+	stegfs_lock(false);
+	stegfs_cache_t *c = node_cache(h->ino);
+	stegfs_unlock();
+	int e = writer_wait(h, c, false);
+
+	/* only opens which could have written need checking */
+	stegfs_lock(false);
+	if (h->write && (c = node_cache(h->ino)) && c->file && c->file->write)
+	{
+		/*
+		 * checking the fit may delete the file; it’s compressed to know
+		 * for sure, so that close() can report it not fitting
+		 */
+		stegfs_unlock();
+		stegfs_lock(true);
+		if ((c = node_cache(h->ino)) && c->file)
+			if (stegfs_file_will_fit(c->file, true))
+				errno = EXIT_SUCCESS;
+	}
+	stegfs_unlock();
+
+	fuse_reply_err(req, e ? e : errno);
+	node_notify(NULL);
 }
 
-static int fuse_stegfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *info)
+static void fuse_stegfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
+	(void)ino;
+	(void)datasync; /* there’s no metadata apart from the data */
+
+	handle_t *h = handle_get(info);
+	if (!h)
+	{
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+	stegfs_lock(false);
+	stegfs_cache_t *c = node_cache(h->ino);
+	stegfs_unlock();
+	int e = writer_wait(h, c, true);
+
+	/* anything changed since is written now, but the file stays open */
+	writer_settle();
+	stegfs_lock(true);
+	if (h->write && (c = node_cache(h->ino)) && c->file && c->file->write)
+		if (stegfs_file_will_fit(c->file, false) && stegfs_file_write(c->file))
+			errno = EXIT_SUCCESS;
+	stegfs_unlock();
+
+	fuse_reply_err(req, e ? e : errno);
+	node_notify(NULL);
+}
+
+static int truncate_locked(fuse_ino_t ino, off_t offset)
+{
 	stegfs_cache_t *c = NULL;
-	while (true)
+	if (!(c = node_cache(ino)))
 	{
-		if ((c = stegfs_cache_exists(path, NULL)) && c->file)
-		{
-			char *buf = calloc(offset, sizeof(uint8_t));
-			fuse_stegfs_read(path, buf, offset, 0, info);
-			fuse_stegfs_unlink(path);
-			fuse_stegfs_write(path, buf, offset, 0, info);
-			free(buf);
-			return -errno;
-		}
-		else if (c && !c->file)
-			return errno = EISDIR, -errno;
-		else
-			stegfs_file_create(path, true);
+		stegfs_file_create(node_get(ino)->path, true);
+		if (!(c = node_cache(ino)))
+			return errno = ENOENT, -errno;
 	}
+	if (!c->file)
+		return errno = EISDIR, -errno;
 
-	return errno = EIO, -errno;
+	/*
+	 * the file is deleted and written again (the existing copies can’t
+	 * be resized), after which the node finds the new cache element
+	 */
+	char *buf = calloc(offset, sizeof( uint8_t ));
+	read_locked(c, buf, offset, 0);
+	unsigned copies = c->file->copies;
+	unlink_locked(node_get(ino)->path);
+	/* the new file has as many copies as the old one */
+	stegfs_file_create(node_get(ino)->path, true);
+	if ((c = node_cache(ino)) && c->file && copies)
+		c->file->copies = copies;
+	errno = EXIT_SUCCESS;
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(offset);
+	src.buf[0].mem = buf;
+	int r = write_locked(ino, &src, 0);
+	free(buf);
 
+	return r < 0 ? r : 0;
 }
 
 #ifdef STEGFS_FALLOCATE
-static int fuse_stegfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *info)
+static void fuse_stegfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
 	/* this isn't finished or working properly */
 
+	node_t *n = node_get(ino);
+	if (!n)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+
+	stegfs_lock(true);
 	stegfs_cache_t *c = NULL;
-	while (true)
+	if (!(c = node_cache(ino)))
 	{
-		if ((c = stegfs_cache_exists(path, NULL)) && c->file)
+		stegfs_file_create(n->path, true);
+		c = node_cache(ino);
+	}
+	if (!c)
+		errno = ENOENT;
+	else if (!c->file)
+		errno = EISDIR;
+	else
+	{
+		uint64_t sz = offset + length;
+		switch (mode)
 		{
-			uint64_t sz = offset + length;
-			switch (mode)
-			{
-				case -1:                        /* emulate truncate */
-					break;
-				case 0:                         /* make bigger (not smaller) */
-					if (sz < c->file->size)
-						sz = c->file->size;
-					break;
-				case FALLOC_FL_KEEP_SIZE:       /* no size change */
-				case FALLOC_FL_PUNCH_HOLE:
-					return errno = EOPNOTSUPP, -errno;
-				case FALLOC_FL_COLLAPSE_RANGE:  /* remove data from middle */
-					if (sz > c->file->size)
-						return errno = EINVAL, -errno;
-				case FALLOC_FL_ZERO_RANGE:      /* does nothing here, but zeros later */
-					break;
-			}
-			char *buf = calloc(sz, sizeof(uint8_t));
-			fuse_stegfs_read(path, buf, sz, 0, info);
-			fuse_stegfs_unlink(path);
-			switch (mode)
-			{
-				case FALLOC_FL_COLLAPSE_RANGE:
-					memmove(buf + offset, buf + offset + length, sz - offset - length);
-					sz -= offset - length;
-					break;
-				case FALLOC_FL_ZERO_RANGE:
-					memset(buf + offset, 0x00, length);
-					break;
-			}
-			fuse_stegfs_write(path, buf, sz, 0, info);
-			free(buf);
-			return -errno;
+			case -1:                        /* emulate truncate */
+				break;
+			case 0:                         /* make bigger (not smaller) */
+				if (sz < c->file->size)
+					sz = c->file->size;
+				break;
+			case FALLOC_FL_KEEP_SIZE:       /* no size change */
+			case FALLOC_FL_PUNCH_HOLE:
+				errno = EOPNOTSUPP;
+				goto done;
+			case FALLOC_FL_COLLAPSE_RANGE:  /* remove data from middle */
+				if (sz > c->file->size)
+				{
+					errno = EINVAL;
+					goto done;
+				}
+			case FALLOC_FL_ZERO_RANGE:      /* does nothing here, but zeros later */
+				break;
 		}
-		else if (c && !c->file)
-			return errno = EISDIR, -errno;
-		else
-			stegfs_file_create(path, true);
+		char *buf = calloc(sz, sizeof(uint8_t));
+		read_locked(c, buf, sz, 0);
+		unsigned copies = c->file->copies;
+		unlink_locked(n->path);
+		stegfs_file_create(n->path, true);
+		if ((c = node_cache(ino)) && c->file && copies)
+			c->file->copies = copies;
+		switch (mode)
+		{
+			case FALLOC_FL_COLLAPSE_RANGE:
+				memmove(buf + offset, buf + offset + length, sz - offset - length);
+				sz -= offset - length;
+				break;
+			case FALLOC_FL_ZERO_RANGE:
+				memset(buf + offset, 0x00, length);
+				break;
+		}
+		errno = EXIT_SUCCESS;
+		struct fuse_bufvec src = FUSE_BUFVEC_INIT(sz);
+		src.buf[0].mem = buf;
+		write_locked(ino, &src, 0);
+		free(buf);
+		handle_t *h = handle_get(info);
+		if (h)
+			h->dirty = true;
 	}
+done:
+	stegfs_unlock();
 
-	return errno = EIO, -errno;
+	fuse_reply_err(req, errno);
+	node_notify(n->path);
 }
 #endif
 
-static int fuse_stegfs_create(const char *path, mode_t mode, struct fuse_file_info *info)
+static void fuse_stegfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
 	(void)mode;
-	(void)info;
 
+	struct fuse_entry_param e;
+	memset(&e, 0x00, sizeof e);
+	char *path = node_path(parent, name);
+	if (!path)
+	{
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	handle_t *h = NULL;
+	stegfs_lock(true);
+	stegfs_t file_system = stegfs_info();
 	stegfs_file_create(path, true);
+	stegfs_cache_t *c = NULL;
+	if (!(c = stegfs_cache_exists(path, NULL)))
+		errno = ENAMETOOLONG;
+	else if (!c->file)
+		errno = EISDIR;
+	else if (node_lookup(parent, path, c, &e))
+	{
+		if ((h = handle_new(e.ino, node_get(e.ino), true)))
+		{
+			/* even if nothing is written, the file is */
+			h->dirty = true;
+			stegfs_cache_open(c, NULL);
+			stat_cached(req, &file_system, c, &e.attr);
+		}
+		else
+		{
+			node_forget(e.ino, 1);
+			errno = ENOMEM;
+		}
+	}
+	stegfs_unlock();
+	free(path);
 
-	return -errno;
+	info->fh = (uintptr_t)h;
+	if (errno)
+		fuse_reply_err(req, errno);
+	else if (fuse_reply_create(req, &e, info) == -ENOENT)
+	{
+		/* the create was interrupted, so there won’t be a release */
+		release_handle(h);
+		node_notify(NULL);
+	}
 }
 
-static int fuse_stegfs_mknod(const char *path, mode_t mode, dev_t rdev)
+static void fuse_stegfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
 {
 	errno = EXIT_SUCCESS;
 
 	(void)mode;
 	(void)rdev;
 
-	stegfs_file_create(path, false);
+	struct fuse_entry_param e;
+	memset(&e, 0x00, sizeof e);
+	char *path = node_path(parent, name);
+	if (!path)
+	{
+		fuse_reply_err(req, errno);
+		return;
+	}
 
-	return -errno;
+	stegfs_lock(true);
+	stegfs_t file_system = stegfs_info();
+	stegfs_file_create(path, false);
+	stegfs_cache_t *c = NULL;
+	if (!(c = stegfs_cache_exists(path, NULL)))
+		errno = ENAMETOOLONG;
+	else if (!c->file)
+		errno = EISDIR;
+	else if (node_lookup(parent, path, c, &e))
+		stat_cached(req, &file_system, c, &e.attr);
+	stegfs_unlock();
+	free(path);
+
+	if (errno)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_entry(req, &e);
 }
 
-static int fuse_stegfs_release(const char *path, struct fuse_file_info *info)
+static void fuse_stegfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
 	errno = EXIT_SUCCESS;
 
-	(void)info;
+	(void)ino;
 
+	handle_t *h = handle_get(info);
+	fuse_reply_err(req, h ? release_handle(h) : EBADF);
+	node_notify(NULL);
+}
+
+static int release_handle(handle_t *h)
+{
+	errno = EXIT_SUCCESS;
+
+	/*
+	 * the file is written when a handle which changed it is closed, and
+	 * when the last handle which could have is (as it may have been
+	 * truncated without one); otherwise it’s left for the others
+	 */
+	pthread_mutex_lock(&node_lock);
+	if (h->write)
+		h->node->writers--;
+	bool last = !h->node->writers;
+	pthread_mutex_unlock(&node_lock);
+
+	/* files which were only read can be closed alongside other threads */
+	stegfs_lock(false);
 	stegfs_cache_t *c = NULL;
-	if ((c = stegfs_cache_exists(path, NULL)) && c->file)
+	if ((c = node_cache(h->ino)) && c->file && (!c->file->write || !(h->dirty || last)))
 	{
-		if (c->file->write && stegfs_file_will_fit(c->file))
+		stegfs_cache_close(c);
+		goto done;
+	}
+	stegfs_unlock();
+
+	writer_settle();
+	stegfs_lock(true);
+	if ((c = node_cache(h->ino)) && c->file)
+	{
+		/*
+		 * deriving keys, allocating blocks and encrypting every copy can
+		 * take a while, so it’s left to a writer thread (the plaintext is
+		 * kept until then, as files still to be written aren’t evicted)
+		 * unless too much is waiting already
+		 */
+		if (c->file->write && stegfs_file_will_fit(c->file, true) && !writer_queue(h, c, 0))
 		{
 			if (stegfs_file_write(c->file))
 				errno = EXIT_SUCCESS;
-			c->file->write = false;
+			c->file->write = !last;
 		}
-		free(c->file->data);
-		c->file->data = NULL;
-		free(c->file->pass);
-		c->file->pass = NULL;
+		/*
+		 * keep the plaintext while the cache has room for it (look the
+		 * file up again as it’s gone if it wouldn’t fit)
+		 */
+		if ((c = node_cache(h->ino)) && c->file)
+			stegfs_cache_close(c);
 	}
+done:
+	stegfs_unlock();
+	handle_free(h);
 
-	return -errno;
+	return errno;
+}
+
+static void fuse_stegfs_init(void *ptr, struct fuse_conn_info *conn)
+{
+	(void)ptr;
+
+	/*
+	 * ask for large requests, so each costs less to handle, and have the
+	 * data spliced to and from the kernel where it can be
+	 */
+	conn->max_write = MAX_REQUEST;
+	conn->max_readahead = MAX_REQUEST;
+#ifdef USE_FUSE3
+	conn->max_read = MAX_REQUEST; /* must match the mount option */
+#else
+	conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+
+	/* started here, as the process may have forked since main() */
+	writer_init();
+	scrub_init();
 }
 
 static void fuse_stegfs_destroy(void *ptr)
 {
 	(void)ptr;
 
+	scrub_deinit();
+	writer_deinit();
 	stegfs_deinit();
+	node_deinit();
 }
 
-static int fuse_stegfs_readlink(const char *path, char *buf, size_t size)
+/*
+ * file system statistics are available as extended attributes of the
+ * root directory
+ */
+static const char *stats_names[] =
+{
+	"user.stegfs.cache.hits",
+	"user.stegfs.cache.misses",
+	"user.stegfs.cache.evictions",
+	"user.stegfs.cache.bytes",
+	"user.stegfs.write.queued",
+	"user.stegfs.write.written",
+	"user.stegfs.write.errors",
+	"user.stegfs.scrub.files",
+	"user.stegfs.scrub.repaired",
+	"user.stegfs.scrub.failed",
+	"user.stegfs.ecc.corrected"
+};
+
+/*
+ * if each file can have its own number of copies, every file has how
+ * many it has as an extended attribute, and every directory how many
+ * new files in it will have (which can be changed)
+ */
+static const char *copies_name = "user.stegfs.copies";
+
+static void fuse_stegfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	uint64_t value = 0;
+	int e = ENODATA;
+
+	stegfs_lock(false);
+	stegfs_t file_system = stegfs_info();
+	if (!strcmp(copies_name, name) && (file_system.features & FEATURE_COPIES))
+	{
+		stegfs_cache_t *c = node_cache(ino);
+		if (c && !(value = c->file ? c->file->copies : c->copies))
+			value = file_system.copies;
+		e = c ? EXIT_SUCCESS : ENOENT;
+	}
+	stegfs_unlock();
+
+	if (ino == FUSE_ROOT_ID)
+	{
+		pthread_mutex_lock(&writer_lock);
+		uint64_t stats[] =
+		{
+			file_system.cache_stats.hits,
+			file_system.cache_stats.misses,
+			file_system.cache_stats.evictions,
+			file_system.cache_stats.bytes,
+			writer_bytes,
+			writer_written,
+			writer_failed,
+			file_system.scrub_stats.files,
+			file_system.scrub_stats.repaired,
+			file_system.scrub_stats.failed,
+			file_system.blocks.corrected
+		};
+		pthread_mutex_unlock(&writer_lock);
+		for (unsigned i = 0; i < sizeof stats / sizeof stats[0]; i++)
+			if (!strcmp(stats_names[i], name))
+			{
+				value = stats[i];
+				e = EXIT_SUCCESS;
+			}
+	}
+
+	if (e)
+	{
+		fuse_reply_err(req, e);
+		return;
+	}
+	char b[21] = { 0x0 }; // max digits for UINT64_MAX
+	int l = snprintf(b, sizeof b, "%" PRIu64, value);
+	if (!size)
+		fuse_reply_xattr(req, l);
+	else if ((size_t)l > size)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, b, l);
+}
+
+static void fuse_stegfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
 {
 	errno = EXIT_SUCCESS;
 
+	(void)flags;
+
+	if (strcmp(copies_name, name))
+	{
+		fuse_reply_err(req, ENOTSUP);
+		return;
+	}
+	/* the value is the number in decimal (0 for the file system’s) */
+	char b[4] = { 0x0 };
+	char *end = NULL;
+	unsigned long n = 0;
+	if (size && size < sizeof b)
+	{
+		memcpy(b, value, size);
+		n = strtoul(b, &end, 10);
+	}
+	if (!end || *end)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	stegfs_lock(true);
+	stegfs_cache_t *c = node_cache(ino);
+	if (!c)
+		errno = ENOENT;
+	else if (c->file)
+		errno = EPERM; /* a file keeps the number it was created with */
+	else
+		stegfs_directory_copies(c, n);
+	stegfs_unlock();
+
+	fuse_reply_err(req, errno);
+}
+
+static void fuse_stegfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	char list[512] = { 0x0 };
+	size_t l = 0;
+	for (unsigned i = 0; ino == FUSE_ROOT_ID && i < sizeof stats_names / sizeof stats_names[0]; i++)
+	{
+		size_t n = strlen(stats_names[i]) + 1;
+		memcpy(list + l, stats_names[i], n);
+		l += n;
+	}
+	stegfs_lock(false);
+	if (stegfs_info().features & FEATURE_COPIES)
+	{
+		size_t n = strlen(copies_name) + 1;
+		memcpy(list + l, copies_name, n);
+		l += n;
+	}
+	stegfs_unlock();
+
+	if (!size)
+		fuse_reply_xattr(req, l);
+	else if (l > size)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, list, l);
+}
+
+static void fuse_stegfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	errno = EXIT_SUCCESS;
+
+	node_t *n = node_get(ino);
+	char *link = NULL;
+	stegfs_lock(false);
 	stegfs_t file_system = stegfs_info();
-	if (file_system.show_bloc && path_starts_with(PATH_BLOC, path))
+	if (n && file_system.show_bloc && path_starts_with(PATH_BLOC DIR_SEPARATOR, n->path))
 	{
-		char *b = dir_get_name(path, PASSWORD_SEPARATOR);
-		uint64_t ino = strtol(b, NULL, 0);
-		char *f = file_system.blocks.file[ino];
+		uint64_t b = strtol(strrchr(n->path, DIR_SEPARATOR_CHAR) + 1, NULL, 0);
+		char *f = b < file_system.size / file_system.blocksize ? file_system.blocks.file[b] : NULL;
 		if (f)
-			snprintf(buf, size, "%s", f);
-		free(b);
+			link = strdup(f);
+		else
+			errno = ENOENT;
 	}
 	else
-	{
-		(void)path;
-		(void)buf;
-		(void)size;
 		errno = ENOTSUP;
+	stegfs_unlock();
+
+	if (errno)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_readlink(req, link);
+	free(link);
+}
+
+/*
+ * open file handle functions
+ */
+
+static handle_t *handle_new(fuse_ino_t ino, node_t *n, bool write)
+{
+	handle_t *h = calloc(1, sizeof( handle_t ));
+	if (!h)
+		return NULL;
+	h->ino = ino;
+	h->node = n;
+	h->pass = dir_get_pass(n->path);
+	if ((h->write = write))
+	{
+		pthread_mutex_lock(&node_lock);
+		n->writers++;
+		pthread_mutex_unlock(&node_lock);
 	}
+	return h;
+}
 
-	return -errno;
+static handle_t *handle_get(const struct fuse_file_info *info)
+{
+	return info ? (handle_t *)(uintptr_t)info->fh : NULL;
+}
+
+static void handle_free(handle_t *h)
+{
+	if (h->pass)
+	{
+		explicit_bzero(h->pass, strlen(h->pass));
+		free(h->pass);
+	}
+	free(h);
+	return;
+}
+
+/*
+ * background writer functions
+ */
+
+static void writer_init(void)
+{
+	pthread_mutex_lock(&writer_lock);
+	writer_stop = false;
+	for (writer_threads = 0; writer_threads < WRITERS; writer_threads++)
+		if (pthread_create(&writer_thread[writer_threads], NULL, writer_main, NULL))
+			break;
+	pthread_mutex_unlock(&writer_lock);
+	return;
+}
+
+/*
+ * queue a file to be written by a given time (0 for a released file, as
+ * soon as possible); if it’s already waiting then that job will write
+ * whatever is there by then; false if it should be written inline instead
+ * (there are no writers, or too much is waiting already for a release);
+ * the namespace must be locked
+ */
+static bool writer_queue(const handle_t *h, stegfs_cache_t *c, time_t due)
+{
+	bool queued = false;
+	pthread_mutex_lock(&writer_lock);
+	write_job_t **j = &writer_jobs;
+	for (; *j; j = &(*j)->next)
+		if ((*j)->cache == c && !(*j)->busy)
+		{
+			writer_bytes += c->file->size - (*j)->bytes;
+			(*j)->bytes = c->file->size;
+			if (due < (*j)->due)
+			{
+				(*j)->due = due;
+				pthread_cond_signal(&writer_queued);
+			}
+			(*j)->released |= !due;
+			queued = true;
+			goto done;
+		}
+	if (!writer_threads || writer_stop || (!due && writer_bytes + c->file->size > WRITE_BEHIND))
+		goto done;
+	write_job_t *job = calloc(1, sizeof( write_job_t ));
+	if (!job)
+		goto done;
+	if (!(job->path = strdup(h->node->path)))
+	{
+		free(job);
+		goto done;
+	}
+	job->cache = c;
+	job->ino = h->ino;
+	job->generation = h->node->generation;
+	job->bytes = c->file->size;
+	job->due = due;
+	job->released = !due;
+	*j = job;
+	writer_bytes += job->bytes;
+	pthread_cond_signal(&writer_queued);
+	queued = true;
+done:
+	pthread_mutex_unlock(&writer_lock);
+	return queued;
 }
 
 /*
- * empty functions; required by fuse, but not used by stegfs; return ENOTSUP
+ * whether an element has been released but not yet written
  */
+static bool writer_pending(const stegfs_cache_t *c)
+{
+	bool pending = false;
+	pthread_mutex_lock(&writer_lock);
+	for (write_job_t *j = writer_jobs; j && !pending; j = j->next)
+		pending = j->cache == c;
+	pthread_mutex_unlock(&writer_lock);
+	return pending;
+}
 
-static int fuse_stegfs_utime(const char *path, struct utimbuf *utime)
+/*
+ * a file can’t be placed until the blocks of every cached file which has
+ * only had its inode read are claimed, which needs the namespace to
+ * itself; claim them one at a time first, so that other requests can be
+ * answered in between rather than waiting for all of them
+ */
+static void writer_settle(void)
 {
-	(void)path;
-	(void)utime;
+	while (stegfs_cache_pending())
+	{
+		stegfs_lock(true);
+		stegfs_cache_settle();
+		stegfs_unlock();
+	}
+	return;
+}
 
-	return errno = ENOTSUP, -errno;
+/*
+ * wait until an element’s releases have been written (or, to sync, any of
+ * its changes, which are written now rather than when due) then take any
+ * failure to write the file a handle is open on; the namespace mustn’t
+ * be locked
+ */
+static int writer_wait(const handle_t *h, const stegfs_cache_t *c, bool sync)
+{
+	pthread_mutex_lock(&writer_lock);
+	for (write_job_t *j = c ? writer_jobs : NULL; j; )
+		if (j->cache == c && (sync || j->released))
+		{
+			if (j->due)
+			{
+				j->due = 0;
+				pthread_cond_signal(&writer_queued);
+			}
+			pthread_cond_wait(&writer_done, &writer_lock);
+			j = writer_jobs;
+		}
+		else
+			j = j->next;
+	pthread_mutex_unlock(&writer_lock);
+	int e = EXIT_SUCCESS;
+	if (h)
+	{
+		pthread_mutex_lock(&node_lock);
+		e = h->node->error;
+		h->node->error = EXIT_SUCCESS;
+		pthread_mutex_unlock(&node_lock);
+	}
+	return e;
 }
 
-static int fuse_stegfs_chmod(const char *path, mode_t mode)
+/*
+ * writing a file waits while other files have more changes waiting than
+ * allowed, and has them written straight away meanwhile (a file larger
+ * than the limit by itself wouldn’t be helped by waiting)
+ */
+static void writer_throttle(const stegfs_cache_t *c)
 {
-	(void)path;
-	(void)mode;
+	if (!c)
+		return;
+	pthread_mutex_lock(&writer_lock);
+	while (writer_threads && !writer_stop)
+	{
+		uint64_t others = writer_bytes;
+		for (write_job_t *j = writer_jobs; j; j = j->next)
+			if (j->cache == c)
+				others -= j->bytes;
+		if (others <= WRITE_BEHIND)
+			break;
+		for (write_job_t *j = writer_jobs; j; j = j->next)
+			if (j->cache != c)
+				j->due = 0;
+		pthread_cond_broadcast(&writer_queued);
+		pthread_cond_wait(&writer_done, &writer_lock);
+	}
+	pthread_mutex_unlock(&writer_lock);
+	return;
+}
+
+/*
+ * take the oldest job which is due and isn’t already being written (or
+ * waiting on one that is, for the same file) until told to stop with
+ * none left; everything left is due once stopping
+ */
+static void *writer_main(void *ptr)
+{
+	(void)ptr;
+
+	pthread_mutex_lock(&writer_lock);
+	while (true)
+	{
+		time_t now = time(NULL);
+		time_t next = 0;
+		write_job_t *j = writer_jobs;
+		for (; j; j = j->next)
+		{
+			if (j->busy)
+				continue;
+			if (!writer_stop && j->due > now)
+			{
+				if (!next || j->due < next)
+					next = j->due;
+				continue;
+			}
+			write_job_t *b = writer_jobs;
+			for (; b != j && !(b->busy && b->cache == j->cache); b = b->next)
+				;
+			if (b == j)
+				break;
+		}
+		if (!j)
+		{
+			if (writer_stop && !writer_jobs)
+				break;
+			if (next)
+			{
+				struct timespec t = { next, 0 };
+				pthread_cond_timedwait(&writer_queued, &writer_lock, &t);
+			}
+			else
+				pthread_cond_wait(&writer_queued, &writer_lock);
+			continue;
+		}
+		j->busy = true;
+		pthread_mutex_unlock(&writer_lock);
+
+		writer_run(j);
+		node_notify(NULL);
+
+		pthread_mutex_lock(&writer_lock);
+		for (write_job_t **i = &writer_jobs; *i; i = &(*i)->next)
+			if (*i == j)
+			{
+				*i = j->next;
+				break;
+			}
+		writer_bytes -= j->bytes;
+		explicit_bzero(j->path, strlen(j->path));
+		free(j->path);
+		free(j);
+		/* another job for the same file may have been waiting on this one */
+		pthread_cond_broadcast(&writer_done);
+		pthread_cond_broadcast(&writer_queued);
+	}
+	pthread_mutex_unlock(&writer_lock);
+	return NULL;
+}
+
+/*
+ * the namespace is only held exclusively to find room for the file (and
+ * afterwards to mark it written); its copies are encrypted and written
+ * from a snapshot alongside other threads, so reads carry on meanwhile
+ */
+static void writer_run(write_job_t *j)
+{
+	errno = EXIT_SUCCESS;
+
+	int e = EXIT_SUCCESS;
+	stegfs_write_t w;
+	bool placed = false;
+	writer_settle();
+	stegfs_lock(true);
+	stegfs_cache_t *c = NULL;
+	/* it may have been deleted (or written again) since it was released */
+	if ((c = stegfs_cache_exists(j->path, NULL)) != j->cache || !c->file || !c->file->write)
+		goto done;
+	/* checking the fit may delete the file */
+	if (stegfs_file_will_fit(c->file, false))
+	{
+		stegfs_file_lock(c->file);
+		placed = stegfs_file_place(c->file, &w, true);
+		stegfs_file_unlock(c->file);
+	}
+	e = errno;
+	stegfs_unlock();
+
+	if (placed)
+	{
+		stegfs_lock(false);
+		stegfs_file_t *f = (c = stegfs_cache_exists(j->path, NULL)) == j->cache ? c->file : NULL;
+		if (f)
+			stegfs_file_lock(f);
+		e = stegfs_file_store(f, &w) ? EXIT_SUCCESS : errno;
+		if (f)
+			stegfs_file_unlock(f);
+		stegfs_unlock();
+	}
+
+	/* only the file as it was placed is any concern of this job’s now */
+	stegfs_lock(true);
+	if ((c = stegfs_cache_exists(j->path, NULL)) != j->cache || !c->file || (placed && c->file->placed != w.placed))
+		c = NULL;
+	if (c && placed && w.lost)
+	{
+		stegfs_file_delete(c->file);
+		c = NULL;
+	}
+	/*
+	 * the plaintext can be evicted once no handle could change it again
+	 * (when nothing has it open, otherwise that happens on the last close)
+	 * and nothing changed since the snapshot is waiting to be written
+	 */
+	pthread_mutex_lock(&node_lock);
+	node_t *n = node_get(j->ino);
+	bool same = n && n->generation == j->generation;
+	if (same && e)
+		n->error = e;
+	bool writing = same && n->writers;
+	pthread_mutex_unlock(&node_lock);
+	pthread_mutex_lock(&writer_lock);
+	for (write_job_t *i = writer_jobs; i && !writing; i = i->next)
+		writing = i != j && i->cache == j->cache;
+	pthread_mutex_unlock(&writer_lock);
+	if (c)
+	{
+		c->file->write = writing;
+		if (!c->users)
+			stegfs_cache_close(c);
+	}
+
+	pthread_mutex_lock(&writer_lock);
+	if (e)
+		writer_failed++;
+	else
+		writer_written++;
+	pthread_mutex_unlock(&writer_lock);
+done:
+	stegfs_unlock();
+	return;
+}
+
+/*
+ * stop the writers once everything queued has been written
+ */
+static void writer_deinit(void)
+{
+	pthread_mutex_lock(&writer_lock);
+	writer_stop = true;
+	pthread_cond_broadcast(&writer_queued);
+	unsigned threads = writer_threads;
+	pthread_mutex_unlock(&writer_lock);
+	for (unsigned i = 0; i < threads; i++)
+		pthread_join(writer_thread[i], NULL);
+	pthread_mutex_lock(&writer_lock);
+	writer_threads = 0;
+	pthread_mutex_unlock(&writer_lock);
+	return;
+}
+
+/*
+ * background scrub functions
+ */
+
+static void scrub_init(void)
+{
+	pthread_mutex_lock(&scrub_lock);
+	scrub_stop = false;
+	scrub_running = !pthread_create(&scrub_thread, NULL, scrub_main, NULL);
+	pthread_mutex_unlock(&scrub_lock);
+	return;
+}
+
+/*
+ * check one file at a time, then wait long enough to keep to the rate;
+ * nothing is checked while anything else holds (or is waiting for) the
+ * namespace exclusively, so FUSE requests are never held up for long
+ */
+static void *scrub_main(void *ptr)
+{
+	(void)ptr;
+
+#ifdef __linux__
+	/* threads have their own priority on Linux */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), SCRUB_NICE);
+#endif
+	pthread_mutex_lock(&scrub_lock);
+	while (!scrub_stop)
+	{
+		pthread_mutex_unlock(&scrub_lock);
+		uint64_t bytes = 0;
+		/*
+		 * damaged copies aren’t repaired (nor files written) while some
+		 * cached files have only had their inode read, so claim the
+		 * blocks of one of them at a time, without waiting in between
+		 */
+		bool more = false;
+		if (stegfs_cache_pending() && stegfs_trylock(true))
+		{
+			stegfs_cache_settle();
+			stegfs_unlock();
+			more = stegfs_cache_pending();
+		}
+		if (stegfs_trylock(false))
+		{
+			bytes = stegfs_cache_scrub(SCRUB_AGAIN);
+			stegfs_unlock();
+		}
+		uint64_t ns = (bytes ? bytes : SCRUB_IDLE * SCRUB_RATE) * UINT64_C(1000000000) / SCRUB_RATE;
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		ns += t.tv_nsec;
+		t.tv_sec += ns / 1000000000;
+		t.tv_nsec = ns % 1000000000;
+		pthread_mutex_lock(&scrub_lock);
+		if (!scrub_stop && !more)
+			pthread_cond_timedwait(&scrub_wake, &scrub_lock, &t);
+	}
+	pthread_mutex_unlock(&scrub_lock);
+	return NULL;
+}
 
-	return errno = ENOTSUP, -errno;
+static void scrub_deinit(void)
+{
+	pthread_mutex_lock(&scrub_lock);
+	scrub_stop = true;
+	pthread_cond_signal(&scrub_wake);
+	bool running = scrub_running;
+	scrub_running = false;
+	pthread_mutex_unlock(&scrub_lock);
+	if (running)
+		pthread_join(scrub_thread, NULL);
+	return;
 }
 
-static int fuse_stegfs_chown(const char *path, uid_t uid, gid_t gid)
+/*
+ * node id functions
+ */
+
+static node_t *node_get(fuse_ino_t ino)
 {
-	(void)path;
-	(void)uid;
-	(void)gid;
+	if (!ino || ino >= (fuse_ino_t)NODE_CHUNK * NODE_CHUNKS)
+		return NULL;
+	node_t *chunk = __atomic_load_n(&nodes[ino / NODE_CHUNK], __ATOMIC_ACQUIRE);
+	if (!chunk || !chunk[ino % NODE_CHUNK].path)
+		return NULL;
+	return &chunk[ino % NODE_CHUNK];
+}
 
-	return errno = ENOTSUP, -errno;
+/*
+ * take an unused id, or the next new one; the node lock must be held
+ */
+static fuse_ino_t node_alloc(void)
+{
+	fuse_ino_t ino = node_unused;
+	node_t *n = NULL;
+	if (ino)
+	{
+		n = &nodes[ino / NODE_CHUNK][ino % NODE_CHUNK];
+		node_unused = n->sibling;
+	}
+	else
+	{
+		if (node_next >= (fuse_ino_t)NODE_CHUNK * NODE_CHUNKS)
+			return 0;
+		ino = node_next++;
+		if (!nodes[ino / NODE_CHUNK])
+		{
+			node_t *chunk = calloc(NODE_CHUNK, sizeof( node_t ));
+			if (!chunk)
+				return node_next--, 0;
+			__atomic_store_n(&nodes[ino / NODE_CHUNK], chunk, __ATOMIC_RELEASE);
+		}
+		n = &nodes[ino / NODE_CHUNK][ino % NODE_CHUNK];
+	}
+	n->generation++;
+	n->sibling = 0;
+	n->cache = NULL;
+	n->lookups = 0;
+	return ino;
+}
+
+/*
+ * link a node to its cache element; the node lock must be held
+ */
+static void node_bind(fuse_ino_t ino, stegfs_cache_t *c)
+{
+	node_t *n = &nodes[ino / NODE_CHUNK][ino % NODE_CHUNK];
+	n->cache = c;
+	n->sibling = c->node;
+	c->node = ino;
+	return;
+}
+
+/*
+ * find (or create) the node for a path and count another reference to it
+ * from the kernel; the namespace must be locked
+ */
+static bool node_lookup(fuse_ino_t parent, const char *path, stegfs_cache_t *c, struct fuse_entry_param *e)
+{
+	pthread_mutex_lock(&node_lock);
+	fuse_ino_t ino = 0;
+	node_t *n = NULL;
+	/* each password used for a file is a different node */
+	for (ino = c ? c->node : 0; ino; ino = n->sibling)
+		if (!strcmp((n = &nodes[ino / NODE_CHUNK][ino % NODE_CHUNK])->path, path))
+			break;
+	if (!ino && (ino = node_alloc()))
+	{
+		n = &nodes[ino / NODE_CHUNK][ino % NODE_CHUNK];
+		n->parent = parent;
+		if (!(n->path = strdup(path)))
+		{
+			n->sibling = node_unused;
+			node_unused = ino;
+			ino = 0;
+		}
+		else if (c)
+			node_bind(ino, c);
+	}
+	if (ino)
+	{
+		n->lookups++;
+		e->ino = ino;
+		e->generation = n->generation;
+		e->attr_timeout = timeout.attr;
+		e->entry_timeout = timeout.entry;
+	}
+	pthread_mutex_unlock(&node_lock);
+	return ino ? true : (errno = ENFILE, false);
+}
+
+/*
+ * the kernel has dropped some references to a node; once there are none
+ * the id can be used again
+ */
+static void node_forget(fuse_ino_t ino, uint64_t lookups)
+{
+	if (ino == FUSE_ROOT_ID)
+		return;
+	pthread_mutex_lock(&node_lock);
+	node_t *n = node_get(ino);
+	if (!n)
+		goto done;
+	n->lookups -= lookups < n->lookups ? lookups : n->lookups;
+	if (n->lookups)
+		goto done;
+	if (n->cache)
+		for (fuse_ino_t *i = &n->cache->node; *i; i = &nodes[*i / NODE_CHUNK][*i % NODE_CHUNK].sibling)
+			if (*i == ino)
+			{
+				*i = n->sibling;
+				break;
+			}
+	explicit_bzero(n->path, strlen(n->path));
+	free(n->path);
+	n->path = NULL;
+	n->cache = NULL;
+	n->sibling = node_unused;
+	node_unused = ino;
+done:
+	pthread_mutex_unlock(&node_lock);
+	return;
+}
+
+/*
+ * the cache element a node refers to; if it has been dropped (deleted and
+ * written again, perhaps) then look for it once more; the namespace must
+ * be locked, so it can’t be dropped while it’s being used
+ */
+static stegfs_cache_t *node_cache(fuse_ino_t ino)
+{
+	node_t *n = node_get(ino);
+	if (!n)
+		return NULL;
+	pthread_mutex_lock(&node_lock);
+	stegfs_cache_t *c = n->cache;
+	pthread_mutex_unlock(&node_lock);
+	if (c || !(c = stegfs_cache_exists(n->path, NULL)))
+		return c;
+	pthread_mutex_lock(&node_lock);
+	if (!n->cache)
+		node_bind(ino, c);
+	c = n->cache;
+	pthread_mutex_unlock(&node_lock);
+	return c;
+}
+
+/*
+ * the path of a name within a directory node
+ */
+static char *node_path(fuse_ino_t parent, const char *name)
+{
+	node_t *n = node_get(parent);
+	if (!n)
+		return errno = ESTALE, NULL;
+	char *path = NULL;
+	if (asprintf(&path, "%s" DIR_SEPARATOR "%s", path_equals(DIR_SEPARATOR, n->path) ? "" : n->path, name) < 0)
+		return errno = ENOMEM, NULL;
+	return path;
+}
+
+/*
+ * a cache element has been dropped, so its nodes no longer refer to it;
+ * the kernel is told to forget their names once the request that dropped
+ * it has been answered
+ */
+static void node_dropped(stegfs_cache_t *c)
+{
+	pthread_mutex_lock(&node_lock);
+	for (fuse_ino_t ino = c->node, next = 0; ino; ino = next)
+	{
+		node_t *n = &nodes[ino / NODE_CHUNK][ino % NODE_CHUNK];
+		next = n->sibling;
+		n->cache = NULL;
+		n->sibling = 0;
+		node_invalid_t *i = realloc(node_invalid, (node_invalids + 1) * sizeof( node_invalid_t ));
+		if (!i)
+			continue;
+		node_invalid = i;
+		node_invalid[node_invalids].ino = ino;
+		node_invalid[node_invalids].parent = n->parent;
+		node_invalid[node_invalids].path = strdup(n->path);
+		node_invalids++;
+	}
+	c->node = 0;
+	pthread_mutex_unlock(&node_lock);
+	return;
+}
+
+/*
+ * tell the kernel about any names dropped while answering the current
+ * request (other than the one it asked to be removed)
+ */
+static void node_notify(const char *skip)
+{
+	for (size_t i = 0; i < node_invalids; i++)
+	{
+		char *path = node_invalid[i].path;
+		if (!path)
+			continue;
+		if (channel && !path_equals(skip, path))
+		{
+			const char *name = strrchr(path, DIR_SEPARATOR_CHAR) + 1;
+			fuse_lowlevel_notify_inval_entry(channel, node_invalid[i].parent, name, strlen(name));
+			fuse_lowlevel_notify_inval_inode(channel, node_invalid[i].ino, 0, 0);
+		}
+		explicit_bzero(path, strlen(path));
+		free(path);
+	}
+	free(node_invalid);
+	node_invalid = NULL;
+	node_invalids = 0;
+	return;
+}
+
+static void node_deinit(void)
+{
+	for (unsigned i = 0; i < NODE_CHUNKS && nodes[i]; i++)
+	{
+		for (unsigned j = 0; j < NODE_CHUNK; j++)
+			if (nodes[i][j].path)
+			{
+				explicit_bzero(nodes[i][j].path, strlen(nodes[i][j].path));
+				free(nodes[i][j].path);
+			}
+		free(nodes[i]);
+		nodes[i] = NULL;
+	}
+	node_next = FUSE_ROOT_ID;
+	node_unused = 0;
+	return;
 }
 
 int main(int argc, char **argv)
@@ -666,7 +2330,7 @@ int main(int argc, char **argv)
 	errno = EXIT_SUCCESS;
 	if (!args.help)
 	{
-		switch (stegfs_init(args.fs, args.paranoid, args.cipher, args.mode, args.hash, args.mac, args.duplicates, args.show_bloc))
+		switch (stegfs_init(args.fs, args.paranoid, args.cipher, args.mode, args.hash, args.mac, args.duplicates, args.stripes, args.features, args.blocksize, args.show_bloc))
 		{
 			case STEGFS_INIT_OKAY:
 				goto done;
@@ -693,8 +2357,96 @@ int main(int argc, char **argv)
 	}
 
 done:
+	stegfs_cache_limit(args.cache_size * MEGABYTE, args.cache_ttl);
 	init_deinit(args);
+
 	struct fuse_args f = FUSE_ARGS_INIT(fargc, fargs);
-	fuse_opt_parse(&f, NULL, NULL, NULL);
-	return fuse_main(f.argc, f.argv, &fuse_stegfs_functions, NULL);
+	char *mount = NULL;
+	int mt = 0;
+	int fg = 0;
+	int e = EXIT_FAILURE;
+	struct fuse_session *s = NULL;
+	/* the kernel’s cache timeouts are taken out before FUSE sees them */
+	if (fuse_opt_parse(&f, &timeout, timeout_options, NULL) < 0)
+		goto end;
+	/*
+	 * reads can only be as large as the mount allows (added last so it
+	 * overrides anything given, as the library checks it matches what’s
+	 * asked for in init)
+	 */
+	char max_read[32] = { 0x0 };
+	snprintf(max_read, sizeof max_read, "-omax_read=%d", MAX_REQUEST);
+	fuse_opt_add_arg(&f, max_read);
+#ifdef USE_FUSE3
+	struct fuse_cmdline_opts o;
+	memset(&o, 0x00, sizeof o);
+	if (fuse_parse_cmdline(&f, &o) < 0)
+		goto end;
+	mount = o.mountpoint;
+	mt = !o.singlethread;
+	fg = o.foreground;
+	if (args.help || o.show_help)
+	{
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		e = EXIT_SUCCESS;
+		goto end;
+	}
+#else
+	if (fuse_parse_cmdline(&f, &mount, &mt, &fg) < 0)
+		goto end;
+	if (args.help)
+	{
+		e = EXIT_SUCCESS;
+		goto end;
+	}
+#endif
+
+	/* the root directory is always node 1, and is never forgotten */
+	stegfs_lock(true);
+	pthread_mutex_lock(&node_lock);
+	fuse_ino_t root = node_alloc();
+	nodes[0][root].path = strdup(DIR_SEPARATOR);
+	nodes[0][root].lookups = 1;
+	node_bind(root, stegfs_cache_exists(DIR_SEPARATOR, NULL));
+	pthread_mutex_unlock(&node_lock);
+	stegfs_unlock();
+	stegfs_cache_watch(node_dropped);
+
+#ifdef USE_FUSE3
+	if (!(s = fuse_session_new(&f, &fuse_stegfs_functions, sizeof fuse_stegfs_functions, NULL)))
+		goto end;
+	if (!fuse_set_signal_handlers(s))
+	{
+		if (!fuse_session_mount(s, mount))
+		{
+			channel = s;
+			fuse_daemonize(fg);
+			e = mt ? fuse_session_loop_mt(s, o.clone_fd) : fuse_session_loop(s);
+			fuse_session_unmount(s);
+		}
+		fuse_remove_signal_handlers(s);
+	}
+	fuse_session_destroy(s);
+#else
+	if (!(channel = fuse_mount(mount, &f)))
+		goto end;
+	if ((s = fuse_lowlevel_new(&f, &fuse_stegfs_functions, sizeof fuse_stegfs_functions, NULL)))
+	{
+		if (!fuse_set_signal_handlers(s))
+		{
+			fuse_session_add_chan(s, channel);
+			fuse_daemonize(fg);
+			e = mt ? fuse_session_loop_mt(s) : fuse_session_loop(s);
+			fuse_remove_signal_handlers(s);
+			fuse_session_remove_chan(channel);
+		}
+		fuse_session_destroy(s);
+	}
+	fuse_unmount(mount, channel);
+#endif
+end:
+	free(mount);
+	fuse_opt_free_args(&f);
+	return e ? EXIT_FAILURE : EXIT_SUCCESS;
 }
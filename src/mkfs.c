@@ -43,6 +43,7 @@
 
 #include "stegfs.h"
 #include "init.h"
+#include "ecc.h"
 
 extern bool is_stegfs(void)
 {
@@ -145,7 +146,7 @@ static gcry_cipher_hd_t crypto_init(enum gcry_cipher_algos c, enum gcry_cipher_m
 	return cipher_handle;
 }
 
-static void superblock_info(stegfs_block_t *sb, const char *cipher, const char *mode, const char *hash, const char *mac, uint8_t copies)
+static void superblock_info(stegfs_superblock_t *sb, const char *cipher, const char *mode, const char *hash, const char *mac, uint8_t copies, uint8_t stripes, uint32_t features, uint32_t blocksize)
 {
 	TLV_HANDLE tlv = tlv_init();
 
@@ -158,7 +159,7 @@ static void superblock_info(stegfs_block_t *sb, const char *cipher, const char *
 	tlv_append(&tlv, t);
 
 	t.tag = TAG_BLOCKSIZE;
-	uint32_t blocksize = htonl(SIZE_BYTE_BLOCK);
+	blocksize = htonl(blocksize);
 	t.length = sizeof blocksize;
 	t.value = malloc(sizeof blocksize);
 	memcpy(t.value, &blocksize, sizeof blocksize);
@@ -200,6 +201,24 @@ static void superblock_info(stegfs_block_t *sb, const char *cipher, const char *
 	tlv_append(&tlv, t);
 	free(t.value);
 
+	t.tag = TAG_FEATURES;
+	features = htonl(features);
+	t.length = sizeof features;
+	t.value = malloc(sizeof features);
+	memcpy(t.value, &features, sizeof features);
+	tlv_append(&tlv, t);
+	free(t.value);
+
+	if (ntohl(features) & FEATURE_STRIPE)
+	{
+		t.tag = TAG_STRIPES;
+		t.length = sizeof stripes;
+		t.value = malloc(sizeof stripes);
+		memcpy(t.value, &stripes, sizeof stripes);
+		tlv_append(&tlv, t);
+		free(t.value);
+	}
+
 	uint64_t tags = htonll(tlv_count(tlv));
 	memcpy(sb->data, &tags, sizeof tags);
 	memcpy(sb->data + sizeof tags, tlv_export(tlv), tlv_size(tlv));
@@ -228,7 +247,7 @@ int main(int argc, char **argv)
 
 	int64_t fs = open_filesystem(path, &args.size, args.force, args.rewrite_sb, args.dry_run);
 
-	uint64_t blocks = args.size / SIZE_BYTE_BLOCK;
+	uint64_t blocks = args.size / args.blocksize;
 	void *mm = NULL;
 	if (args.dry_run)
 		printf("Test run     : File system not modified\n");
@@ -259,6 +278,7 @@ int main(int argc, char **argv)
 	if (r < 7)
 		r = 7;
 	printf("Blocks       : %*s\n", r, s1);
+	printf("Block size   : %*" PRIu32 " KB\n", r, args.blocksize / KILOBYTE);
 
 	double z = args.size / MEGABYTE;
 	char units[] = "MB";
@@ -267,7 +287,15 @@ int main(int argc, char **argv)
 	s2 = strchr(s1, '.');
 	l = s2 - s1;
 	printf("Size         : %'*.*g %s\n", r, (l + 2), z, units);
-	if ((z = ((double)args.size / SIZE_BYTE_BLOCK * SIZE_BYTE_DATA) / MEGABYTE) < 1)
+	size_t datasize = args.blocksize - SIZE_BYTE_PATH - SIZE_BYTE_HASH - SIZE_BYTE_NEXT;
+	if (args.features & FEATURE_ECC)
+	{
+		/* as stegfs_init works it out */
+		size_t length = gcry_cipher_get_algo_blklen(args.cipher);
+		size_t e = ECC_PAYLOAD(args.blocksize) - SIZE_BYTE_PATH;
+		datasize = e - e % length - SIZE_BYTE_HASH - SIZE_BYTE_NEXT;
+	}
+	if ((z = ((double)blocks * datasize) / MEGABYTE) < 1)
 	{
 		z *= KILOBYTE;
 		strcpy(units, "KB");
@@ -279,12 +307,17 @@ int main(int argc, char **argv)
 	s2 = strchr(s1, '.');
 	l = s2 - s1;
 	printf("Capacity     : %'*.*g %s\n", r, (l + 2), z, units);
-	printf("Largest file : %'*.*g %s\n", r, (l + 2), z / args.duplicates, units);
-	printf("Duplication  : %*d ×\n", args.rewrite_sb ? 0 : r, args.duplicates);
+	printf("Largest file : %'*.*g %s\n", r, (l + 2), z * args.stripes / args.duplicates, units);
+	printf("Duplication  : %*d ×%s\n", args.rewrite_sb ? 0 : r, args.duplicates, args.features & FEATURE_COPIES ? " (unless chosen per file)" : "");
+	if (args.features & FEATURE_STRIPE)
+		printf("Stripes      : %*d + %d parity\n", args.rewrite_sb ? 0 : r, args.stripes, args.duplicates - args.stripes);
 	printf("Cipher       : %s\n", cipher_name_from_id(args.cipher));
 	printf("Cipher mode  : %s\n", mode_name_from_id(args.mode));
 	printf("Hash         : %s\n", hash_name_from_id(args.hash));
 	printf("MAC          : %s\n", mac_name_from_id(args.mac));
+	printf("Index blocks : %s\n", args.features & FEATURE_INDEX ? "Yes" : "No");
+	printf("ECC          : %s\n", args.features & FEATURE_ECC ? "Yes" : "No");
+	printf("Compression  : %s\n", args.features & FEATURE_COMPRESS ? "Yes" : "No");
 
 	if (args.rewrite_sb || args.dry_run)
 		goto superblock;
@@ -322,12 +355,12 @@ superblock:
 	if (args.paranoid)
 		goto done;
 
-	stegfs_block_t sb;
+	stegfs_superblock_t sb;
 	gcry_create_nonce(&sb, sizeof sb);
 	sb.path[0] = htonll(PATH_MAGIC_0);
 	sb.path[1] = htonll(PATH_MAGIC_1);
 
-	superblock_info(&sb, cipher_name_from_id(args.cipher), mode_name_from_id(args.mode), hash_name_from_id(args.hash), mac_name_from_id(args.mac), args.duplicates);
+	superblock_info(&sb, cipher_name_from_id(args.cipher), mode_name_from_id(args.mode), hash_name_from_id(args.hash), mac_name_from_id(args.mac), args.duplicates, args.stripes, args.features, args.blocksize);
 
 	sb.hash[0] = htonll(HASH_MAGIC_0);
 	sb.hash[1] = htonll(HASH_MAGIC_1);
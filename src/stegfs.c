@@ -30,6 +30,7 @@
 #include <netinet/in.h>
 
 #include <gcrypt.h>
+#include <zlib.h>
 
 #include "common/common.h"
 #include "common/ccrypt.h"
@@ -37,6 +38,7 @@
 #include "common/dir.h"
 
 #include "stegfs.h"
+#include "ecc.h"
 
 
 #define normalize(I) ((I)%(file_system.size/file_system.blocksize))
@@ -45,19 +47,95 @@
 static version_e parse_version(const char *v);
 
 static bool block_read(uint64_t, stegfs_block_t *, gcry_cipher_hd_t, const char * const restrict);
-static bool block_write(uint64_t, stegfs_block_t, gcry_cipher_hd_t, const char * const restrict);
+static bool block_write(uint64_t, stegfs_block_t *, gcry_cipher_hd_t, const char * const restrict);
+static bool block_intact(uint64_t);
+static bool block_walk(uint64_t, uint64_t *, gcry_cipher_hd_t, const char * const restrict);
+static bool block_resume(gcry_cipher_hd_t, const stegfs_file_t * const restrict, unsigned, uint64_t);
 static void block_delete(uint64_t);
+static void block_prefetch(uint64_t);
 
 static bool block_in_use(uint64_t, const char * const restrict);
-static uint64_t block_assign(const char * const restrict);
+static uint64_t block_assign(const stegfs_file_t * const restrict);
+static bool block_claim(uint64_t, const stegfs_file_t * const restrict);
+static void block_release(uint64_t);
+
+static uint64_t index_count(uint64_t);
+static bool index_assign(stegfs_file_t *, unsigned, uint64_t);
+static bool index_read(stegfs_file_t *, unsigned, gcry_cipher_hd_t);
+static bool index_write(const stegfs_file_t * const restrict, unsigned, gcry_cipher_hd_t);
+
+static size_t cache_key_length(const char * const restrict);
+static uint64_t cache_hash(const char * const restrict, size_t);
+static const char *cache_key(const stegfs_cache_t * const restrict, stegfs_cache_key_e);
+static stegfs_cache_t *cache_map_find(const stegfs_cache_map_t * const restrict, stegfs_cache_key_e, const char * const restrict, size_t);
+static void cache_map_insert(stegfs_cache_map_t *, stegfs_cache_key_e, stegfs_cache_t *);
+static void cache_map_delete(stegfs_cache_map_t *, stegfs_cache_key_e, stegfs_cache_t *);
+static stegfs_cache_t *cache_child(stegfs_cache_t *, const char * const restrict, size_t, size_t);
+static void cache_drop(stegfs_cache_t *);
+static void cache_forget(stegfs_file_t *);
+static uint64_t cache_bytes(const stegfs_file_t * const restrict);
+static void cache_busy(stegfs_cache_t *);
+static void cache_idle(stegfs_cache_t *);
+static void cache_pending(stegfs_cache_t *);
+static void cache_trim(void);
+static void cache_sweep(void *);
+
+static void *slab_alloc(stegfs_slab_t *);
+static void slab_free(stegfs_slab_t *, void *);
+static void slab_sweep(stegfs_slab_t *, void (*)(void *));
+static void slab_destroy(stegfs_slab_t *);
+static char *slab_strndup(const char * const restrict, size_t);
+static void slab_strfree(char *);
+
+static unsigned copies_max(void);
+static void file_copies(stegfs_file_t *);
+static uint64_t file_blocks(uint64_t);
+static uint8_t *file_compress(const stegfs_file_t * const restrict, uint64_t *);
+static bool file_expand(stegfs_file_t *, const uint8_t * const restrict, uint64_t);
+static void file_discard(uint8_t *, uint64_t);
+static bool file_room(uint64_t, unsigned);
+static bool file_read_blocks(stegfs_file_t *);
+static stegfs_file_t *file_alloc(void);
+static void file_sweep(void *);
+static void file_block(const stegfs_file_t * const restrict, unsigned, uint64_t, uint64_t, const uint8_t * const restrict, uint8_t *);
+static void file_tail(const stegfs_file_t * const restrict, uint64_t, uint8_t *);
+static void file_mac(const stegfs_file_t * const restrict, uint64_t, const uint8_t * const restrict, gcry_mac_hd_t, uint8_t *, size_t *);
+static bool file_read_stripes(stegfs_file_t *, uint64_t, gcry_cipher_hd_t, gcry_mac_hd_t, const uint8_t * const restrict, size_t);
+static bool file_write_copy(const stegfs_file_t * const restrict, unsigned, uint64_t, const uint8_t * const restrict, gcry_cipher_hd_t);
+static bool file_write_inodes(const stegfs_file_t * const restrict, uint64_t, const uint8_t * const restrict, size_t);
+static uint64_t file_scrub(stegfs_file_t *, stegfs_scrub_stats_t *);
+
+static stegfs_negative_t *negative_slot(const char * const restrict, uint8_t *);
+
+static void inode_locate(stegfs_file_t *);
+static bool inode_size(const stegfs_block_t * const restrict, uint64_t *, uint64_t *);
+static unsigned inode_copies(const stegfs_block_t * const restrict, unsigned);
+static void stat_pending(void);
 
 static gcry_cipher_hd_t init_cipher(const stegfs_file_t * const restrict, uint8_t);
+static void init_iv(gcry_cipher_hd_t, const stegfs_file_t * const restrict, uint8_t);
 static gcry_mac_hd_t init_mac(const stegfs_file_t * const restrict, uint8_t);
 
 
 static stegfs_t file_system;
 
-extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid, enum gcry_cipher_algos cipher, enum gcry_cipher_modes mode, enum gcry_md_algos hash, enum gcry_mac_algos mac, uint32_t dups, bool show_bloc)
+/*
+ * the namespace lock guards the cache tree and its indexes; the idle list,
+ * negative cache and /bloc/ names have their own locks as they’re updated
+ * by threads which only share the namespace (these are always taken last)
+ */
+static pthread_rwlock_t namespace_lock;
+static pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t negative_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t bloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* kept apart from file_system so taking a copy of that doesn’t race it */
+static uint64_t blocks_used;
+static uint64_t blocks_corrected;
+
+static uint64_t placements; /* files placed, to tell each placement apart */
+
+extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid, enum gcry_cipher_algos cipher, enum gcry_cipher_modes mode, enum gcry_md_algos hash, enum gcry_mac_algos mac, uint32_t dups, uint32_t stripes, uint32_t features, size_t blocksize, bool show_bloc)
 {
 	if ((file_system.handle = open(fs, O_RDWR, S_IRUSR | S_IWUSR)) < 0)
 		return STEGFS_INIT_UNKNOWN;
@@ -66,10 +144,35 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 	if ((file_system.memory = mmap(NULL, file_system.size, PROT_READ | PROT_WRITE, MAP_SHARED, file_system.handle, 0)) == MAP_FAILED)
 		return STEGFS_INIT_UNKNOWN;
 
+	/*
+	 * prefer writers, otherwise a steady stream of reads could keep
+	 * anything from being written
+	 */
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&namespace_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	memset(&file_system.cache, 0x00, sizeof file_system.cache);
 	file_system.cache.name = strdup(DIR_SEPARATOR);
-	file_system.cache.ents = 0;
-	file_system.cache.child = NULL;
-	file_system.cache.file = NULL;
+	file_system.cache.path = strdup(DIR_SEPARATOR);
+	memset(&file_system.slab_cache, 0x00, sizeof file_system.slab_cache);
+	file_system.slab_cache.size = sizeof( stegfs_cache_t );
+	memset(&file_system.slab_file, 0x00, sizeof file_system.slab_file);
+	for (unsigned i = 0; i < SLAB_STRINGS; i++)
+	{
+		memset(&file_system.slab_string[i], 0x00, sizeof file_system.slab_string[i]);
+		file_system.slab_string[i].size = SLAB_STRING_MIN << i;
+	}
+	memset(&file_system.cache_index, 0x00, sizeof file_system.cache_index);
+	file_system.cache_newest = NULL;
+	file_system.cache_oldest = NULL;
+	file_system.cache_pending = NULL;
+	stegfs_cache_limit(CACHE_BUDGET_DEFAULT * MEGABYTE, CACHE_TTL_DEFAULT);
+	memset(&file_system.cache_stats, 0x00, sizeof file_system.cache_stats);
+	memset(&file_system.scrub_stats, 0x00, sizeof file_system.scrub_stats);
+	file_system.negative = calloc(NEGATIVE_MAX, sizeof( stegfs_negative_t ));
 	if ((file_system.show_bloc = show_bloc))
 		stegfs_cache_add(PATH_BLOC, NULL);
 	if (paranoid)
@@ -78,13 +181,15 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 		file_system.mode = mode;
 		file_system.hash = hash;
 		file_system.mac = mac;
-		file_system.blocksize = SIZE_BYTE_BLOCK;
+		file_system.blocksize = blocksize;
 		file_system.head_offset = OFFSET_BYTE_HEAD;
 		file_system.copies = dups;
+		file_system.features = features;
+		file_system.stripes = (features & FEATURE_STRIPE) ? stripes : 1;
 		goto done;
 	}
 
-	stegfs_block_t block;
+	stegfs_superblock_t block;
 	memcpy(&block, file_system.memory, sizeof block);
 	/* quick check for previous version; account for all byte orders */
 	if ((block.hash[0] == HASH_MAGIC_201001_0 || htonll(block.hash[0]) == HASH_MAGIC_201001_0)
@@ -195,6 +300,8 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 		return STEGFS_INIT_MISSING_TAG;
 	memcpy(&file_system.blocksize, tlv_value_of(tlv, TAG_BLOCKSIZE), tlv_length_of(tlv, TAG_BLOCKSIZE));
 	file_system.blocksize = ntohl(file_system.blocksize);
+	if (file_system.blocksize < SIZE_BYTE_BLOCK || file_system.blocksize > SIZE_BYTE_BLOCK_MAX || (file_system.blocksize & (file_system.blocksize - 1)))
+		return STEGFS_INIT_INVALID_TAG;
 
 	/* get number of bytes file data in file header */
 	if (!tlv_has_tag(tlv, TAG_HEADER_OFFSET))
@@ -209,15 +316,51 @@ extern stegfs_init_e stegfs_init(const char * const restrict fs, bool paranoid,
 	if (file_system.copies <= 0 || file_system.copies > COPIES_MAX)
 		return STEGFS_INIT_INVALID_TAG;
 
+	/* get optional features */
+	file_system.features = FEATURE_NONE;
+	if (tlv_has_tag(tlv, TAG_FEATURES))
+	{
+		memcpy(&file_system.features, tlv_value_of(tlv, TAG_FEATURES), tlv_length_of(tlv, TAG_FEATURES));
+		file_system.features = ntohl(file_system.features);
+	}
+	if (file_system.features & ~(FEATURE_INDEX | FEATURE_ECC | FEATURE_STRIPE | FEATURE_COMPRESS | FEATURE_COPIES))
+		return STEGFS_INIT_INVALID_TAG;
+
+	/* get number of data stripes (the other copies are their parity) */
+	file_system.stripes = 1;
+	if (file_system.features & FEATURE_STRIPE)
+	{
+		if (!tlv_has_tag(tlv, TAG_STRIPES))
+			return STEGFS_INIT_MISSING_TAG;
+		uint8_t k = 0;
+		memcpy(&k, tlv_value_of(tlv, TAG_STRIPES), sizeof k);
+		if ((file_system.stripes = k) < 2 || file_system.stripes >= file_system.copies)
+			return STEGFS_INIT_INVALID_TAG;
+	}
+
 	tlv_deinit(&tlv);
 
 done:
-	file_system.blocks.used = 1;
+	blocks_used = 1; /* the superblock */
+	blocks_corrected = 0;
 	file_system.blocks.in_use = calloc(file_system.size / file_system.blocksize, sizeof( bool ));
 	if (file_system.show_bloc)
 		file_system.blocks.file = calloc(file_system.size / file_system.blocksize, sizeof( char * ));
 
 	init_crypto();
+	file_system.datasize = file_system.blocksize - SIZE_BYTE_PATH - SIZE_BYTE_HASH - SIZE_BYTE_NEXT;
+	if (file_system.features & FEATURE_ECC)
+	{
+		/*
+		 * the parity comes out of the data, which must still leave the
+		 * encrypted part of a block a whole number of cipher blocks
+		 */
+		size_t length = gcry_cipher_get_algo_blklen(file_system.cipher);
+		size_t z = ECC_PAYLOAD(file_system.blocksize) - SIZE_BYTE_PATH;
+		file_system.datasize = z - z % length - SIZE_BYTE_HASH - SIZE_BYTE_NEXT;
+	}
+	if (file_system.features & (FEATURE_ECC | FEATURE_STRIPE))
+		ecc_init();
 	return STEGFS_INIT_OKAY;
 }
 
@@ -246,7 +389,7 @@ extern void stegfs_deinit(void)
 	free(file_system.blocks.in_use);
 	if (file_system.show_bloc)
 	{
-		for (uint64_t i = 0; i < file_system.blocks.used; i++)
+		for (uint64_t i = 0; i < file_system.size / file_system.blocksize; i++)
 			if (file_system.blocks.file[i])
 				free(file_system.blocks.file[i]);
 		free(file_system.blocks.file);
@@ -254,45 +397,103 @@ extern void stegfs_deinit(void)
 
 	stegfs_cache_remove(DIR_SEPARATOR);
 	free(file_system.cache.name);
+	free(file_system.cache.path);
+	slab_destroy(&file_system.slab_cache);
+	slab_destroy(&file_system.slab_file);
+	for (unsigned i = 0; i < SLAB_STRINGS; i++)
+		slab_destroy(&file_system.slab_string[i]);
+	free(file_system.negative);
+	pthread_rwlock_destroy(&namespace_lock);
 
 	return;
 }
 
 extern stegfs_t stegfs_info(void)
 {
-	return file_system;
+	/* the idle list and its counters change under a shared lock */
+	pthread_mutex_lock(&lru_lock);
+	stegfs_t info = file_system;
+	pthread_mutex_unlock(&lru_lock);
+	info.blocks.used = __atomic_load_n(&blocks_used, __ATOMIC_RELAXED);
+	info.blocks.corrected = __atomic_load_n(&blocks_corrected, __ATOMIC_RELAXED);
+	return info;
 }
 
-extern bool stegfs_file_will_fit(stegfs_file_t *file)
+extern void stegfs_lock(bool exclusive)
 {
-	stegfs_block_t block;
-	lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-	uint64_t blocks_needed = (d.quot + (d.rem > 0)) * file_system.copies;
+	if (exclusive)
+		pthread_rwlock_wrlock(&namespace_lock);
+	else
+		pthread_rwlock_rdlock(&namespace_lock);
+	return;
+}
 
-	uint64_t blocks_total = (file_system.size / file_system.blocksize) - 1;
-	if (blocks_needed > blocks_total)
-	{
-		stegfs_file_delete(file);
-		return errno = EFBIG, false; /* file would not fit in the file system */
-	}
-	if (blocks_needed > blocks_total - file_system.blocks.used)
+extern bool stegfs_trylock(bool exclusive)
+{
+	if (exclusive)
+		return !pthread_rwlock_trywrlock(&namespace_lock);
+	return !pthread_rwlock_tryrdlock(&namespace_lock);
+}
+
+extern void stegfs_unlock(void)
+{
+	pthread_rwlock_unlock(&namespace_lock);
+	return;
+}
+
+extern void stegfs_file_lock(stegfs_file_t *file)
+{
+	pthread_mutex_lock(&file->lock);
+	return;
+}
+
+extern void stegfs_file_unlock(stegfs_file_t *file)
+{
+	pthread_mutex_unlock(&file->lock);
+	return;
+}
+
+extern bool stegfs_file_will_fit(stegfs_file_t *file, bool exact)
+{
+	uint64_t stored = file->size;
+	if (file_system.features & FEATURE_COMPRESS)
 	{
-		stegfs_file_delete(file);
-		return errno = ENOSPC, false; /* file won’t fit in remaining space */
+		/*
+		 * how much room a compressed file needs isn’t known until it’s
+		 * compressed, which is only worth doing once it’s finished with;
+		 * until then it needs at least the length of each group and as
+		 * much as deflate could possibly squeeze it in to
+		 */
+		uint64_t groups = (file->size + SIZE_BYTE_GROUP - 1) / SIZE_BYTE_GROUP;
+		if (exact)
+			file_discard(file_compress(file, &stored), stored);
+		else
+			stored = groups * sizeof( uint32_t ) + file->size / DEFLATE_RATIO_MAX;
 	}
-	return errno = EXIT_SUCCESS, true;
+	if (file_room(stored, file->copies))
+		return true;
+	int e = errno;
+	stegfs_file_delete(file);
+	return errno = e, false;
 }
 
 extern void stegfs_file_create(const char * const restrict path, bool write)
 {
+	dir_view_t view;
+	if (!dir_view(&view, path, PASSWORD_SEPARATOR))
+		return;
 	stegfs_file_t file;
-	//memset(&file, 0x00, sizeof file);
-	file.path = dir_get_path(path);
-	file.name = dir_get_name(path, PASSWORD_SEPARATOR);
-	file.pass = dir_get_pass(path);
+	memset(&file, 0x00, sizeof file);
+	file.path = dir_span_dupa(&view, view.dir);
+	file.name = dir_span_dupa(&view, view.name);
+	file.pass = dir_span_dupa(&view, view.pass);
 	file.write = write;
+	file.walked = true; /* nothing to find yet */
 	file.size = 0;
 	file.time = time(NULL);
+	/* as many copies as the directory gives new files */
+	stegfs_cache_t *dir = stegfs_cache_exists(file.path, NULL);
+	file.copies = dir && dir->copies ? dir->copies : file_system.copies;
 	stegfs_cache_add(NULL, &file);
 	return;
 }
@@ -302,136 +503,201 @@ extern void stegfs_directory_create(const char * const restrict path)
 	stegfs_cache_add(path, NULL);
 }
 
-extern bool stegfs_file_stat_aux(stegfs_file_t *file, bool quick)
+extern bool stegfs_directory_copies(stegfs_cache_t *dir, unsigned copies)
 {
+	if (!(file_system.features & FEATURE_COPIES))
+		return errno = ENOTSUP, false;
+	/* a striped file needs at least one parity stripe */
+	if (copies && (copies > COPIES_MAX || (file_system.stripes > 1 && copies <= file_system.stripes)))
+		return errno = EINVAL, false;
+	dir->copies = copies;
+	return errno = EXIT_SUCCESS, true;
+}
+
+extern bool stegfs_file_stat_meta(stegfs_file_t *file)
+{
+	inode_locate(file);
 	/*
-	 * figure out where the files’ inode blocks are
-	 */
-	gcry_md_hd_t hash;
-	gcry_md_open(&hash, GCRY_MD_SHA512, GCRY_MD_FLAG_SECURE);
-	gcry_md_write(hash, file->path, strlen(file->path));
-	gcry_md_write(hash, file->name, strlen(file->name));
-	uint8_t *inodes = gcry_md_read(hash, GCRY_MD_SHA512);
-	size_t len = gcry_md_get_algo_dlen(GCRY_MD_SHA512);
-	/*
-	 * calculate inode values; must be done here, so we have all of
-	 * them and not just the first that we can read (I wonder if there
-	 * is a better way than rotating the data…)
+	 * the size, timestamp and number of copies are in every inode, so
+	 * stop at the first one that can be read (until then it isn’t
+	 * known how many inodes there are)
 	 */
-	for (unsigned i = 0; i < file_system.copies; i++)
+	bool found = false;
+	gcry_cipher_hd_t cipher_handle = init_cipher(file, 0);
+	for (unsigned i = 0; i < (file->copies ? file->copies : copies_max()) && !found; i++)
 	{
-		memcpy(&file->inodes[i], inodes, sizeof file->inodes[i]);
-		uint8_t b = inodes[0];
-		memmove(inodes, inodes + 1, len - 1);
-		inodes[len] = b;
+		init_iv(cipher_handle, file, i);
+		stegfs_block_t inode;
+		if (!block_read(file->inodes[i], &inode, cipher_handle, file->path))
+			continue;
+		unsigned copies = inode_copies(&inode, i);
+		if (!copies || !inode_size(&inode, &file->size, &file->stored))
+			continue;
+		uint64_t first[SIZE_LONG_DATA];
+		memcpy(first, inode.data, sizeof first);
+		file->time = htonll(first[0]);
+		file->copies = copies;
+		/* the inode at least is known to be in use */
+		block_claim(file->inodes[i], file);
+		found = true;
 	}
-	gcry_md_close(hash);
+	gcry_cipher_close(cipher_handle);
+	if (!found)
+		return errno = ENOENT, false;
+	/* block lists are found when the file is opened, written or scrubbed */
+	file->walked = false;
+	return true;
+}
+
+extern bool stegfs_file_stat_aux(stegfs_file_t *file, bool quick)
+{
+	inode_locate(file);
 	/*
 	 * read file inode, pray for success, then see if we can get a
 	 * complete copy of the file
 	 */
-	unsigned available_inodes = file_system.copies;
+	/*
+	 * until one of its inodes has been read it isn’t known how many
+	 * copies the file has, so every inode it could have is tried
+	 */
+	unsigned copies = file->copies ? file->copies : copies_max();
+	unsigned available_inodes = copies;
 	unsigned corrupt_copies = 0;
 	bool found = false;
-	for (unsigned i = 0; i < file_system.copies; i++)
+	/*
+	 * the key is the same for every inode and copy (only the IV
+	 * differs) so only derive it once
+	 */
+	gcry_cipher_hd_t cipher_handle = init_cipher(file, 0);
+	/* start with the inode of the copy which last read without error */
+	if (file->copy >= copies || !file->copies)
+		file->copy = 0;
+	for (unsigned n = 0; n < copies; n++)
 	{
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
+		unsigned i = (file->copy + n) % copies;
+		init_iv(cipher_handle, file, i);
 		stegfs_block_t inode;
 		//memset(&inode, 0x00, sizeof inode);
 		if (block_read(file->inodes[i], &inode, cipher_handle, file->path))
 		{
-			if ((file->size = ntohll(inode.next)) > file_system.size)
+			/*
+			 * only store the size and time if they’ve changed, as
+			 * threads sharing the namespace may be reading them
+			 */
+			uint64_t size, stored;
+			unsigned c = inode_copies(&inode, i);
+			if (!c || !inode_size(&inode, &size, &stored) || (file->copies && c != file->copies))
 			{
 				available_inodes--;
-				gcry_cipher_close(cipher_handle);
 				continue;
 			}
-			file_system.blocks.in_use[normalize(file->inodes[i])] = true;
-			if (file_system.show_bloc)
-				asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-			file_system.blocks.used++;
+			if (!file->copies)
+			{
+				/* the inodes tried so far were all before this one */
+				available_inodes -= copies - c;
+				copies = file->copies = c;
+			}
+			if (file->size != size)
+				file->size = size;
+			if (file->stored != stored)
+				file->stored = stored;
+			block_claim(file->inodes[i], file);
 			if (!quick && found)
 				continue;
 
 			uint64_t first[SIZE_LONG_DATA];
 			memcpy(first, inode.data, sizeof first);
-			file->time = htonll(first[0]);
-			for (unsigned j = 0, l = 1; j < file_system.copies; j++, l++)
+			if (file->time != (time_t)htonll(first[0]))
+				file->time = htonll(first[0]);
+			for (unsigned j = 0, l = 1; j < copies; j++, l++)
 			{
-				gcry_cipher_hd_t another_cipher = init_cipher(file, j);
-				lldiv_t d = lldiv(file->size - (file->size < (sizeof inode.data - file_system.head_offset) ? file->size : (sizeof inode.data - file_system.head_offset)), SIZE_BYTE_DATA);
-				uint64_t blocks = d.quot + (d.rem > 0);
+				init_iv(cipher_handle, file, j);
+				uint64_t blocks = file_blocks(file->stored);
 				file->blocks[j] = realloc(file->blocks[j], (blocks + 2) * sizeof blocks);
-				//memset(file->blocks[j], 0x00, blocks * sizeof blocks);
+				/*
+				 * a copy which can’t be followed to the end must
+				 * be seen to be, not left with whatever was there
+				 */
+				memset(file->blocks[j] + 1, 0x00, blocks * sizeof blocks);
 				file->blocks[j][0] = blocks;
+				file->blocks[j][blocks + 1] = 0;
+				if (blocks && (file_system.features & FEATURE_INDEX))
+				{
+					/*
+					 * the inode points to the first index block,
+					 * which (with any that follow) lists every
+					 * data block of this copy
+					 */
+					uint64_t n = index_count(blocks);
+					file->index[j] = realloc(file->index[j], (n + 2) * sizeof n);
+					file->index[j][0] = n;
+					file->index[j][1] = htonll(first[l]);
+					file->index[j][n + 1] = 0;
+					init_iv(cipher_handle, file, COPIES_MAX + j);
+					if (!index_read(file, j, cipher_handle))
+						corrupt_copies++;
+					continue;
+				}
 				if (blocks)
 				{
 					/* first full block of file data */
 					file->blocks[j][1] = htonll(first[l]);
-					file_system.blocks.in_use[normalize(file->blocks[j][1])] = true;
-					if (file_system.show_bloc)
-						asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-					file_system.blocks.used++;
+					block_claim(file->blocks[j][1], file);
 				}
 				/*
-				 * traverse file block tree; whilst the
-				 * whole block is read, the actual file
-				 * data is discarded
+				 * traverse file block tree; only the
+				 * address of the next block is decrypted,
+				 * the data is verified when it’s read
 				 */
 				for (uint64_t k = 2 ; k <= blocks; k++)
 				{
-					stegfs_block_t block;
-					//memset(&block, 0x00, sizeof block);
-					if (block_read(file->blocks[j][k - 1], &block, another_cipher, file->path))
-					{
-						file_system.blocks.in_use[normalize(file->blocks[j][k - 1])] = true;
-						if (file_system.show_bloc)
-							asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-						file_system.blocks.used++;
-						file->blocks[j][k] = ntohll(block.next);
-					}
+					if (block_walk(file->blocks[j][k - 1], &file->blocks[j][k], cipher_handle, file->path))
+						block_claim(file->blocks[j][k], file);
 					else
 					{
 						corrupt_copies++;
 						break;
 					}
 				}
-				gcry_cipher_close(another_cipher);
 			}
 			if (quick)
 				break;
-			if (corrupt_copies < file_system.copies)
+			if (corrupt_copies <= copies - file_system.stripes)
 				found = true;
 		}
 		else
 			available_inodes--;
-		gcry_cipher_close(cipher_handle);
 	}
+	gcry_cipher_close(cipher_handle);
 	/*
-	 * as long as there’s a valid inode and one complete copy we’re
-	 * good
+	 * as long as there’s a valid inode and one complete copy (or enough
+	 * complete stripes) we’re good
 	 */
-	if (available_inodes && corrupt_copies < file_system.copies)
+	if (available_inodes && corrupt_copies <= copies - file_system.stripes)
 	{
+		file->walked = true;
+		/* leave the damage for the scrubber to repair */
+		if (corrupt_copies || available_inodes < copies)
+			file->damaged = true;
 		stegfs_cache_add(NULL, file);
 		return true;
 	}
-	for (unsigned i = 0; i < file_system.copies; i++)
+	for (unsigned i = 0; i < copies; i++)
 		if (file->blocks[i])
 		{
-			for (uint64_t j = 1; j < file->blocks[i][0]; j++)
-			{
-				file_system.blocks.in_use[normalize(file->blocks[i][j])] = false;
-				if (file_system.show_bloc)
-				{
-					free(file_system.blocks.file[normalize(file->blocks[i][j])]);
-					file_system.blocks.file[normalize(file->blocks[i][j])] = NULL;
-				}
-				file_system.blocks.used--;
-			}
+			for (uint64_t j = 1; j <= file->blocks[i][0] && file->blocks[i][j]; j++)
+				block_release(file->blocks[i][j]);
 			free(file->blocks[i]);
 			file->blocks[i] = NULL;
 		}
+	for (unsigned i = 0; i < copies; i++)
+		if (file->index[i])
+		{
+			for (uint64_t j = 1; j <= file->index[i][0] && file->index[i][j]; j++)
+				block_release(file->index[i][j]);
+			free(file->index[i]);
+			file->index[i] = NULL;
+		}
 	return errno = ENOENT, false;
 }
 
@@ -439,100 +705,91 @@ extern bool stegfs_file_read(stegfs_file_t *file)
 {
 	if (!stegfs_file_stat(file, true))
 		return false;
-	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
-	uint8_t *mac_data = gcry_calloc_secure(mac_length, sizeof( uint8_t ));
-	/*
-	 * read the start of the file data
-	 */
-	file->data = realloc(file->data, file->size);
-	for (unsigned i = 0, c = 0; i < file_system.copies && !c; i++)
+	if (!(file_system.features & FEATURE_COMPRESS))
 	{
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		stegfs_block_t inode;
-		//memset(&inode, 0x00, sizeof inode);
-		if (block_read(file->inodes[i], &inode, cipher_handle, file->path))
-		{
-			memcpy(file->data, inode.data + file_system.head_offset, file->size < (sizeof inode.data - file_system.head_offset) ? file->size : (sizeof inode.data - file_system.head_offset));
-			memcpy(mac_data, inode.data + ((file_system.copies + 1) * sizeof( uint64_t )), mac_length);
-			c = 1;
-		}
-		gcry_cipher_close(cipher_handle);
+		if (!file_read_blocks(file))
+			return false;
 	}
-	/*
-	 * and then the rest of it
-	 */
-	stegfs_block_t block;
-	for (unsigned i = 0, corrupt_copies = 0; i < file_system.copies; i++)
+	else
 	{
-		lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-		uint64_t blocks = d.quot + (d.rem > 0);
-		if (file->blocks[i][0] != blocks)
-			continue; /* this copy is corrupt; try the next */
-		bool failed = false;
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		gcry_mac_hd_t mac_handle = init_mac(file, i);
-		for (uint64_t j = 1, k = 0; j <= file->blocks[i][0] && file->blocks[i][j]; j++, k++)
-		{
-			/*
-			 * we should be largely confident that we’ll be
-			 * able to read the complete file as otherwise the
-			 * stat would have failed
-			 */
-			//memset(&block, 0x00, sizeof block);
-			if (block_read(file->blocks[i][j], &block, cipher_handle, file->path))
-			{
-				size_t l = sizeof block.data;
-				if ((l + k * sizeof block.data) > (file->size - (sizeof block.data - file_system.head_offset)))
-					l = l - ((l + k * sizeof block.data) - (file->size - (sizeof block.data - file_system.head_offset)));
-				memcpy(file->data + (sizeof block.data - file_system.head_offset) + k * sizeof block.data, block.data, l);
-				gcry_mac_write(mac_handle, block.data, sizeof block.data);
-			}
-			else
-			{
-				failed = true;
-				corrupt_copies++;
-				break;
-			}
-		}
-		gcry_cipher_close(cipher_handle);
-		/* compare generated MAC with stored MAC */
-		if (file_system.version >= VERSION_202X_XX && gcry_mac_verify(mac_handle, mac_data, mac_length) == GPG_ERR_CHECKSUM)
-			failed = true;
-		gcry_mac_close(mac_handle);
-		gcry_free(mac_data);
-		if (failed)
-			continue;
-		stegfs_cache_add(NULL, file);
-		return corrupt_copies < file_system.copies;
+		/*
+		 * read what’s kept in the blocks in to a copy of the file,
+		 * then expand it in to the file itself
+		 */
+		stegfs_file_t packed = *file;
+		packed.data = NULL;
+		bool read = file_read_blocks(&packed) && file_expand(file, packed.data, packed.stored);
+		file->damaged = packed.damaged;
+		file->copy = packed.copy;
+		file_discard(packed.data, packed.stored);
+		if (!read)
+			return errno = EIO, false;
 	}
-	/*
-	 * somehow we failed to read a complete copy of the file, despite
-	 * knowing that a complete copy existed when stat’d
-	 */
-	return errno = EIO, false;
+	stegfs_cache_add(NULL, file);
+	return true;
 }
 
 extern bool stegfs_file_write(stegfs_file_t *file)
 {
-	stegfs_block_t block;
-	lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-	uint64_t blocks = d.quot + (d.rem > 0);
+	stegfs_write_t placement;
+	if (!stegfs_file_place(file, &placement, false))
+		return false;
+	if (stegfs_file_store(file, &placement))
+	{
+		stegfs_cache_add(NULL, file);
+		return true;
+	}
+	if (placement.lost)
+		stegfs_file_delete(file);
+	return false;
+}
+
+extern bool stegfs_file_place(stegfs_file_t *file, stegfs_write_t *placement, bool copy)
+{
+	memset(placement, 0x00, sizeof *placement);
 	uint64_t z = file->size;
-	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
-	uint8_t *mac_data = gcry_calloc_secure(mac_length, sizeof( uint8_t ));
+	/*
+	 * compressed files keep less in their blocks than the plaintext
+	 * (which is left as it is); either way what’s written can be kept
+	 * apart from the plaintext, which may then change before it is
+	 */
+	uint64_t stored = z;
+	uint8_t *packed = NULL;
+	if (file_system.features & FEATURE_COMPRESS)
+	{
+		packed = file_compress(file, &stored);
+		/* anything already written is kept if there isn’t room */
+		if (!file_room(stored, file->copies))
+		{
+			file_discard(packed, stored);
+			return false;
+		}
+	}
+	else if (copy && z)
+	{
+		if (!(packed = malloc(z)))
+			return errno = ENOMEM, false;
+		memcpy(packed, file->data, z);
+	}
+	uint64_t blocks = file_blocks(stored);
 
+	/*
+	 * claim the blocks of any files which have only had their inodes
+	 * read, so they’re not overwritten by this one
+	 */
+	stat_pending();
 	if (!stegfs_file_stat(file, true))
 	{
-		for (unsigned i = 0; i < file_system.copies; i++)
+		/*
+		 * allocate inodes, mark as in use (inode locations are
+		 * calculated in stegfs_file_stat); all of them before any
+		 * data blocks, which could otherwise be given the place of a
+		 * later copy’s inode
+		 */
+		for (unsigned i = 0; i < file->copies; i++)
+			block_claim(file->inodes[i], file);
+		for (unsigned i = 0; i < file->copies; i++)
 		{
-			/*
-			 * allocate inodes, mark as in use (inode locations
-			 * are calculated in stegfs_file_stat)
-			 */
-			file_system.blocks.in_use[normalize(file->inodes[i])] = true;
-			if (file_system.show_bloc)
-				asprintf(&file_system.blocks.file[normalize(file->inodes[i])], "../%s/%s", file->path, file->name);
-			file_system.blocks.used++;
 			/*
 			 * note-to-self: allocate 2 more blocks than is
 			 * necessary so that block[0] indicates how many
@@ -542,173 +799,175 @@ extern bool stegfs_file_write(stegfs_file_t *file)
 			file->blocks[i] = calloc(blocks + 2, sizeof blocks);
 			file->blocks[i][0] = blocks;
 			for (uint64_t j = 1; j <= blocks; j++)
-				if (!(file->blocks[i][j] = block_assign(file->path)))
+				if (!(file->blocks[i][j] = block_assign(file)))
 				{
 					/* failed to allocate space; free what we had claimed */
+					for (unsigned k = 0; k < file->copies; k++)
+						block_release(file->inodes[k]);
 					for (unsigned k = 0; k <= i; k++)
 					{
-						file_system.blocks.in_use[normalize(file->inodes[i])] = false;
-						if (file_system.show_bloc)
-						{
-							free(file_system.blocks.file[normalize(file->inodes[i])]);
-							file_system.blocks.file[normalize(file->inodes[i])] = NULL;
-						}
-						file_system.blocks.used--;
 						if (file->blocks[k])
 						{
-							for (uint64_t l = 1; l <= j; l++)
-							{
-								file_system.blocks.in_use[normalize(file->blocks[k][l])] = false;
-								if (file_system.show_bloc)
-								{
-									free(file_system.blocks.file[normalize(file->blocks[k][l])]);
-									file_system.blocks.file[normalize(file->blocks[k][l])] = NULL;
-								}
-								file_system.blocks.used--;
-							}
+							for (uint64_t l = 1; l < (k < i ? blocks + 1 : j); l++)
+								block_release(file->blocks[k][l]);
 							free(file->blocks[k]);
 							file->blocks[k] = NULL;
 						}
 					}
+					file_discard(packed, stored);
 					return errno = ENOSPC, false;
 				}
-				else if (file_system.show_bloc)
-					asprintf(&file_system.blocks.file[normalize(file->blocks[i][j])], "../%s/%s", file->path, file->name);
 		}
 	}
 	file->size = z; /* stat can cause size to be reset to 0 */
+	file->stored = stored;
 	if (blocks > file->blocks[0][0]) /* need more blocks than we have */
 	{
-		for (unsigned i = 0; i < file_system.copies; i++)
+		for (unsigned i = 0; i < file->copies; i++)
 		{
 			file->blocks[i] = realloc(file->blocks[i], (blocks + 2) * sizeof blocks);
 			for (uint64_t j = file->blocks[i][0]; j <= blocks; j++)
-				if (!(file->blocks[i][j] = block_assign(file->path)))
+				if (!(file->blocks[i][j] = block_assign(file)))
 				{
 					/* failed to allocate space; free what we had claimed */
 					for (unsigned k = 0; k <= i; k++)
 						for (uint64_t l = file->blocks[k][0]; l <= j; l++)
-						{
-							file_system.blocks.in_use[normalize(file->blocks[k][l])] = false;
-							if (file_system.show_bloc)
-							{
-								free(file_system.blocks.file[normalize(file->blocks[k][l])]);
-								file_system.blocks.file[normalize(file->blocks[k][l])] = NULL;
-							}
-							file_system.blocks.used--;
-						}
+							block_release(file->blocks[k][l]);
+					file_discard(packed, stored);
 					return errno = ENOSPC, false;
 				}
-				else if (file_system.show_bloc)
-					asprintf(&file_system.blocks.file[normalize(file->blocks[i][j])], "../%s/%s", file->path, file->name);
 		}
-		for (unsigned i = 0; i < file_system.copies; i++)
+		for (unsigned i = 0; i < file->copies; i++)
 			file->blocks[i][0] = blocks;
 	}
 	else if (blocks < file->blocks[0][0]) /* have more blocks than we need */
-		for (unsigned i = 0; i < file_system.copies; i++)
+		for (unsigned i = 0; i < file->copies; i++)
 		{
 			for (uint64_t j = blocks + 1; j <= file->blocks[i][0]; j++)
 				block_delete(file->blocks[i][j]);
 			file->blocks[i] = realloc(file->blocks[i], (blocks + 2) * sizeof blocks);
 			file->blocks[i][0] = blocks;
 		}
+	for (unsigned i = 0; i < file->copies; i++)
+		file->blocks[i][blocks + 1] = 0;
 	/*
-	 * write the data
+	 * make sure each copy has enough index blocks to list all of its
+	 * data blocks
 	 */
-	for (unsigned i = 0; i < file_system.copies; i++)
-	{
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		gcry_mac_hd_t mac_handle = init_mac(file, i);
-		for (uint64_t j = 1, k = 0; j <= blocks; j++, k++)
-		{
-			size_t l = sizeof block.data;
-			if ((l + k * sizeof block.data) > (file->size - (sizeof block.data - file_system.head_offset)))
-				l = l - ((l + k * sizeof block.data) - (file->size - (sizeof block.data - file_system.head_offset)));
-			gcry_create_nonce(&block, sizeof block);
-			memcpy(block.data, file->data + (sizeof block.data - file_system.head_offset) + k * sizeof block.data, l);
-			block.next = htonll(file->blocks[i][j + 1]);
-			if (!i)
-				gcry_mac_write(mac_handle, block.data, sizeof block.data);
-			if (!block_write(file->blocks[i][j], block, cipher_handle, file->path))
+	if (file_system.features & FEATURE_INDEX)
+		for (unsigned i = 0; i < file->copies; i++)
+			if (!index_assign(file, i, blocks))
 			{
-				/* see below (where inode blocks are written) */
-				for (unsigned k = 0; k <= i; k++)
-					for (uint64_t l = 1; l <= j; l++)
-						block_delete(file->blocks[k][l]);
-				gcry_cipher_close(cipher_handle);
-				gcry_mac_close(mac_handle);
-				return false;
+				file_discard(packed, stored);
+				return errno = ENOSPC, false;
 			}
+	placement->data = packed;
+	placement->size = z;
+	placement->stored = stored;
+	placement->time = file->time;
+	placement->placed = file->placed = ++placements;
+	return true;
+}
+
+extern bool stegfs_file_store(stegfs_file_t *file, stegfs_write_t *placement)
+{
+	errno = EXIT_SUCCESS;
+	bool stored = true;
+	/*
+	 * a file which has gone (or been placed again, and so written from
+	 * newer data) since has nothing left to write
+	 */
+	if (!file || file->placed != placement->placed)
+		goto done;
+	uint64_t blocks = file_blocks(placement->stored);
+	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
+	uint8_t *mac_data = gcry_calloc_secure(mac_length, sizeof( uint8_t ));
+	/*
+	 * write the data; every copy is padded the same after the end of
+	 * the file, so a file read from a mix of copies (or rebuilt from
+	 * its stripes) still matches the MAC; it’s written from a view of
+	 * the file as it was placed, with the compressed data (or copy of
+	 * the plaintext) in place of its own
+	 */
+	stegfs_file_t view = *file;
+	view.size = placement->size;
+	view.stored = placement->stored;
+	view.time = placement->time;
+	if (placement->data)
+		view.data = placement->data;
+	uint8_t *tail = malloc(file_system.stripes * file_system.datasize);
+	file_tail(&view, blocks, tail);
+	gcry_mac_hd_t mac_handle = init_mac(file, 0);
+	file_mac(&view, blocks, tail, mac_handle, mac_data, &mac_length);
+	gcry_mac_close(mac_handle);
+	gcry_cipher_hd_t cipher_handle = init_cipher(file, 0);
+	for (unsigned i = 0; i < file->copies; i++)
+		if (!file_write_copy(&view, i, blocks, tail, cipher_handle))
+		{
+			gcry_cipher_close(cipher_handle);
+			/* the blocks will at least be marked as available */
+			for (unsigned k = 0; k <= i; k++)
+				for (uint64_t l = 1; l <= blocks; l++)
+					block_delete(file->blocks[k][l]);
+			gcry_free(mac_data);
+			free(tail);
+			stored = false;
+			goto done;
 		}
-		/* store the calculated MAC for read verification */
-		if (!i)
-			gcry_mac_read(mac_handle, mac_data, &mac_length);
-		gcry_mac_close(mac_handle);
-		gcry_cipher_close(cipher_handle);
-	}
+	gcry_cipher_close(cipher_handle);
+	free(tail);
 	/*
 	 * write file inode blocks
 	 */
-	stegfs_block_t inode;
-	gcry_create_nonce(&inode, sizeof inode);
-	uint64_t first[SIZE_LONG_DATA];
-	if (blocks)
-		for (unsigned i = 0, j = 1; i < file_system.copies; i++, j++)
-			first[j] = htonll(file->blocks[i][1]);
-	else
-		gcry_create_nonce(first, sizeof first);
-	first[0] = htonll(file->time);
-	memcpy(inode.data, first, sizeof first);
-	memcpy(inode.data + ((file_system.copies + 1) * sizeof( uint64_t )), mac_data, mac_length);
+	stored = file_write_inodes(&view, blocks, mac_data, mac_length);
 	gcry_free(mac_data);
-	if (file->data && file->size)
-		memcpy(inode.data + file_system.head_offset, file->data, file->size < (sizeof inode.data - file_system.head_offset) ? file->size : (sizeof inode.data - file_system.head_offset));
-	inode.next = htonll(file->size);
-	for (unsigned i = 0; i < file_system.copies; i++)
+	if (!stored)
 	{
-		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
-		if (!block_write(file->inodes[i], inode, cipher_handle, file->path))
-		{
-			for (unsigned j = 0; j <= i; j++)
-				/*
-				 * it’s likely that if a write failed above,
-				 * it won’t work here either, but at least
-				 * the block will be marked as available
-				 * (in fact if a call to write fails it’s
-				 * likely all subsequent write will fail
-				 * too)
-				 */
-				block_delete(file->inodes[j]);
-			stegfs_file_delete(file);
-			gcry_cipher_close(cipher_handle);
-			return false;
-		}
-		gcry_cipher_close(cipher_handle);
+		for (unsigned i = 0; i < file->copies; i++)
+			/*
+			 * it’s likely that if a write failed above, it won’t
+			 * work here either, but at least the block will be
+			 * marked as available (in fact if a call to write
+			 * fails it’s likely all subsequent write will fail
+			 * too)
+			 */
+			block_delete(file->inodes[i]);
+		placement->lost = true;
+		goto done;
 	}
-
-	stegfs_cache_add(NULL, file);
-	return true;
+	file->damaged = false;
+	file->scrubbed = time(NULL);
+done:
+	file_discard(placement->data, placement->stored);
+	placement->data = NULL;
+	return stored;
 }
 
 extern void stegfs_file_delete(stegfs_file_t *file)
 {
-	char *p = NULL;
+	/*
+	 * stat (and delete) the cached file, holding on to it so its block
+	 * lists aren’t evicted in between
+	 */
+	stegfs_cache_t *c = stegfs_cache_add(NULL, file);
+	if (!c || !c->file)
+		return;
+	stegfs_cache_open(c, NULL);
+	file = c->file;
 	if (!stegfs_file_stat(file))
 		goto rfc;
-	stegfs_block_t block;
-	lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-	uint64_t blocks = d.quot + (d.rem > 0);
-	for (unsigned i = 0; i < file_system.copies; i++)
+	uint64_t blocks = file_blocks(file->stored);
+	for (unsigned i = 0; i < file->copies; i++)
 	{
 		block_delete(file->inodes[i]);
-		for (uint64_t j = 1; j <= blocks && file->blocks[i][j]; j++)
+		for (uint64_t j = 1; file->blocks[i] && j <= blocks && file->blocks[i][j]; j++)
 			block_delete(file->blocks[i][j]);
+		if (file->index[i])
+			for (uint64_t j = 1; j <= file->index[i][0] && file->index[i][j]; j++)
+				block_delete(file->index[i][j]);
 	}
 rfc:
-	asprintf(&p, "%s/%s", path_equals(file->path, DIR_SEPARATOR) ? "" : file->path, file->name);
-	stegfs_cache_remove(p);
-	free(p);
+	stegfs_cache_remove(c->path);
 	return;
 }
 
@@ -722,7 +981,22 @@ static bool block_read(uint64_t bid, stegfs_block_t *block, gcry_cipher_hd_t cip
 	bid %= (file_system.size / file_system.blocksize);
 	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
 		return errno = EINVAL, false;
-	memcpy(block, file_system.memory + (bid * file_system.blocksize), sizeof( stegfs_block_t ));
+	const uint8_t *ptr = file_system.memory + (bid * file_system.blocksize);
+	uint8_t *fixed = NULL;
+	if ((file_system.features & FEATURE_ECC) && !ecc_check(ptr, file_system.blocksize))
+	{
+		/*
+		 * correct a copy of the block, as other threads may be looking at
+		 * it; if it can’t be corrected, the hashes decide if it’s any good
+		 */
+		fixed = malloc(file_system.blocksize);
+		memcpy(fixed, ptr, file_system.blocksize);
+		if (ecc_correct(fixed, file_system.blocksize) > 0)
+			__atomic_add_fetch(&blocks_corrected, 1, __ATOMIC_RELAXED);
+		ptr = fixed;
+	}
+	bool valid = false;
+	memcpy(block->path, ptr, sizeof block->path);
 	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
 	uint8_t *hash_buffer = gcry_malloc_secure(hash_length);
 	/* ignore path check in root */
@@ -730,88 +1004,221 @@ static bool block_read(uint64_t bid, stegfs_block_t *block, gcry_cipher_hd_t cip
 	{
 		/* check path hash */
 		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, strlen(path));
-		if (memcmp(block->path, hash_buffer, hash_length))
-		{
-			gcry_free(hash_buffer);
-			return false;
-		}
+		if (memcmp(block->path, hash_buffer, hash_length > sizeof block->path ? sizeof block->path : hash_length))
+			goto done;
 	}
+	/*
+	 * decrypt block, but not the path; the hash and next address are
+	 * stored straight after the data, so move them in to place unless
+	 * the block is the largest size (when they’re already there)
+	 */
+	size_t z = file_system.datasize + sizeof block->hash + sizeof block->next;
+	ptr += sizeof block->path;
 #ifdef __DEBUG__
 	(void)cipher;
+	memcpy(block->data, ptr, z);
 #else
-	/* decrypt block, but not the path */
-	void *ptr = block;
-	ptr += sizeof block->path;
-	gcry_cipher_decrypt(cipher, ptr, file_system.blocksize - sizeof block->path, NULL, 0);
+	gcry_cipher_decrypt(cipher, block->data, z, ptr, z);
 #endif
+	if (file_system.datasize < sizeof block->data)
+		memcpy(block->hash, block->data + file_system.datasize, sizeof block->hash + sizeof block->next);
 	/* check data hash */
-	gcry_md_hash_buffer(file_system.hash, hash_buffer, block->data, sizeof block->data);
-	if (memcmp(block->hash, hash_buffer, hash_length))
-	{
-		gcry_free(hash_buffer);
-		return false;
-	}
+	gcry_md_hash_buffer(file_system.hash, hash_buffer, block->data, file_system.datasize);
+	valid = !memcmp(block->hash, hash_buffer, hash_length > sizeof block->hash ? sizeof block->hash : hash_length);
+done:
 	gcry_free(hash_buffer);
-	return true;
+	free(fixed);
+	return valid;
 }
 
-static bool block_write(uint64_t bid, stegfs_block_t block, gcry_cipher_hd_t cipher, const char * const restrict path)
+/*
+ * NB this fills in the block’s hash, and (unless the block is the largest
+ * size) copies it and the next address to just after the data, as that’s
+ * where they’re stored on disk
+ */
+static bool block_write(uint64_t bid, stegfs_block_t *block, gcry_cipher_hd_t cipher, const char * const restrict path)
 {
 	errno = EXIT_SUCCESS;
 	bid %= (file_system.size / file_system.blocksize);
 	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
 		return errno = EINVAL, false;
-	gcry_create_nonce((void *)block.path, sizeof block.path);
+	uint8_t *ptr = file_system.memory + (bid * file_system.blocksize);
+	gcry_create_nonce(ptr, sizeof block->path);
 	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
 	uint8_t *hash_buffer = gcry_malloc_secure(hash_length);
 	if (!path_equals(path, DIR_SEPARATOR))
 	{
 		/* compute path hash */
 		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, strlen(path));
-		memcpy(block.path, hash_buffer, hash_length > sizeof block.path ? sizeof block.path : hash_length);
+		memcpy(ptr, hash_buffer, hash_length > sizeof block->path ? sizeof block->path : hash_length);
 	}
 	/* compute data hash (includes 0x00 after EOF) */
-	gcry_md_hash_buffer(file_system.hash, hash_buffer, block.data, sizeof block.data);
-	memcpy(block.hash, hash_buffer, hash_length > sizeof block.hash ? sizeof block.hash : hash_length);
+	gcry_md_hash_buffer(file_system.hash, hash_buffer, block->data, file_system.datasize);
+	memcpy(block->hash, hash_buffer, hash_length > sizeof block->hash ? sizeof block->hash : hash_length);
 	gcry_free(hash_buffer);
+	if (file_system.datasize < sizeof block->data)
+		memcpy(block->data + file_system.datasize, block->hash, sizeof block->hash + sizeof block->next);
+	/* encrypt the data, but not the path */
+	size_t z = file_system.datasize + sizeof block->hash + sizeof block->next;
 #ifdef __DEBUG__
 	(void)cipher;
+	memcpy(ptr + sizeof block->path, block->data, z);
 #else
-	/* encrypt the data, but not the path */
-	void *ptr = &block;
-	ptr += sizeof block.path;
-	gcry_cipher_encrypt(cipher, ptr, file_system.blocksize - sizeof block.path, NULL, 0);
+	gcry_cipher_encrypt(cipher, ptr + sizeof block->path, z, block->data, z);
 #endif
-	/*
-	 * TODO: When ECC, sizeof block.data must be SIZE_BYTE_DATA
-	 * (1,976) - 56 == 1920 as shown by:
-	 * 2,048 ÷ 256 = 8 (number of ECC blocks per FS block)
-	 * 249 × 8 = 1,992 (total capacity of FS block)
-	 * 1,992 - 32 - 32 - 8 = 1,920 (capacity of FS block.data)
-	 */
-
-	memcpy(file_system.memory + (bid * file_system.blocksize), &block, sizeof block);
-	//msync(file_system.memory + (bid * file_system.blocksize), sizeof block, MS_SYNC);
+	if (file_system.features & FEATURE_ECC)
+	{
+		/*
+		 * the parity covers everything up to it, including the bytes
+		 * left over to keep the cipher text whole cipher blocks
+		 */
+		z += sizeof block->path;
+		if (z < ECC_PAYLOAD(file_system.blocksize))
+			gcry_create_nonce(ptr + z, ECC_PAYLOAD(file_system.blocksize) - z);
+		ecc_encode(ptr, file_system.blocksize);
+	}
+
+	//msync(file_system.memory + (bid * file_system.blocksize), file_system.blocksize, MS_SYNC);
 	return true;
 }
 
-static void block_delete(uint64_t bid)
+/*
+ * whether a block’s parity agrees with it (always true without ECC)
+ */
+static bool block_intact(uint64_t bid)
 {
 	bid %= (file_system.size / file_system.blocksize);
-	stegfs_block_t block;
-	memcpy(&block, file_system.memory + (bid * file_system.blocksize), sizeof block);
-	gcry_create_nonce(&block, file_system.blocksize);
 	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
-		return;
-	memcpy(file_system.memory + (bid * file_system.blocksize), &block, sizeof block);
-	//msync(file_system.memory + (bid * file_system.blocksize), sizeof block, MS_SYNC);
-	file_system.blocks.in_use[bid] = false;
-	if (file_system.show_bloc)
+		return false;
+	return !(file_system.features & FEATURE_ECC) || ecc_check(file_system.memory + (bid * file_system.blocksize), file_system.blocksize);
+}
+
+/*
+ * find the next block in a chain without reading the whole block: the
+ * path hash is checked in place, and only the last cipher block (which
+ * holds the next block address) is decrypted; the data hash is left to
+ * be checked when the block is actually read
+ */
+static bool block_walk(uint64_t bid, uint64_t *next, gcry_cipher_hd_t cipher, const char * const restrict path)
+{
+	switch (file_system.mode)
 	{
-		free(file_system.blocks.file[bid]);
-		file_system.blocks.file[bid] = NULL;
+		case GCRY_CIPHER_MODE_ECB:
+		case GCRY_CIPHER_MODE_CBC:
+		case GCRY_CIPHER_MODE_CFB:
+			break;
+		default:
+		{
+			/* the tail can’t be decrypted on its own; do it the slow way */
+			stegfs_block_t block;
+			if (!block_read(bid, &block, cipher, path))
+				return false;
+			*next = ntohll(block.next);
+			return true;
+		}
+	}
+	errno = EXIT_SUCCESS;
+	bid %= (file_system.size / file_system.blocksize);
+	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
+		return errno = EINVAL, false;
+	const uint8_t *ptr = file_system.memory + (bid * file_system.blocksize);
+	/* ignore path check in root */
+	if (!path_equals(path, DIR_SEPARATOR))
+	{
+		size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
+		uint8_t *hash_buffer = gcry_malloc_secure(hash_length);
+		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, strlen(path));
+		bool match = !memcmp(ptr, hash_buffer, hash_length > SIZE_BYTE_PATH ? SIZE_BYTE_PATH : hash_length);
+		gcry_free(hash_buffer);
+		if (!match)
+			return false;
+	}
+	/* with ECC the tail is used as is; if it’s damaged, that shows later */
+	const uint8_t *end = ptr + SIZE_BYTE_PATH + file_system.datasize + SIZE_BYTE_HASH + SIZE_BYTE_NEXT;
+#ifdef __DEBUG__
+	(void)cipher;
+	memcpy(next, end - sizeof *next, sizeof *next);
+#else
+	/*
+	 * for ECB, CBC and CFB a cipher block can be decrypted given only
+	 * the cipher text of the block before it; this also leaves the
+	 * handle ready for the next block in the chain
+	 */
+	size_t length = gcry_cipher_get_algo_blklen(file_system.cipher);
+	uint8_t tail[SIZE_BYTE_HASH + SIZE_BYTE_NEXT];
+	size_t z = length < sizeof *next ? sizeof *next : length;
+	if (z > sizeof tail)
+		return errno = EINVAL, false;
+	if (file_system.mode != GCRY_CIPHER_MODE_ECB)
+		gcry_cipher_setiv(cipher, end - z - length, length);
+	gcry_cipher_decrypt(cipher, tail, z, end - z, z);
+	memcpy(next, tail + z - sizeof *next, sizeof *next);
+#endif
+	*next = ntohll(*next);
+	return true;
+}
+
+/*
+ * ready a cipher handle to read a block of a copy without reading those
+ * before it: as when walking a chain, ECB, CBC and CFB only need the last
+ * cipher block of the block before; other modes can only read a copy
+ * from its start
+ */
+static bool block_resume(gcry_cipher_hd_t cipher, const stegfs_file_t * const restrict file, unsigned copy, uint64_t j)
+{
+	if (j == 1)
+	{
+		init_iv(cipher, file, copy);
+		return true;
+	}
+	switch (file_system.mode)
+	{
+		case GCRY_CIPHER_MODE_ECB:
+			return true;
+		case GCRY_CIPHER_MODE_CBC:
+		case GCRY_CIPHER_MODE_CFB:
+			break;
+		default:
+			return false;
 	}
-	file_system.blocks.used--;
+	uint64_t bid = file->blocks[copy][j - 1] % (file_system.size / file_system.blocksize);
+	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
+		return false;
+#ifdef __DEBUG__
+	(void)cipher;
+#else
+	size_t length = gcry_cipher_get_algo_blklen(file_system.cipher);
+	size_t end = SIZE_BYTE_PATH + file_system.datasize + SIZE_BYTE_HASH + SIZE_BYTE_NEXT;
+	gcry_cipher_setiv(cipher, file_system.memory + bid * file_system.blocksize + end - length, length);
+#endif
+	return true;
+}
+
+static void block_delete(uint64_t bid)
+{
+	bid %= (file_system.size / file_system.blocksize);
+	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
+		return;
+	gcry_create_nonce(file_system.memory + (bid * file_system.blocksize), file_system.blocksize);
+	//msync(file_system.memory + (bid * file_system.blocksize), file_system.blocksize, MS_SYNC);
+	block_release(bid);
+	return;
+}
+
+/*
+ * hint that the block will be read soon, so the kernel can fetch it ahead
+ * of when it’s decrypted
+ */
+static void block_prefetch(uint64_t bid)
+{
+	bid %= (file_system.size / file_system.blocksize);
+	if (!bid || (bid * file_system.blocksize + file_system.blocksize > file_system.size))
+		return;
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)(file_system.memory + (bid * file_system.blocksize));
+	uintptr_t end = start + file_system.blocksize;
+	start &= ~(page - 1);
+	madvise((void *)start, end - start, MADV_WILLNEED);
 	return;
 }
 
@@ -823,24 +1230,22 @@ static bool block_in_use(uint64_t bid, const char * const restrict path)
 	/*
 	 * check if the block is in the cache
 	 */
-	if (file_system.blocks.in_use[bid])
+	if (__atomic_load_n(&file_system.blocks.in_use[bid], __ATOMIC_ACQUIRE))
 		return true;
 	/*
 	 * block not found in cache; check if this might belong to a file
 	 * in this directory, or any parent directory
 	 */
 #ifndef __DEBUG__
+	dir_view_t view;
+	if (!dir_view(&view, path, '\0'))
+		return false;
 	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
 	uint8_t *hash_buffer = gcry_malloc_secure(hash_length);
-	char *p = NULL;
-	uint16_t hierarchy = dir_get_deep(path);
-	for (uint16_t i = 1; i < hierarchy; i++)
-	{
-		char *e = dir_get_part(path, i);
-		asprintf(&p, "%s/%s", p ? : "", e ? : "");
-		if (e)
-			free(e);
-		gcry_md_hash_buffer(file_system.hash, hash_buffer, p, strlen(p));
+	for (uint16_t i = 0; i + 1 < view.parts; i++)
+	{
+		/* the path up to and including this element */
+		gcry_md_hash_buffer(file_system.hash, hash_buffer, path, view.part[i].offset + view.part[i].length);
 		if (!memcmp(hash_buffer, file_system.memory + (bid * file_system.blocksize), hash_length))
 		{
 			gcry_free(hash_buffer);
@@ -848,12 +1253,10 @@ static bool block_in_use(uint64_t bid, const char * const restrict path)
 			 * block detected as being used by a file that exists
 			 * closer to the root of the system; mark it as such
 			 */
-			file_system.blocks.in_use[bid] = true;
-			file_system.blocks.used++;
+			block_claim(bid, NULL);
 			return true;
 		}
 	}
-	free(p);
 	gcry_free(hash_buffer);
 #else
 	(void)path;
@@ -868,23 +1271,243 @@ static bool block_in_use(uint64_t bid, const char * const restrict path)
  * text is 0’s - translation into the valid range is done as necessary by
  * block_ functions
  */
-static uint64_t block_assign(const char * const restrict path)
+static uint64_t block_assign(const stegfs_file_t * const restrict file)
 {
 	uint64_t block;
 	uint64_t tries = 0;
 	do
 	{
-		block = (lrand48() << 32 | lrand48());// % (file_system.size / file_system.blocksize);
+		/* unlike lrand48 this is safe to call from any thread */
+		gcry_create_nonce(&block, sizeof block);
 		/* eventually “timeout” after trying as many blocks as exists */
 		if ((++tries) > file_system.size / file_system.blocksize)
 			return 0;
 	}
-	while (block_in_use(block, path));
-	file_system.blocks.in_use[normalize(block)] = true;
-	file_system.blocks.used++;
+	while (block_in_use(block, file->path) || !block_claim(block, file));
 	return block;
 }
 
+/*
+ * mark a block as in use, returning false if it already was; the tracker
+ * is shared by every thread, so this has to be atomic
+ */
+static bool block_claim(uint64_t bid, const stegfs_file_t * const restrict file)
+{
+	bid = normalize(bid);
+	if (__atomic_exchange_n(&file_system.blocks.in_use[bid], true, __ATOMIC_ACQ_REL))
+		return false;
+	__atomic_add_fetch(&blocks_used, 1, __ATOMIC_RELAXED);
+	if (file_system.show_bloc && file)
+	{
+		pthread_mutex_lock(&bloc_lock);
+		free(file_system.blocks.file[bid]);
+		asprintf(&file_system.blocks.file[bid], "../%s/%s", file->path, file->name);
+		pthread_mutex_unlock(&bloc_lock);
+	}
+	return true;
+}
+
+static void block_release(uint64_t bid)
+{
+	bid = normalize(bid);
+	if (!__atomic_exchange_n(&file_system.blocks.in_use[bid], false, __ATOMIC_ACQ_REL))
+		return;
+	__atomic_sub_fetch(&blocks_used, 1, __ATOMIC_RELAXED);
+	if (file_system.show_bloc)
+	{
+		pthread_mutex_lock(&bloc_lock);
+		free(file_system.blocks.file[bid]);
+		file_system.blocks.file[bid] = NULL;
+		pthread_mutex_unlock(&bloc_lock);
+	}
+	return;
+}
+
+/*
+ * inode functions
+ */
+
+/*
+ * figure out where the files’ inode blocks are
+ */
+static void inode_locate(stegfs_file_t *file)
+{
+	file_copies(file);
+	if (file->inodes[0])
+		return; /* already located; other threads may be reading them */
+	gcry_md_hd_t hash;
+	gcry_md_open(&hash, GCRY_MD_SHA512, GCRY_MD_FLAG_SECURE);
+	gcry_md_write(hash, file->path, strlen(file->path));
+	gcry_md_write(hash, file->name, strlen(file->name));
+	uint8_t *inodes = gcry_md_read(hash, GCRY_MD_SHA512);
+	size_t len = gcry_md_get_algo_dlen(GCRY_MD_SHA512);
+	/*
+	 * calculate inode values; must be done here, so we have all of
+	 * them and not just the first that we can read (I wonder if there
+	 * is a better way than rotating the data…)
+	 */
+	for (unsigned i = 0; i < copies_max(); i++)
+	{
+		memcpy(&file->inodes[i], inodes, sizeof file->inodes[i]);
+		uint8_t b = inodes[0];
+		memmove(inodes, inodes + 1, len - 1);
+		inodes[len] = b;
+	}
+	gcry_md_close(hash);
+	return;
+}
+
+/*
+ * whether there’s room for each of a file’s copies with this much kept
+ * in its blocks; errno says why not
+ */
+static bool file_room(uint64_t stored, unsigned copies)
+{
+	uint64_t blocks_needed = file_blocks(stored);
+	if (file_system.features & FEATURE_INDEX)
+		blocks_needed += index_count(blocks_needed);
+	blocks_needed *= copies;
+
+	uint64_t blocks_total = (file_system.size / file_system.blocksize) - 1;
+	if (blocks_needed > blocks_total)
+		return errno = EFBIG, false; /* file would not fit in the file system */
+	if (blocks_needed > blocks_total - __atomic_load_n(&blocks_used, __ATOMIC_RELAXED))
+		return errno = ENOSPC, false; /* file won’t fit in remaining space */
+	return errno = EXIT_SUCCESS, true;
+}
+
+/*
+ * the size of a file from one of its inodes, and how much of it is kept
+ * in its blocks (only less if it’s compressed); neither can be more than
+ * there’s room for
+ */
+static bool inode_size(const stegfs_block_t * const restrict inode, uint64_t *size, uint64_t *stored)
+{
+	*stored = *size = ntohll(inode->next);
+	if (file_system.features & FEATURE_COMPRESS)
+	{
+		memcpy(stored, inode->data + file_system.head_offset - sizeof *stored, sizeof *stored);
+		*stored = ntohll(*stored);
+		/* incompressible groups are kept as they are, with their length */
+		if (*stored > *size + (*size + SIZE_BYTE_GROUP - 1) / SIZE_BYTE_GROUP * sizeof( uint32_t ))
+			return false;
+	}
+	return *stored <= file_system.size;
+}
+
+/*
+ * how many copies a file has, from its i’th inode; it’s only recorded if
+ * each file can have its own number, which must include the inode (and a
+ * parity stripe if the file is striped)
+ */
+static unsigned inode_copies(const stegfs_block_t * const restrict inode, unsigned i)
+{
+	if (!(file_system.features & FEATURE_COPIES))
+		return file_system.copies;
+	unsigned copies = inode->data[file_system.head_offset - sizeof( uint64_t ) - sizeof( uint8_t )];
+	if (copies <= i || copies > COPIES_MAX || (file_system.stripes > 1 && copies <= file_system.stripes))
+		return 0;
+	return copies;
+}
+
+/*
+ * complete the stat of any cached files which have only had their inode
+ * read, so that all of their blocks are marked as in use (their data
+ * could be anywhere, so none can be skipped); they’re kept on a list of
+ * their own, so this costs nothing once they all have been, which the
+ * callers see to beforehand, a file at a time
+ */
+static void stat_pending(void)
+{
+	while (stegfs_cache_pending())
+		stegfs_cache_settle();
+	return;
+}
+
+/*
+ * index functions
+ */
+
+/*
+ * number of index blocks needed to list the given number of data blocks
+ */
+static uint64_t index_count(uint64_t blocks)
+{
+	lldiv_t d = lldiv(blocks, file_system.datasize / sizeof blocks);
+	return d.quot + (d.rem > 0);
+}
+
+/*
+ * grow or shrink the list of index blocks for the given copy so there are
+ * enough to list the given number of data blocks
+ */
+static bool index_assign(stegfs_file_t *file, unsigned copy, uint64_t blocks)
+{
+	uint64_t have = file->index[copy] ? file->index[copy][0] : 0;
+	uint64_t need = index_count(blocks);
+	for (uint64_t i = need + 1; i <= have; i++)
+		block_delete(file->index[copy][i]);
+	file->index[copy] = realloc(file->index[copy], (need + 2) * sizeof need);
+	for (uint64_t i = have + 1; i <= need; i++)
+		if (!(file->index[copy][i] = block_assign(file)))
+		{
+			/* failed to allocate space; free what we had claimed */
+			for (uint64_t j = have + 1; j < i; j++)
+				block_delete(file->index[copy][j]);
+			file->index[copy][0] = have;
+			file->index[copy][have + 1] = 0;
+			return false;
+		}
+	file->index[copy][0] = need;
+	file->index[copy][need + 1] = 0;
+	return true;
+}
+
+/*
+ * read the index blocks of a copy, filling in its list of data blocks;
+ * the first index block must already be known
+ */
+static bool index_read(stegfs_file_t *file, unsigned copy, gcry_cipher_hd_t cipher)
+{
+	for (uint64_t i = 1, k = 1; i <= file->index[copy][0]; i++)
+	{
+		stegfs_block_t block;
+		if (!block_read(file->index[copy][i], &block, cipher, file->path))
+			return false;
+		block_claim(file->index[copy][i], file);
+		for (uint64_t j = 0; j < file_system.datasize / sizeof j && k <= file->blocks[copy][0]; j++, k++)
+		{
+			memcpy(&file->blocks[copy][k], block.data + j * sizeof j, sizeof j);
+			file->blocks[copy][k] = ntohll(file->blocks[copy][k]);
+			block_claim(file->blocks[copy][k], file);
+		}
+		if (i < file->index[copy][0])
+			file->index[copy][i + 1] = ntohll(block.next);
+	}
+	return true;
+}
+
+/*
+ * write the index blocks of a copy, listing all of its data blocks
+ */
+static bool index_write(const stegfs_file_t * const restrict file, unsigned copy, gcry_cipher_hd_t cipher)
+{
+	for (uint64_t i = 1, k = 1; i <= file->index[copy][0]; i++)
+	{
+		stegfs_block_t block;
+		memset(block.data, 0x00, file_system.datasize);
+		for (uint64_t j = 0; j < file_system.datasize / sizeof j && k <= file->blocks[copy][0]; j++, k++)
+		{
+			uint64_t b = htonll(file->blocks[copy][k]);
+			memcpy(block.data + j * sizeof b, &b, sizeof b);
+		}
+		block.next = htonll(file->index[copy][i + 1]);
+		if (!block_write(file->index[copy][i], &block, cipher, file->path))
+			return false;
+	}
+	return true;
+}
+
 static gcry_cipher_hd_t init_cipher(const stegfs_file_t * const restrict file, uint8_t ivi)
 {
 	/* obtain handles */
@@ -926,8 +1549,22 @@ static gcry_cipher_hd_t init_cipher(const stegfs_file_t * const restrict file, u
 	gcry_cipher_setkey(cipher, key_data, key_length);
 	gcry_free(key_data);
 	gcry_md_close(salt);
+	gcry_md_close(hash);
 	/* create the iv for the encryption algorithm */
-	gcry_md_reset(hash);
+	init_iv(cipher, file, ivi);
+	return cipher;
+}
+
+/*
+ * (re)set the iv of an existing cipher handle; this is cheap compared to
+ * deriving the key, so one handle can be reused for differently IV’d
+ * chains of blocks
+ */
+static void init_iv(gcry_cipher_hd_t cipher, const stegfs_file_t * const restrict file, uint8_t ivi)
+{
+	gcry_md_hd_t hash;
+	gcry_md_open(&hash, file_system.hash, GCRY_MD_FLAG_SECURE);
+	size_t hash_length = gcry_md_get_algo_dlen(file_system.hash);
 	size_t iv_length = gcry_cipher_get_algo_blklen(file_system.cipher);
 	/* allocate space for whichever is larger */
 	uint8_t *iv = gcry_calloc_secure(iv_length > hash_length ? iv_length : hash_length, sizeof( uint8_t ));
@@ -940,8 +1577,9 @@ static gcry_cipher_hd_t init_cipher(const stegfs_file_t * const restrict file, u
 	gcry_md_write(hash, &ivi, sizeof ivi);
 	memcpy(iv, gcry_md_read(hash, file_system.hash), iv_length);
 	gcry_cipher_setiv(cipher, iv, iv_length);
+	gcry_free(iv);
 	gcry_md_close(hash);
-	return cipher;
+	return;
 }
 
 static gcry_mac_hd_t init_mac(const stegfs_file_t * const restrict file, uint8_t ivi)
@@ -1000,108 +1638,106 @@ static gcry_mac_hd_t init_mac(const stegfs_file_t * const restrict file, uint8_t
  * add path (directory) or file to the cache; if adding a file, the path
  * can be null as it will be taken from the file object
  */
-extern void stegfs_cache_add(const char * const restrict path, stegfs_file_t *file)
+extern stegfs_cache_t *stegfs_cache_add(const char * const restrict path, stegfs_file_t *file)
 {
-	stegfs_cache_t *ptr = NULL;//&(file_system.cache);
+	stegfs_cache_t *ptr = NULL;
 	char *p = NULL;
 	if (path)
 		p = strdup(path);
 	else
 		asprintf(&p, "%s/%s", path_equals(file->path, DIR_SEPARATOR) ? "" : file->path, file->name);
-	if ((ptr = stegfs_cache_exists(p, NULL)))
+	stegfs_negative_remove(p);
+	dir_view_t view;
+	if (!dir_view(&view, p, PASSWORD_SEPARATOR))
+		goto c2a4;
+	size_t length = view.name.offset + view.name.length;
+	if ((ptr = cache_map_find(&file_system.cache_index, CACHE_KEY_PATH, p, length)))
 		goto c2a3; /* already in cache */
-
+	if (length <= 1)
+		goto c2a4; /* the root is always there */
+	/*
+	 * walk down from the root, adding any missing directories on the way
+	 */
 	ptr = &file_system.cache;
-	char *name = dir_get_name(p, PASSWORD_SEPARATOR);
-	uint16_t hierarchy = dir_get_deep(p);
-	for (uint16_t i = 1; i < hierarchy; i++)
+	for (uint16_t i = 0; i < view.parts; i++)
 	{
-		char *e = dir_get_part(p, i);
-		bool found = false;
-		for (uint64_t j = 0; j < ptr->ents; j++)
-			if (ptr->child[j]->name && !strcmp(ptr->child[j]->name, e))
-			{
-				ptr = ptr->child[j];
-				found = true;
-				break;
-			}
-		if (!found)
+		dir_span_t e = i + 1 < view.parts ? view.part[i] : view.name;
+		if (!e.length)
+			continue;
+		stegfs_cache_t *c = cache_map_find(&ptr->children, CACHE_KEY_NAME, dir_span_ptr(&view, e), e.length);
+		ptr = c ? c : cache_child(ptr, p, e.offset + e.length, e.length);
+	}
+c2a3:
+	if (file && file != ptr->file)
+	{
+		if (!ptr->file)
 		{
+			ptr->file = file_alloc();
+			ptr->parent->files++;
+			/* set path and name */
+			ptr->file->path = slab_strndup(file->path, strlen(file->path));
+			ptr->file->name = slab_strndup(file->name, strlen(file->name));
 			/*
-			 * use existing, NULL entry in array if available
+			 * locate the inodes now, so they don’t change once
+			 * other threads can see the file
 			 */
-			uint64_t k = ptr->ents;
-			for (uint64_t j = 0; j < ptr->ents; j++)
-				if (!ptr->child[j]->name)
-				{
-					k = j;
-					goto c2a1;
-				}
-			ptr->child = realloc(ptr->child, (k + 1) * sizeof(stegfs_cache_t *));
-			ptr->ents++;
-c2a1:
-			ptr->child[k] = calloc(sizeof( stegfs_cache_t ), sizeof( uint8_t ));
-			ptr->child[k]->name = strdup(e);
-			ptr = ptr->child[k];
+			inode_locate(ptr->file);
 		}
-		free(e);
-	}
-	/* ditto */
-	uint64_t j = ptr->ents;
-	for (uint64_t i = 0; i < ptr->ents; i++)
-		if (!ptr->child[i]->name)
+		if (file->pass && (!ptr->file->pass || strcmp(ptr->file->pass, file->pass)))
 		{
-			j = i;
-			goto c2a2;
+			free(ptr->file->pass);
+			ptr->file->pass = strdup(file->pass);
 		}
-	ptr->child = realloc(ptr->child, (j + 1) * sizeof(stegfs_cache_t *));
-	ptr->ents++;
-c2a2:
-	ptr->child[j] = calloc(sizeof( stegfs_cache_t ), sizeof( uint8_t ));
-	ptr = ptr->child[j];
-	ptr->name = name;
-c2a3:
-	if (file && file != ptr->file)
-	{
-		if (!ptr->file)
-			ptr->file = calloc(sizeof( stegfs_file_t ), sizeof( uint8_t ));
-		/* set path and name */
-		asprintf(&ptr->file->path, "%s", file->path);
-		asprintf(&ptr->file->name, "%s", file->name);
-		asprintf(&ptr->file->pass, "%s", file->pass);
-		/* set inodes */
-		for (unsigned i = 0; i < file_system.copies; i++)
-			ptr->file->inodes[i] = file->inodes[i];
-		/* set time and size */
-		ptr->file->write = file->write;
-		ptr->file->time = file->time;
-		ptr->file->size = file->size;
-		if (ptr->file->size)
+		/*
+		 * hand the data and block lists over to the cache rather than
+		 * copying them; they’re no longer the caller’s
+		 */
+		if (file->data)
 		{
-			/* copy data */
-			if (file->data)
+			if (ptr->file->data)
 			{
-				ptr->file->data = realloc(ptr->file->data, ptr->file->size);
-				memcpy(ptr->file->data, file->data, ptr->file->size);
+				explicit_bzero(ptr->file->data, ptr->file->size);
+				free(ptr->file->data);
 			}
-			/* copy blocks */
-			stegfs_block_t block;
-			lldiv_t d = lldiv(file->size - (file->size < (sizeof block.data - file_system.head_offset) ? file->size : (sizeof block.data - file_system.head_offset)), SIZE_BYTE_DATA);
-			uint64_t blocks = d.quot + (d.rem > 0);
-			for (unsigned i = 0; i < file_system.copies; i++)
+			ptr->file->data = file->data;
+			file->data = NULL;
+		}
+		for (unsigned i = 0; i < copies_max() && file->blocks; i++)
+		{
+			if (file->blocks[i])
+			{
+				free(ptr->file->blocks[i]);
+				ptr->file->blocks[i] = file->blocks[i];
+				file->blocks[i] = NULL;
+			}
+			if (file->index[i])
 			{
-				ptr->file->blocks[i] = realloc(ptr->file->blocks[i], (blocks + 1) * sizeof blocks);
-				//memset(ptr->file->blocks[i], 0x00, blocks * sizeof blocks);
-				ptr->file->blocks[i][0] = blocks;
-				for (uint64_t j = 1 ; j <= blocks && file->blocks[i] && file->blocks[i][j]; j++)
-					ptr->file->blocks[i][j] = file->blocks[i][j];
+				free(ptr->file->index[i]);
+				ptr->file->index[i] = file->index[i];
+				file->index[i] = NULL;
 			}
 		}
+		/* set time and size */
+		ptr->file->write = file->write;
+		ptr->file->walked = file->walked;
+		ptr->file->damaged |= file->damaged;
+		ptr->file->time = file->time;
+		ptr->file->size = file->size;
+		ptr->file->stored = file->stored;
+		/* a file keeps the number of copies it was first known to have */
+		if (!ptr->file->copies)
+			ptr->file->copies = file->copies;
 	}
+	if (ptr->file)
+	{
+		pthread_mutex_lock(&lru_lock);
+		cache_idle(ptr); /* recount what it holds if it’s idle */
+		cache_pending(ptr);
+		pthread_mutex_unlock(&lru_lock);
+	}
+c2a4:
 	free(p);
-//	if (name)
-//		free(name);
-	return;
+	return ptr;
 }
 
 /*
@@ -1110,99 +1746,1382 @@ c2a3:
  */
 extern stegfs_cache_t *stegfs_cache_exists(const char * const restrict path, stegfs_cache_t *entry)
 {
-	stegfs_cache_t *ptr = &(file_system.cache);
-	char *name = dir_get_name(path, PASSWORD_SEPARATOR);
-	uint16_t hierarchy = dir_get_deep(path);
-	for (uint16_t i = 1; i < hierarchy; i++)
+	/* if another thread has the idle list it can do the trimming */
+	if (!pthread_mutex_trylock(&lru_lock))
 	{
-		bool found = false;
-		char *e = dir_get_part(path, i);
-		for (uint64_t j = 0; j < ptr->ents; j++)
-			if (ptr->child[j]->name && !strcmp(ptr->child[j]->name, e))
-			{
-				ptr = ptr->child[j];
-				found = true;
-				break;
+		cache_trim();
+		pthread_mutex_unlock(&lru_lock);
+	}
+	size_t length = cache_key_length(path);
+	stegfs_cache_t *ptr = length == 1 && *path == DIR_SEPARATOR_CHAR ? &file_system.cache : cache_map_find(&file_system.cache_index, CACHE_KEY_PATH, path, length);
+	if (ptr && entry)
+		memcpy(entry, ptr, sizeof( stegfs_cache_t ));
+	return ptr;
+}
+
+extern void stegfs_cache_remove(const char * const restrict path)
+{
+	if (!strcmp(path, DIR_SEPARATOR))
+	{
+		/*
+		 * empty the whole cache (but keep the root); rather than
+		 * walking the tree, sweep through the slabs wiping files and
+		 * freeing directory arrays, then drop every chunk
+		 */
+		slab_sweep(&file_system.slab_file, file_sweep);
+		slab_sweep(&file_system.slab_cache, cache_sweep);
+		slab_destroy(&file_system.slab_file);
+		slab_destroy(&file_system.slab_cache);
+		for (unsigned i = 0; i < SLAB_STRINGS; i++)
+			slab_destroy(&file_system.slab_string[i]);
+		free(file_system.cache.child);
+		file_system.cache.child = NULL;
+		file_system.cache.ents = 0;
+		file_system.cache.room = 0;
+		file_system.cache.holes = 0;
+		file_system.cache.files = 0;
+		free(file_system.cache.children.bucket);
+		memset(&file_system.cache.children, 0x00, sizeof( stegfs_cache_map_t ));
+		free(file_system.cache_index.bucket);
+		memset(&file_system.cache_index, 0x00, sizeof( stegfs_cache_map_t ));
+		file_system.cache_newest = NULL;
+		file_system.cache_oldest = NULL;
+		file_system.cache_pending = NULL;
+		file_system.cache_stats.bytes = 0;
+		return;
+	}
+	stegfs_cache_t *ptr = cache_map_find(&file_system.cache_index, CACHE_KEY_PATH, path, cache_key_length(path));
+	if (ptr)
+		cache_drop(ptr);
+	return;
+}
+
+/*
+ * cache index functions
+ */
+
+/*
+ * length of the part of a path used as its cache key; any password on the
+ * last element is dropped
+ */
+static size_t cache_key_length(const char * const restrict path)
+{
+	const char *pass = strrchr(path, PASSWORD_SEPARATOR);
+	if (pass && pass > strrchr(path, DIR_SEPARATOR_CHAR))
+		return pass - path;
+	return strlen(path);
+}
+
+/* FNV-1a */
+static uint64_t cache_hash(const char * const restrict key, size_t length)
+{
+	uint64_t h = 0xcbf29ce484222325llu;
+	for (size_t i = 0; i < length; i++)
+		h = (h ^ (uint8_t)key[i]) * 0x100000001b3llu;
+	return h;
+}
+
+static const char *cache_key(const stegfs_cache_t * const restrict ptr, stegfs_cache_key_e k)
+{
+	return k == CACHE_KEY_PATH ? ptr->path : ptr->name;
+}
+
+static stegfs_cache_t *cache_map_find(const stegfs_cache_map_t * const restrict map, stegfs_cache_key_e k, const char * const restrict key, size_t length)
+{
+	if (!map->size)
+		return NULL;
+	uint64_t h = cache_hash(key, length);
+	for (stegfs_cache_t *ptr = map->bucket[h & (map->size - 1)]; ptr; ptr = ptr->next[k])
+	{
+		const char *c = cache_key(ptr, k);
+		if (ptr->hash[k] == h && !strncmp(c, key, length) && !c[length])
+			return ptr;
+	}
+	return NULL;
+}
+
+static void cache_map_insert(stegfs_cache_map_t *map, stegfs_cache_key_e k, stegfs_cache_t *ptr)
+{
+	if (map->used >= map->size)
+	{
+		/*
+		 * double the number of buckets (keeping chains short) and move
+		 * everything already indexed over
+		 */
+		uint64_t size = map->size ? map->size * 2 : CACHE_INDEX_MIN;
+		stegfs_cache_t **bucket = calloc(size, sizeof( stegfs_cache_t * ));
+		for (uint64_t i = 0; i < map->size; i++)
+			for (stegfs_cache_t *c = map->bucket[i], *n = NULL; c; c = n)
+			{
+				n = c->next[k];
+				c->next[k] = bucket[c->hash[k] & (size - 1)];
+				bucket[c->hash[k] & (size - 1)] = c;
 			}
-		free(e);
-		if (!found)
-			goto done;
+		free(map->bucket);
+		map->bucket = bucket;
+		map->size = size;
 	}
-	for (uint64_t i = 0; i < ptr->ents; i++)
-		if (ptr->child[i]->name && !strcmp(ptr->child[i]->name, name))
+	const char *c = cache_key(ptr, k);
+	ptr->hash[k] = cache_hash(c, strlen(c));
+	stegfs_cache_t **b = &map->bucket[ptr->hash[k] & (map->size - 1)];
+	ptr->next[k] = *b;
+	*b = ptr;
+	map->used++;
+	return;
+}
+
+static void cache_map_delete(stegfs_cache_map_t *map, stegfs_cache_key_e k, stegfs_cache_t *ptr)
+{
+	if (!map->size)
+		return;
+	for (stegfs_cache_t **c = &map->bucket[ptr->hash[k] & (map->size - 1)]; *c; c = &(*c)->next[k])
+		if (*c == ptr)
 		{
-			free(name);
-			if (entry)
-				memcpy(entry, ptr->child[i], sizeof( stegfs_cache_t ));
-			return ptr->child[i];
+			*c = ptr->next[k];
+			ptr->next[k] = NULL;
+			map->used--;
+			break;
 		}
-done:
-	if (name)
-		free(name);
-	return NULL;
+	return;
 }
 
-extern void stegfs_cache_remove(const char * const restrict path)
+/*
+ * create a new child element, adding it to its parent and both indexes;
+ * its name is the last name_length bytes of its path
+ */
+static stegfs_cache_t *cache_child(stegfs_cache_t *parent, const char * const restrict path, size_t path_length, size_t name_length)
 {
-	stegfs_cache_t *ptr = &(file_system.cache);
-	char *name = dir_get_name(path, PASSWORD_SEPARATOR);
-	uint16_t hierarchy = dir_get_deep(path);
-	for (uint16_t i = 1; i < hierarchy; i++)
+	stegfs_cache_t *ptr = slab_alloc(&file_system.slab_cache);
+	ptr->path = slab_strndup(path, path_length);
+	ptr->name = ptr->path + path_length - name_length;
+	ptr->parent = parent;
+	ptr->copies = parent->copies;
+	if (parent->ents == parent->room && parent->holes)
 	{
-		bool found = false;
-		char *e = dir_get_part(path, i);
-		for (uint64_t j = 0; j < ptr->ents; j++)
-			if (ptr->child[j]->name && !strcmp(ptr->child[j]->name, e))
+		/*
+		 * only close up the holes when the array would otherwise
+		 * need to grow, so positions stay stable for as long as
+		 * possible
+		 */
+		uint64_t j = 0;
+		for (uint64_t i = 0; i < parent->ents; i++)
+			if (parent->child[i])
 			{
-				ptr = ptr->child[j];
-				found = true;
-				break;
+				parent->child[j] = parent->child[i];
+				parent->child[j]->slot = j;
+				j++;
 			}
-		free(e);
-		if (!found)
-			goto done;
+		parent->ents = j;
+		parent->holes = 0;
 	}
-	bool found = false;
-	for (uint64_t i = 0; i < ptr->ents; i++)
-		if (ptr->child[i]->name && !strcmp(ptr->child[i]->name, name))
+	ptr->slot = parent->ents;
+	if (parent->ents == parent->room)
+	{
+		parent->room = parent->room ? parent->room * 2 : CACHE_CHILD_MIN;
+		parent->child = realloc(parent->child, parent->room * sizeof( stegfs_cache_t * ));
+	}
+	parent->child[parent->ents++] = ptr;
+	cache_map_insert(&parent->children, CACHE_KEY_NAME, ptr);
+	cache_map_insert(&file_system.cache_index, CACHE_KEY_PATH, ptr);
+	return ptr;
+}
+
+/*
+ * remove an element (and everything below it) from the cache; it leaves
+ * a hole in the parent’s child array, unless it was the last child
+ */
+static void cache_drop(stegfs_cache_t *ptr)
+{
+	for (uint64_t i = ptr->ents; i > 0; i--)
+		if (ptr->child[i - 1])
+			cache_drop(ptr->child[i - 1]);
+	if (ptr->node && file_system.cache_watch)
+		file_system.cache_watch(ptr);
+	free(ptr->child);
+	ptr->child = NULL;
+	free(ptr->children.bucket);
+	ptr->children.bucket = NULL;
+	cache_busy(ptr);
+	stegfs_cache_t *parent = ptr->parent;
+	if (ptr->file)
+	{
+		parent->files--;
+		cache_forget(ptr->file);
+		pthread_mutex_lock(&lru_lock);
+		cache_pending(ptr);
+		pthread_mutex_unlock(&lru_lock);
+		slab_strfree(ptr->file->path);
+		slab_strfree(ptr->file->name);
+		ptr->file->name = NULL; /* marks the slot as free */
+		pthread_mutex_destroy(&ptr->file->lock);
+		slab_free(&file_system.slab_file, ptr->file);
+	}
+	cache_map_delete(&parent->children, CACHE_KEY_NAME, ptr);
+	cache_map_delete(&file_system.cache_index, CACHE_KEY_PATH, ptr);
+	parent->child[ptr->slot] = NULL;
+	parent->holes++;
+	while (parent->ents && !parent->child[parent->ents - 1])
+	{
+		parent->ents--;
+		parent->holes--;
+	}
+	slab_strfree(ptr->path);
+	ptr->path = NULL; /* marks the slot as free */
+	slab_free(&file_system.slab_cache, ptr);
+	return;
+}
+
+/*
+ * free the arrays of a (still used) cache element during teardown
+ */
+static void cache_sweep(void *object)
+{
+	stegfs_cache_t *ptr = object;
+	if (!ptr->path)
+		return;
+	free(ptr->child);
+	free(ptr->children.bucket);
+	if (strlen(ptr->path) >= SLAB_STRING_MIN << (SLAB_STRINGS - 1))
+		free(ptr->path);
+	return;
+}
+
+extern void stegfs_cache_watch(void (*f)(stegfs_cache_t *))
+{
+	file_system.cache_watch = f;
+	return;
+}
+
+/*
+ * cache memory management functions
+ */
+
+extern void stegfs_cache_limit(uint64_t bytes, time_t ttl)
+{
+	pthread_mutex_lock(&lru_lock);
+	file_system.cache_budget = bytes;
+	file_system.cache_ttl = ttl;
+	cache_trim();
+	pthread_mutex_unlock(&lru_lock);
+	return;
+}
+
+extern bool stegfs_cache_open(stegfs_cache_t *ptr, const char * const restrict pass)
+{
+	bool hit = false;
+	pthread_mutex_lock(&lru_lock);
+	ptr->users++;
+	cache_busy(ptr);
+	if (!pass || !ptr->file)
+		goto done;
+	/*
+	 * only the password that was used to read the plaintext may see it
+	 * again without another read
+	 */
+	if ((hit = ptr->file->walked && ptr->file->pass && !strcmp(ptr->file->pass, pass) && (ptr->file->data || !ptr->file->size)))
+		file_system.cache_stats.hits++;
+	else
+		file_system.cache_stats.misses++;
+done:
+	pthread_mutex_unlock(&lru_lock);
+	return hit;
+}
+
+extern void stegfs_cache_close(stegfs_cache_t *ptr)
+{
+	pthread_mutex_lock(&lru_lock);
+	if (ptr->users)
+		ptr->users--;
+	cache_idle(ptr);
+	pthread_mutex_unlock(&lru_lock);
+	return;
+}
+
+extern bool stegfs_cache_pending(void)
+{
+	pthread_mutex_lock(&lru_lock);
+	bool pending = file_system.cache_pending;
+	pthread_mutex_unlock(&lru_lock);
+	return pending;
+}
+
+extern void stegfs_cache_settle(void)
+{
+	pthread_mutex_lock(&lru_lock);
+	stegfs_cache_t *ptr = file_system.cache_pending;
+	if (!ptr)
+	{
+		pthread_mutex_unlock(&lru_lock);
+		return;
+	}
+	stegfs_file_t *file = ptr->file;
+	file->walked = true; /* even if it’s since been lost */
+	cache_pending(ptr);
+	pthread_mutex_unlock(&lru_lock);
+	stegfs_file_stat(file);
+	return;
+}
+
+extern uint64_t stegfs_cache_scrub(time_t again)
+{
+	time_t now = time(NULL);
+	stegfs_cache_t *ptr = NULL;
+	/*
+	 * damaged files come first, then whichever has gone longest without
+	 * being checked; only idle files with their plaintext will do, so
+	 * there’s always something to write a damaged copy from
+	 */
+	pthread_mutex_lock(&lru_lock);
+	for (stegfs_cache_t *c = file_system.cache_oldest; c; c = c->newer)
+	{
+		stegfs_file_t *f = c->file;
+		if (!f->pass || (f->size && !f->data) || (!f->damaged && now - f->scrubbed < again))
+			continue;
+		if (!ptr || f->damaged > ptr->file->damaged || (f->damaged == ptr->file->damaged && f->scrubbed < ptr->file->scrubbed))
+			ptr = c;
+	}
+	if (ptr)
+	{
+		ptr->users++; /* so it isn’t evicted meanwhile */
+		cache_busy(ptr);
+	}
+	pthread_mutex_unlock(&lru_lock);
+	if (!ptr)
+		return 0;
+
+	stegfs_scrub_stats_t stats = { 0, 0, 0 };
+	stegfs_file_t *file = ptr->file;
+	uint64_t bytes = 0;
+	stegfs_file_lock(file);
+	if (!(file_system.features & FEATURE_COMPRESS))
+		bytes = file_scrub(file, &stats);
+	else
+	{
+		/*
+		 * compressed files are checked (and written again) from a copy
+		 * with what’s kept in the blocks in place of the plaintext;
+		 * compressing the plaintext again needn’t give the same, so
+		 * it’s read back instead (from any copy the MAC agrees with)
+		 */
+		stegfs_file_t packed = *file;
+		packed.data = NULL;
+		if (file_read_blocks(&packed))
+			bytes = file_scrub(&packed, &stats);
+		else
 		{
-			ptr = ptr->child[i];
-			found = true;
+			/* there’s nothing left to repair the copies from */
+			packed.damaged = true;
+			stats.files++;
+			stats.failed++;
+		}
+		file->damaged = packed.damaged;
+		file->copy = packed.copy;
+		file->scrubbed = time(NULL);
+		file_discard(packed.data, packed.stored);
+	}
+	stegfs_file_unlock(file);
+
+	pthread_mutex_lock(&lru_lock);
+	file_system.scrub_stats.files += stats.files;
+	file_system.scrub_stats.repaired += stats.repaired;
+	file_system.scrub_stats.failed += stats.failed;
+	ptr->users--;
+	cache_idle(ptr);
+	pthread_mutex_unlock(&lru_lock);
+	return bytes;
+}
+
+/*
+ * securely wipe and release the plaintext, password and block lists of a
+ * file; its size, time and inodes are kept so it can still be stat’d
+ */
+static void cache_forget(stegfs_file_t *file)
+{
+	if (file->data)
+	{
+		explicit_bzero(file->data, file->size);
+		free(file->data);
+		file->data = NULL;
+	}
+	if (file->pass)
+	{
+		explicit_bzero(file->pass, strlen(file->pass));
+		free(file->pass);
+		file->pass = NULL;
+	}
+	for (unsigned i = 0; i < copies_max(); i++)
+	{
+		if (file->blocks[i])
+		{
+			explicit_bzero(file->blocks[i], (file->blocks[i][0] + 1) * sizeof( uint64_t ));
+			free(file->blocks[i]);
+			file->blocks[i] = NULL;
+		}
+		if (file->index[i])
+		{
+			explicit_bzero(file->index[i], (file->index[i][0] + 1) * sizeof( uint64_t ));
+			free(file->index[i]);
+			file->index[i] = NULL;
+		}
+	}
+	file->walked = false;
+	return;
+}
+
+static uint64_t cache_bytes(const stegfs_file_t * const restrict file)
+{
+	uint64_t bytes = file->data ? file->size : 0;
+	for (unsigned i = 0; i < copies_max(); i++)
+	{
+		if (file->blocks[i])
+			bytes += (file->blocks[i][0] + 2) * sizeof( uint64_t );
+		if (file->index[i])
+			bytes += (file->index[i][0] + 2) * sizeof( uint64_t );
+	}
+	return bytes;
+}
+
+/*
+ * take a file off the idle (LRU) list; the idle list functions expect the
+ * caller to hold the LRU lock unless it has the namespace exclusively
+ */
+static void cache_busy(stegfs_cache_t *ptr)
+{
+	if (!ptr->newer && !ptr->older && file_system.cache_newest != ptr)
+		return; /* not on the list */
+	if (ptr->newer)
+		ptr->newer->older = ptr->older;
+	else
+		file_system.cache_newest = ptr->older;
+	if (ptr->older)
+		ptr->older->newer = ptr->newer;
+	else
+		file_system.cache_oldest = ptr->newer;
+	ptr->newer = NULL;
+	ptr->older = NULL;
+	file_system.cache_stats.bytes -= ptr->bytes;
+	ptr->bytes = 0;
+	return;
+}
+
+/*
+ * put a file which isn’t open (or waiting to be written) at the head of
+ * the idle list, then evict whatever no longer fits
+ */
+static void cache_idle(stegfs_cache_t *ptr)
+{
+	cache_busy(ptr);
+	if (!ptr->file || ptr->users || ptr->file->write)
+		return;
+	if (!ptr->file->pass)
+	{
+		cache_forget(ptr->file); /* plaintext nobody could ask for */
+		cache_pending(ptr);
+	}
+	if (!ptr->file->walked)
+		return; /* nothing worth evicting */
+	ptr->bytes = cache_bytes(ptr->file);
+	ptr->used = time(NULL);
+	ptr->older = file_system.cache_newest;
+	if (ptr->older)
+		ptr->older->newer = ptr;
+	else
+		file_system.cache_oldest = ptr;
+	file_system.cache_newest = ptr;
+	file_system.cache_stats.bytes += ptr->bytes;
+	cache_trim();
+	return;
+}
+
+/*
+ * keep a file on the pending list for as long as only its inode has been
+ * read (and there’s a password to read the rest with); unlike the idle
+ * list this always expects the LRU lock, as the scrub thread looks at it
+ * without holding the namespace
+ */
+static void cache_pending(stegfs_cache_t *ptr)
+{
+	bool pending = ptr->file && !ptr->file->walked && ptr->file->pass;
+	bool listed = ptr->pending_prev || file_system.cache_pending == ptr;
+	if (pending == listed)
+		return;
+	if (pending)
+	{
+		ptr->pending_next = file_system.cache_pending;
+		if (ptr->pending_next)
+			ptr->pending_next->pending_prev = ptr;
+		file_system.cache_pending = ptr;
+		return;
+	}
+	if (ptr->pending_prev)
+		ptr->pending_prev->pending_next = ptr->pending_next;
+	else
+		file_system.cache_pending = ptr->pending_next;
+	if (ptr->pending_next)
+		ptr->pending_next->pending_prev = ptr->pending_prev;
+	ptr->pending_next = NULL;
+	ptr->pending_prev = NULL;
+	return;
+}
+
+/*
+ * evict the least recently used idle files until within budget and none
+ * have been idle for too long
+ */
+static void cache_trim(void)
+{
+	time_t now = time(NULL);
+	stegfs_cache_t *ptr;
+	while ((ptr = file_system.cache_oldest) && (file_system.cache_stats.bytes > file_system.cache_budget || (file_system.cache_ttl && now - ptr->used > file_system.cache_ttl)))
+	{
+		cache_busy(ptr);
+		cache_forget(ptr->file);
+		cache_pending(ptr);
+		file_system.cache_stats.evictions++;
+	}
+	return;
+}
+
+/*
+ * negative look-up cache functions
+ */
+
+/*
+ * find the slot for a path; the slot is chosen by the path without the
+ * password, so every password for a name shares a slot (which is fine,
+ * this is only a cache)
+ */
+static stegfs_negative_t *negative_slot(const char * const restrict path, uint8_t *name)
+{
+	const char *pass = strrchr(path, PASSWORD_SEPARATOR);
+	size_t length = pass && pass > strrchr(path, DIR_SEPARATOR_CHAR) ? (size_t)(pass - path) : strlen(path);
+	gcry_md_hash_buffer(GCRY_MD_SHA256, name, path, length);
+	uint64_t slot;
+	memcpy(&slot, name, sizeof slot);
+	return &file_system.negative[slot % NEGATIVE_MAX];
+}
+
+extern void stegfs_negative_add(const char * const restrict path)
+{
+	if (!file_system.negative)
+		return;
+	uint8_t name[SIZE_BYTE_HASH];
+	uint8_t full[SIZE_BYTE_HASH];
+	stegfs_negative_t *entry = negative_slot(path, name);
+	gcry_md_hash_buffer(GCRY_MD_SHA256, full, path, strlen(path));
+	pthread_mutex_lock(&negative_lock);
+	memcpy(entry->name, name, sizeof name);
+	memcpy(entry->path, full, sizeof full);
+	entry->time = time(NULL);
+	pthread_mutex_unlock(&negative_lock);
+	return;
+}
+
+extern bool stegfs_negative_exists(const char * const restrict path)
+{
+	if (!file_system.negative)
+		return false;
+	uint8_t name[SIZE_BYTE_HASH];
+	uint8_t full[SIZE_BYTE_HASH];
+	stegfs_negative_t *entry = negative_slot(path, name);
+	gcry_md_hash_buffer(GCRY_MD_SHA256, full, path, strlen(path));
+	pthread_mutex_lock(&negative_lock);
+	bool found = entry->time && time(NULL) - entry->time <= NEGATIVE_TTL && !memcmp(entry->name, name, sizeof name) && !memcmp(entry->path, full, sizeof full);
+	pthread_mutex_unlock(&negative_lock);
+	return found;
+}
+
+extern void stegfs_negative_remove(const char * const restrict path)
+{
+	if (!file_system.negative)
+		return;
+	uint8_t name[SIZE_BYTE_HASH];
+	stegfs_negative_t *entry = negative_slot(path, name);
+	pthread_mutex_lock(&negative_lock);
+	if (!memcmp(entry->name, name, sizeof name))
+		memset(entry, 0x00, sizeof( stegfs_negative_t ));
+	pthread_mutex_unlock(&negative_lock);
+	return;
+}
+
+/*
+ * slab functions
+ */
+
+static void *slab_alloc(stegfs_slab_t *slab)
+{
+	void *object = slab->free;
+	if (object)
+		memcpy(&slab->free, object, sizeof slab->free);
+	else
+	{
+		if (!slab->chunk || slab->used + slab->size > SLAB_CHUNK)
+		{
+			uint8_t *chunk = malloc(SLAB_CHUNK);
+			memcpy(chunk, &slab->chunk, sizeof slab->chunk);
+			slab->chunk = chunk;
+			slab->used = SLAB_HEADER;
+		}
+		object = slab->chunk + slab->used;
+		slab->used += slab->size;
+	}
+	return memset(object, 0x00, slab->size);
+}
+
+static void slab_free(stegfs_slab_t *slab, void *object)
+{
+	memcpy(object, &slab->free, sizeof slab->free);
+	slab->free = object;
+	return;
+}
+
+/*
+ * call f for every object (used or free) ever handed out by the slab;
+ * it must be able to tell a free object from one in use
+ */
+static void slab_sweep(stegfs_slab_t *slab, void (*f)(void *))
+{
+	size_t used = slab->used;
+	for (uint8_t *chunk = slab->chunk; chunk; used = SLAB_HEADER + (SLAB_CHUNK - SLAB_HEADER) / slab->size * slab->size)
+	{
+		for (size_t i = SLAB_HEADER; i < used; i += slab->size)
+			f(chunk + i);
+		memcpy(&chunk, chunk, sizeof chunk);
+	}
+	return;
+}
+
+static void slab_destroy(stegfs_slab_t *slab)
+{
+	for (uint8_t *chunk = slab->chunk, *prev; chunk; chunk = prev)
+	{
+		memcpy(&prev, chunk, sizeof prev);
+		free(chunk);
+	}
+	slab->chunk = NULL;
+	slab->used = 0;
+	slab->free = NULL;
+	return;
+}
+
+/*
+ * short strings come from the slab of the smallest size class that fits;
+ * anything longer is left to malloc
+ */
+static char *slab_strndup(const char * const restrict string, size_t length)
+{
+	for (unsigned i = 0; i < SLAB_STRINGS; i++)
+		if (length < (size_t)SLAB_STRING_MIN << i)
+		{
+			char *s = slab_alloc(&file_system.slab_string[i]);
+			memcpy(s, string, length);
+			return s; /* already terminated */
+		}
+	return strndup(string, length);
+}
+
+static void slab_strfree(char *string)
+{
+	if (!string)
+		return;
+	size_t length = strlen(string);
+	for (unsigned i = 0; i < SLAB_STRINGS; i++)
+		if (length < (size_t)SLAB_STRING_MIN << i)
+		{
+			slab_free(&file_system.slab_string[i], string);
+			return;
+		}
+	free(string);
+	return;
+}
+
+/*
+ * file functions
+ */
+
+/*
+ * the most copies a file can have, which is how many inodes it has and
+ * how long its per-copy lists are
+ */
+static unsigned copies_max(void)
+{
+	return (file_system.features & FEATURE_COPIES) ? COPIES_MAX : file_system.copies;
+}
+
+/*
+ * give a file declared outside the cache its per-copy lists
+ */
+static void file_copies(stegfs_file_t *file)
+{
+	if (file->inodes)
+		return;
+	file->inodes = calloc(copies_max(), sizeof( uint64_t ) + 2 * sizeof( uint64_t * ));
+	file->blocks = (uint64_t **)(file->inodes + copies_max());
+	file->index = file->blocks + copies_max();
+	return;
+}
+
+/*
+ * how many data blocks each copy of a file has (after what’s in the
+ * inodes); a striped file’s are shared between its data stripes
+ */
+static uint64_t file_blocks(uint64_t size)
+{
+	size_t head = file_system.datasize - file_system.head_offset;
+	lldiv_t d = lldiv(size - (size < head ? size : head), file_system.datasize * file_system.stripes);
+	return d.quot + (d.rem > 0);
+}
+
+/*
+ * compress the plaintext of a file a group at a time, so that each can be
+ * expanded by itself; each group is preceded by its compressed length,
+ * and is kept as it is if compressing doesn’t make it any smaller
+ */
+static uint8_t *file_compress(const stegfs_file_t * const restrict file, uint64_t *length)
+{
+	uint64_t groups = (file->size + SIZE_BYTE_GROUP - 1) / SIZE_BYTE_GROUP;
+	uint8_t *packed = malloc(file->size + groups * sizeof( uint32_t ) + 1);
+	uint64_t l = 0;
+	for (uint64_t off = 0; off < file->size; off += SIZE_BYTE_GROUP)
+	{
+		uLong z = file->size - off < SIZE_BYTE_GROUP ? file->size - off : SIZE_BYTE_GROUP;
+		uLongf c = z - 1;
+		uint8_t *group = packed + l + sizeof( uint32_t );
+		if (compress2(group, &c, file->data + off, z, Z_BEST_SPEED) != Z_OK)
+		{
+			memcpy(group, file->data + off, z);
+			c = z;
+		}
+		uint32_t n = htonl(c);
+		memcpy(packed + l, &n, sizeof n);
+		l += sizeof n + c;
+	}
+	*length = l;
+	return packed;
+}
+
+/*
+ * expand what’s kept in the blocks of a compressed file back in to its
+ * plaintext; anything which doesn’t add up to the size of the file is an
+ * error
+ */
+static bool file_expand(stegfs_file_t *file, const uint8_t * const restrict packed, uint64_t length)
+{
+	file->data = realloc(file->data, file->size);
+	uint64_t l = 0;
+	for (uint64_t off = 0; off < file->size; off += SIZE_BYTE_GROUP)
+	{
+		uLongf z = file->size - off < SIZE_BYTE_GROUP ? file->size - off : SIZE_BYTE_GROUP;
+		uLongf e = z;
+		uint32_t c;
+		if (length - l < sizeof c)
+			return errno = EIO, false;
+		memcpy(&c, packed + l, sizeof c);
+		l += sizeof c;
+		if ((c = ntohl(c)) > z || c > length - l)
+			return errno = EIO, false;
+		if (c == z)
+			memcpy(file->data + off, packed + l, z);
+		else if (uncompress(file->data + off, &e, packed + l, c) != Z_OK || e != z)
+			return errno = EIO, false;
+		l += c;
+	}
+	if (l != length)
+		return errno = EIO, false;
+	return true;
+}
+
+/*
+ * securely wipe and release compressed file data
+ */
+static void file_discard(uint8_t *packed, uint64_t length)
+{
+	if (!packed)
+		return;
+	explicit_bzero(packed, length);
+	free(packed);
+	return;
+}
+
+/*
+ * cached files are allocated along with their per-copy lists
+ */
+static stegfs_file_t *file_alloc(void)
+{
+	if (!file_system.slab_file.size)
+		file_system.slab_file.size = sizeof( stegfs_file_t ) + copies_max() * (sizeof( uint64_t ) + 2 * sizeof( uint64_t * ));
+	stegfs_file_t *file = slab_alloc(&file_system.slab_file);
+	file->inodes = (uint64_t *)(file + 1);
+	file->blocks = (uint64_t **)(file->inodes + copies_max());
+	file->index = file->blocks + copies_max();
+	pthread_mutex_init(&file->lock, NULL);
+	return file;
+}
+
+/*
+ * wipe a (still used) cached file during teardown
+ */
+static void file_sweep(void *object)
+{
+	stegfs_file_t *file = object;
+	if (!file->name)
+		return;
+	cache_forget(file);
+	pthread_mutex_destroy(&file->lock);
+	if (strlen(file->path) >= SLAB_STRING_MIN << (SLAB_STRINGS - 1))
+		free(file->path);
+	if (strlen(file->name) >= SLAB_STRING_MIN << (SLAB_STRINGS - 1))
+		free(file->name);
+	return;
+}
+
+/*
+ * the plaintext of data block k (from 0) of a copy: every copy holds the
+ * whole file unless it’s striped, when the first copies each hold one
+ * data block from every row of them and the rest hold the parity of the
+ * row; the last row comes from the tail
+ */
+static void file_block(const stegfs_file_t * const restrict file, unsigned copy, uint64_t blocks, uint64_t k, const uint8_t * const restrict tail, uint8_t *data)
+{
+	size_t head = file_system.datasize - file_system.head_offset;
+	const uint8_t *row[COPIES_MAX];
+	for (unsigned i = 0; i < file_system.stripes; i++)
+		row[i] = k + 1 < blocks ? file->data + head + (k * file_system.stripes + i) * file_system.datasize : tail + i * file_system.datasize;
+	if (copy < file_system.stripes || file_system.stripes == 1)
+		memcpy(data, row[copy % file_system.stripes], file_system.datasize);
+	else
+		ecc_stripe_encode(data, row, file_system.stripes, copy - file_system.stripes, file_system.datasize);
+	return;
+}
+
+/*
+ * the last row of data blocks (just the last block unless the file is
+ * striped): the end of the file, then padding
+ */
+static void file_tail(const stegfs_file_t * const restrict file, uint64_t blocks, uint8_t *tail)
+{
+	size_t z = file_system.stripes * file_system.datasize;
+	gcry_create_nonce(tail, z);
+	if (!blocks)
+		return;
+	uint64_t start = file_system.datasize - file_system.head_offset + (blocks - 1) * z;
+	memcpy(tail, file->data + start, file->stored - start);
+	return;
+}
+
+/*
+ * the MAC is of the data blocks in order (as if all of the data were in
+ * one copy) including the padding at the end
+ */
+static void file_mac(const stegfs_file_t * const restrict file, uint64_t blocks, const uint8_t * const restrict tail, gcry_mac_hd_t mac, uint8_t *mac_data, size_t *mac_length)
+{
+	size_t z = file_system.stripes * file_system.datasize;
+	if (blocks)
+	{
+		gcry_mac_write(mac, file->data + file_system.datasize - file_system.head_offset, (blocks - 1) * z);
+		gcry_mac_write(mac, tail, z);
+	}
+	gcry_mac_read(mac, mac_data, mac_length);
+	return;
+}
+
+/*
+ * read the data kept in the blocks of a file (which has been stat’d),
+ * checking it against the MAC
+ */
+static bool file_read_blocks(stegfs_file_t *file)
+{
+	if (file->copy >= file->copies)
+		file->copy = 0;
+	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
+	uint8_t *mac_data = gcry_calloc_secure(mac_length, sizeof( uint8_t ));
+	/*
+	 * the key is the same for every inode and copy (only the IV
+	 * differs) so only derive it once
+	 */
+	gcry_cipher_hd_t cipher_handle = init_cipher(file, file->copy);
+	gcry_mac_hd_t mac_handle = init_mac(file, 0);
+	/*
+	 * read the start of the file data, starting with the copy which
+	 * last read without error
+	 */
+	file->data = realloc(file->data, file->stored);
+	for (unsigned n = 0; n < file->copies; n++)
+	{
+		unsigned i = (file->copy + n) % file->copies;
+		init_iv(cipher_handle, file, i);
+		stegfs_block_t inode;
+		if (block_read(file->inodes[i], &inode, cipher_handle, file->path))
+		{
+			memcpy(file->data, inode.data + file_system.head_offset, file->stored < (file_system.datasize - file_system.head_offset) ? file->stored : (file_system.datasize - file_system.head_offset));
+			memcpy(mac_data, inode.data + ((file->copies + 1) * sizeof( uint64_t )), mac_length);
 			break;
 		}
-	if (!found)
+		file->damaged = true;
+	}
+	uint64_t blocks = file_blocks(file->stored);
+	unsigned copy = file->copy;
+	bool complete = true;
+	if (file_system.stripes > 1)
+	{
+		complete = file_read_stripes(file, blocks, cipher_handle, mac_handle, mac_data, mac_length);
 		goto done;
-	if (ptr->file)
+	}
+	/*
+	 * and then the rest of it; each block comes from the same copy as
+	 * the last unless it can’t be read, when the other copies are tried
+	 * in turn (and the first which can be read is kept to)
+	 */
+	stegfs_block_t block;
+	/*
+	 * all data block addresses are known from the stat, so let the
+	 * kernel start fetching them while we decrypt
+	 */
+	for (uint64_t j = 1; file->blocks[copy][0] == blocks && j <= blocks && file->blocks[copy][j]; j++)
+		block_prefetch(file->blocks[copy][j]);
+	for (uint64_t j = 1, k = 0; j <= blocks && complete; j++, k++)
 	{
-		free(ptr->file->path);
-		free(ptr->file->name);
-		free(ptr->file->pass);
-		if (ptr->file->data)
-			free(ptr->file->data);
-		for (unsigned i = 0; i < file_system.copies; i++)
-			if (ptr->file->blocks[i])
+		bool found = false;
+		for (unsigned n = 0; n < file->copies && !found; n++)
+		{
+			unsigned i = (copy + n) % file->copies;
+			if (file->blocks[i][0] != blocks || !file->blocks[i][j])
 			{
-				free(ptr->file->blocks[i]);
-				ptr->file->blocks[i] = NULL;
+				file->damaged = true;
+				continue; /* this copy is corrupt; try the next */
+			}
+			/* the handle follows on from the last block read */
+			if ((n || j == 1) && !block_resume(cipher_handle, file, i, j))
+				continue;
+			if (!(found = block_read(file->blocks[i][j], &block, cipher_handle, file->path)))
+			{
+				file->damaged = true;
+				continue;
+			}
+			if (i != copy)
+				for (uint64_t l = j + 1; l <= blocks && file->blocks[i][l]; l++)
+					block_prefetch(file->blocks[i][l]);
+			copy = i;
+		}
+		if (!(complete = found))
+			break;
+		size_t l = file_system.datasize;
+		if ((l + k * file_system.datasize) > (file->stored - (file_system.datasize - file_system.head_offset)))
+			l = l - ((l + k * file_system.datasize) - (file->stored - (file_system.datasize - file_system.head_offset)));
+		memcpy(file->data + (file_system.datasize - file_system.head_offset) + k * file_system.datasize, block.data, l);
+		gcry_mac_write(mac_handle, block.data, file_system.datasize);
+	}
+	/* compare generated MAC with stored MAC */
+	if (complete && file_system.version >= VERSION_202X_XX && gcry_mac_verify(mac_handle, mac_data, mac_length) == GPG_ERR_CHECKSUM)
+		complete = false;
+	/*
+	 * if that didn’t work (the copies may differ after the end of the
+	 * file, or the cipher mode can’t start part way through a copy) try
+	 * each copy from start to finish
+	 */
+	for (unsigned n = 0; n < file->copies && !complete; n++)
+	{
+		copy = (file->copy + n) % file->copies;
+		if (file->blocks[copy][0] != blocks)
+			continue;
+		gcry_mac_reset(mac_handle);
+		init_iv(cipher_handle, file, copy);
+		complete = true;
+		for (uint64_t j = 1, k = 0; j <= blocks && complete; j++, k++)
+		{
+			if (!(complete = block_read(file->blocks[copy][j], &block, cipher_handle, file->path)))
+				break;
+			size_t l = file_system.datasize;
+			if ((l + k * file_system.datasize) > (file->stored - (file_system.datasize - file_system.head_offset)))
+				l = l - ((l + k * file_system.datasize) - (file->stored - (file_system.datasize - file_system.head_offset)));
+			memcpy(file->data + (file_system.datasize - file_system.head_offset) + k * file_system.datasize, block.data, l);
+			gcry_mac_write(mac_handle, block.data, file_system.datasize);
+		}
+		if (complete && file_system.version >= VERSION_202X_XX && gcry_mac_verify(mac_handle, mac_data, mac_length) == GPG_ERR_CHECKSUM)
+			complete = false;
+		if (!complete)
+			file->damaged = true;
+	}
+done:
+	gcry_mac_close(mac_handle);
+	gcry_cipher_close(cipher_handle);
+	gcry_free(mac_data);
+	if (!complete)
+		/*
+		 * somehow we failed to read a complete copy of the file,
+		 * despite knowing that a complete copy existed when stat’d
+		 */
+		return errno = EIO, false;
+	/* start with the same copy next time */
+	file->copy = copy;
+	return true;
+}
+
+
+/*
+ * read a striped file: the data stripes first, and only if any of their
+ * blocks can’t be read the parity too, to rebuild the rows they’re in
+ */
+static bool file_read_stripes(stegfs_file_t *file, uint64_t blocks, gcry_cipher_hd_t cipher, gcry_mac_hd_t mac, const uint8_t * const restrict mac_data, size_t mac_length)
+{
+	size_t head = file_system.datasize - file_system.head_offset;
+	unsigned k = file_system.stripes;
+	unsigned m = file->copies - k;
+	size_t z = k * file_system.datasize;
+	uint64_t data = (UINT64_C(1) << k) - 1;
+	/* room for the whole of the last row, padding and all */
+	if (blocks && file->stored < head + blocks * z)
+		file->data = realloc(file->data, head + blocks * z);
+	uint8_t *body = file->data + head;
+	uint64_t *lost = calloc(blocks + 1, sizeof( uint64_t ));
+	uint64_t *slot = NULL;
+	uint8_t *parity = NULL;
+	bool complete = true;
+	stegfs_block_t block;
+	for (unsigned i = 0; i < k; i++)
+		for (uint64_t j = 1; file->blocks[i][0] == blocks && j <= blocks && file->blocks[i][j]; j++)
+			block_prefetch(file->blocks[i][j]);
+	for (unsigned i = 0; i < file->copies; i++)
+	{
+		if (i == k)
+		{
+			/* keep the parity of just the rows which need it */
+			uint64_t n = 0;
+			slot = calloc(blocks + 1, sizeof( uint64_t ));
+			for (uint64_t r = 0; r < blocks; r++)
+				if (lost[r])
+					slot[r] = ++n;
+			if (!n)
+				break;
+			parity = malloc(n * m * file_system.datasize);
+		}
+		bool whole = file->blocks[i][0] == blocks;
+		bool resume = true;
+		for (uint64_t j = 1, r = 0; j <= blocks; j++, r++)
+		{
+			/* the handle follows on from the last block read */
+			bool found = whole && file->blocks[i][j]
+					&& (!resume || block_resume(cipher, file, i, j))
+					&& block_read(file->blocks[i][j], &block, cipher, file->path);
+			if (!(resume = !found))
+			{
+				if (i < k)
+					memcpy(body + r * z + i * file_system.datasize, block.data, file_system.datasize);
+				else if (slot[r])
+					memcpy(parity + ((slot[r] - 1) * m + i - k) * file_system.datasize, block.data, file_system.datasize);
 			}
-		free(ptr->file);
+			else
+			{
+				lost[r] |= UINT64_C(1) << i;
+				file->damaged = true;
+			}
+		}
+	}
+	/* rebuild the rows with missing data from whichever blocks are left */
+	for (uint64_t r = 0; r < blocks && complete; r++)
+	{
+		if (!(lost[r] & data))
+			continue;
+		uint8_t *s[COPIES_MAX];
+		for (unsigned i = 0; i < k; i++)
+			s[i] = body + r * z + i * file_system.datasize;
+		for (unsigned i = 0; i < m; i++)
+			s[k + i] = parity + ((slot[r] - 1) * m + i) * file_system.datasize;
+		complete = ecc_stripe_decode(s, k, m, ~lost[r], file_system.datasize);
+	}
+	if (complete)
+		gcry_mac_write(mac, body, blocks * z);
+	if (complete && file_system.version >= VERSION_202X_XX && gcry_mac_verify(mac, mac_data, mac_length) == GPG_ERR_CHECKSUM)
+		complete = false;
+	if (blocks && file->stored < head + blocks * z)
+		file->data = realloc(file->data, file->stored);
+	free(parity);
+	free(slot);
+	free(lost);
+	return complete;
+}
+
+/*
+ * encrypt and write the data (and any index) blocks of one copy of a file;
+ * the last row of data is taken from the tail
+ */
+static bool file_write_copy(const stegfs_file_t * const restrict file, unsigned copy, uint64_t blocks, const uint8_t * const restrict tail, gcry_cipher_hd_t cipher)
+{
+	stegfs_block_t block;
+	init_iv(cipher, file, copy);
+	for (uint64_t j = 1, k = 0; j <= blocks; j++, k++)
+	{
+		file_block(file, copy, blocks, k, tail, block.data);
+		block.next = htonll(file->blocks[copy][j + 1]);
+		if (!block_write(file->blocks[copy][j], &block, cipher, file->path))
+			return false;
 	}
-	if (ptr->child)
+	/* index blocks get their own IV so it isn’t reused */
+	if (blocks && (file_system.features & FEATURE_INDEX))
 	{
-		for (uint64_t i = 0; i < ptr->ents; i++)
-			if (ptr->child[i])
+		init_iv(cipher, file, COPIES_MAX + copy);
+		return index_write(file, copy, cipher);
+	}
+	return true;
+}
+
+/*
+ * write every inode of a file; each has the size, time, MAC and start of
+ * the data, and where the first block of every copy is
+ */
+static bool file_write_inodes(const stegfs_file_t * const restrict file, uint64_t blocks, const uint8_t * const restrict mac_data, size_t mac_length)
+{
+	stegfs_block_t inode;
+	gcry_create_nonce(&inode, file_system.blocksize);
+	uint64_t first[SIZE_LONG_DATA];
+	if (blocks)
+		for (unsigned i = 0, j = 1; i < file->copies; i++, j++)
+			first[j] = htonll((file_system.features & FEATURE_INDEX) ? file->index[i][1] : file->blocks[i][1]);
+	else
+		gcry_create_nonce(first, sizeof first);
+	first[0] = htonll(file->time);
+	memcpy(inode.data, first, sizeof first);
+	memcpy(inode.data + ((file->copies + 1) * sizeof( uint64_t )), mac_data, mac_length);
+	if (file->data && file->stored)
+		memcpy(inode.data + file_system.head_offset, file->data, file->stored < (file_system.datasize - file_system.head_offset) ? file->stored : (file_system.datasize - file_system.head_offset));
+	inode.next = htonll(file->size);
+	/* a compressed file also needs how much of it is kept in its blocks */
+	if (file_system.features & FEATURE_COMPRESS)
+	{
+		uint64_t stored = htonll(file->stored);
+		memcpy(inode.data + file_system.head_offset - sizeof stored, &stored, sizeof stored);
+	}
+	/* and, if each file has its own, how many copies there are */
+	if (file_system.features & FEATURE_COPIES)
+		inode.data[file_system.head_offset - sizeof( uint64_t ) - sizeof( uint8_t )] = file->copies;
+	for (unsigned i = 0; i < file->copies; i++)
+	{
+		gcry_cipher_hd_t cipher_handle = init_cipher(file, i);
+		bool written = block_write(file->inodes[i], &inode, cipher_handle, file->path);
+		gcry_cipher_close(cipher_handle);
+		if (!written)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * read every block of every copy (and inode) of a cached file, comparing
+ * the data with the plaintext (and parity with what it should be); any
+ * copy which doesn’t match (or only does once ECC has corrected it) is
+ * written again on to newly assigned blocks, and the inodes rewritten to
+ * point at it; the old blocks are only released if they could still be
+ * read, as the rest may since have been taken by another file
+ */
+static uint64_t file_scrub(stegfs_file_t *file, stegfs_scrub_stats_t *stats)
+{
+	stegfs_block_t block;
+	size_t head = file_system.datasize - file_system.head_offset;
+	uint64_t blocks = file_blocks(file->stored);
+	uint64_t bytes = 0;
+	uint64_t damaged = 0;
+	bool inodes = true;
+	bool *good[COPIES_MAX] = { NULL };
+	gcry_cipher_hd_t cipher_handle = init_cipher(file, 0);
+	size_t mac_length = gcry_mac_get_algo_maclen(file_system.mac);
+	uint8_t *mac_data = gcry_calloc_secure(mac_length, sizeof( uint8_t ));
+	/*
+	 * copies which are written again are padded like the good ones, so
+	 * the last block of each is kept (the parity of the last row of a
+	 * striped file can’t be checked until the padding is known)
+	 */
+	unsigned stripes = file_system.stripes;
+	uint8_t *tail = malloc(stripes * file_system.datasize);
+	uint8_t *last = malloc(file->copies * file_system.datasize);
+	uint8_t *expect = malloc(file_system.datasize);
+	uint64_t kept = 0;
+
+	for (unsigned i = 0; i < file->copies; i++)
+	{
+		init_iv(cipher_handle, file, i);
+		bytes += file_system.blocksize;
+		uint64_t size, stored;
+		if (!block_read(file->inodes[i], &block, cipher_handle, file->path)
+				|| !inode_size(&block, &size, &stored) || size != file->size || stored != file->stored
+				|| inode_copies(&block, i) != file->copies
+				|| (file->stored && memcmp(block.data + file_system.head_offset, file->data, file->stored < head ? file->stored : head))
+				|| !block_intact(file->inodes[i]))
+			inodes = false;
+		uint64_t n = (file_system.features & FEATURE_INDEX) && file->index[i] ? file->index[i][0] : 0;
+		if (!file->blocks[i] || file->blocks[i][0] != blocks || ((file_system.features & FEATURE_INDEX) && n != index_count(blocks)))
+		{
+			damaged |= UINT64_C(1) << i;
+			continue;
+		}
+		/* which of the copy’s data (and then index) blocks are intact */
+		good[i] = calloc(blocks + n + 1, sizeof( bool ));
+		bool parity = stripes > 1 && i >= stripes;
+		init_iv(cipher_handle, file, i);
+		for (uint64_t j = 1, k = 0; j <= blocks; j++, k++)
+		{
+			bytes += file_system.blocksize;
+			bool same = true;
+			if (parity && j < blocks)
 			{
-				char *c = NULL;
-				asprintf(&c, "%s/%s", path, ptr->child[i]->name);
-				stegfs_cache_remove(c);
-				free(c);
+				file_block(file, i, blocks, k, NULL, expect);
+				same = block_read(file->blocks[i][j], &block, cipher_handle, file->path) && !memcmp(block.data, expect, file_system.datasize);
 			}
-		free(ptr->child);
+			else if (parity)
+				same = block_read(file->blocks[i][j], &block, cipher_handle, file->path);
+			else
+			{
+				/* only as much as is file data can be compared */
+				uint64_t off = head + (k * stripes + i % stripes) * file_system.datasize;
+				size_t l = file->stored > off ? file->stored - off : 0;
+				if (l > file_system.datasize)
+					l = file_system.datasize;
+				same = block_read(file->blocks[i][j], &block, cipher_handle, file->path) && (!l || !memcmp(block.data, file->data + off, l));
+			}
+			if ((good[i][j] = same && ((file_system.features & FEATURE_INDEX) || ntohll(block.next) == file->blocks[i][j + 1])) && j == blocks)
+			{
+				memcpy(last + i * file_system.datasize, block.data, file_system.datasize);
+				kept |= UINT64_C(1) << i;
+			}
+			if (!good[i][j] || !block_intact(file->blocks[i][j]))
+				damaged |= UINT64_C(1) << i;
+		}
+		init_iv(cipher_handle, file, COPIES_MAX + i);
+		for (uint64_t j = 1; j <= n; j++)
+		{
+			bytes += file_system.blocksize;
+			if (!(good[i][blocks + j] = block_read(file->index[i][j], &block, cipher_handle, file->path)) || !block_intact(file->index[i][j]))
+				damaged |= UINT64_C(1) << i;
+		}
 	}
-	free(ptr->name);
-	ptr->name = NULL;
+	/*
+	 * the padding is from the last block of any good copy, or the last
+	 * row rebuilt from the good stripes, which the parity of it must
+	 * then match; without it every copy is written again, with new
+	 * padding
+	 */
+	bool tailed = false;
+	if (blocks && stripes == 1 && kept)
+	{
+		memcpy(tail, last + __builtin_ctzll(kept) * file_system.datasize, file_system.datasize);
+		tailed = true;
+	}
+	else if (blocks && stripes > 1)
+	{
+		uint8_t *s[COPIES_MAX];
+		for (unsigned i = 0; i < file->copies; i++)
+			s[i] = last + i * file_system.datasize;
+		if ((tailed = ecc_stripe_decode(s, stripes, file->copies - stripes, kept, file_system.datasize)))
+		{
+			memcpy(tail, last, stripes * file_system.datasize);
+			for (unsigned i = stripes; i < file->copies; i++)
+			{
+				if (!(kept & (UINT64_C(1) << i)))
+					continue;
+				file_block(file, i, blocks, blocks - 1, tail, expect);
+				if (memcmp(expect, s[i], file_system.datasize))
+				{
+					good[i][blocks] = false;
+					damaged |= UINT64_C(1) << i;
+				}
+			}
+		}
+	}
+	if (blocks && !tailed)
+	{
+		file_tail(file, blocks, tail);
+		for (unsigned i = 0; i < file->copies; i++)
+			damaged |= UINT64_C(1) << i;
+	}
+	if (!damaged && inodes)
+		goto done;
+	/*
+	 * new blocks could land on those of a cached file which has only had
+	 * its inode read, so leave the damage until they’ve all been claimed
+	 */
+	if (stegfs_cache_pending())
+		goto done;
+
+	bool repaired = false;
+	for (unsigned i = 0; i < file->copies; i++)
+	{
+		if (!(damaged & (UINT64_C(1) << i)))
+			continue;
+		uint64_t *old_blocks = file->blocks[i];
+		uint64_t *old_index = file->index[i];
+		file->blocks[i] = calloc(blocks + 2, sizeof blocks);
+		file->blocks[i][0] = blocks;
+		file->index[i] = NULL;
+		bool written = true;
+		for (uint64_t j = 1; j <= blocks && written; j++)
+			written = (file->blocks[i][j] = block_assign(file));
+		if (written && blocks && (file_system.features & FEATURE_INDEX))
+			written = index_assign(file, i, blocks);
+		if (written)
+			written = file_write_copy(file, i, blocks, tail, cipher_handle);
+		if (!written)
+		{
+			/* give back whatever was assigned and keep the old copy */
+			for (uint64_t j = 1; j <= blocks && file->blocks[i][j]; j++)
+				block_delete(file->blocks[i][j]);
+			for (uint64_t j = 1; file->index[i] && j <= file->index[i][0]; j++)
+				block_delete(file->index[i][j]);
+			free(file->blocks[i]);
+			free(file->index[i]);
+			file->blocks[i] = old_blocks;
+			file->index[i] = old_index;
+			stats->failed++;
+			continue;
+		}
+		for (uint64_t j = 1; good[i] && j <= blocks; j++)
+			if (good[i][j])
+				block_delete(old_blocks[j]);
+		for (uint64_t j = 1; good[i] && old_index && j <= old_index[0]; j++)
+			if (good[i][blocks + j])
+				block_delete(old_index[j]);
+		free(old_blocks);
+		free(old_index);
+		damaged &= ~(UINT64_C(1) << i);
+		repaired = true;
+		stats->repaired++;
+	}
+	/* point the inodes at the new copies */
+	if (repaired || !inodes)
+	{
+		gcry_mac_hd_t mac_handle = init_mac(file, 0);
+		file_mac(file, blocks, tail, mac_handle, mac_data, &mac_length);
+		gcry_mac_close(mac_handle);
+		if (file_write_inodes(file, blocks, mac_data, mac_length))
+			inodes = true;
+		else
+			stats->failed++;
+	}
+
 done:
-	if (name)
-		free(name);
+	gcry_cipher_close(cipher_handle);
+	gcry_free(mac_data);
+	free(expect);
+	free(last);
+	free(tail);
+	for (unsigned i = 0; i < file->copies; i++)
+		free(good[i]);
+	file->damaged = damaged || !inodes;
+	file->scrubbed = time(NULL);
+	stats->files++;
+	return bytes;
+}
+
+extern void stegfs_file_release(stegfs_file_t *file)
+{
+	if (!file->inodes)
+		return;
+	for (unsigned i = 0; i < copies_max(); i++)
+	{
+		free(file->blocks[i]);
+		free(file->index[i]);
+	}
+	free(file->inodes);
+	file->inodes = NULL;
+	file->blocks = NULL;
+	file->index = NULL;
 	return;
 }
@@ -24,6 +24,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
 #include <gcrypt.h>
 
 #define STEGFS_NAME    "stegfs"
@@ -36,12 +37,16 @@
 #define SIZE_BYTE_DATA_201508 0x07B8    /*!< 1,976 bytes */
 //#define SIZE_BYTE_DATA_202XXX 0x0780    /*!< 1,920 bytes */
 #define SIZE_BYTE_DATA  SIZE_BYTE_DATA_201508
+#define SIZE_BYTE_BLOCK_MAX   0x10000   /*!< 65,536 bytes (largest block size) */
+#define SIZE_BYTE_DATA_MAX    0xFFB8    /*!< 65,464 bytes (data in largest block) */
 
 #define SIZE_BYTE_HASH        0x0020    /*!<    32 bytes */
 #define SIZE_BYTE_NEXT        0x0008    /*!<     8 bytes */
 /* next block (not defined) */
 
 #define SIZE_BYTE_HEAD        0x0400    /*!< 1,024 bytes (data in header block) */
+#define SIZE_BYTE_GROUP       0x10000   /*!< 65,536 bytes (file data compressed at a time) */
+#define DEFLATE_RATIO_MAX     1032      /*!< Best compression deflate can manage */
 #define OFFSET_BYTE_HEAD  (SIZE_BYTE_DATA-SIZE_BYTE_HEAD) /*!< Offset of file data in header block */
 
 /* size in 64 bit ints of parts of block */
@@ -60,6 +65,19 @@
 
 #define KEY_ITERATIONS 32768
 
+#define CACHE_INDEX_MIN 16 /*!< Initial number of buckets in a cache index */
+#define CACHE_CHILD_MIN  4 /*!< Initial size of a directory's child array */
+
+#define SLAB_CHUNK      65536 /*!< Bytes allocated at a time by each slab */
+#define SLAB_HEADER        16 /*!< Bytes at the start of a chunk (link to the previous) */
+#define SLAB_STRING_MIN    16 /*!< Smallest string slab size class */
+#define SLAB_STRINGS        5 /*!< String slab size classes (16 to 256 bytes) */
+#define CACHE_BUDGET_DEFAULT 64  /*!< Default memory (MB) for idle cached files */
+#define CACHE_TTL_DEFAULT    300 /*!< Default seconds an idle file stays cached */
+
+#define NEGATIVE_MAX 1024 /*!< Number of remembered failed look-ups */
+#define NEGATIVE_TTL   30 /*!< Seconds to remember a failed look-up for */
+
 /*
  * File system header for unsupported first attempt at a file system.
  */
@@ -127,10 +145,30 @@ typedef enum
 	TAG_HEADER_OFFSET,
 	TAG_DUPLICATION,
 	TAG_MAC,
+	TAG_FEATURES,
+	TAG_STRIPES,
 	TAG_MAX
 }
 stegfs_tag_e;
 
+/*!
+ * \brief  Optional feature flags
+ *
+ * Bit flags for optional file system format features, stored in the
+ * superblock as TAG_FEATURES. File systems without the tag have none of
+ * these features enabled.
+ */
+typedef enum
+{
+	FEATURE_NONE     = 0x00000000,
+	FEATURE_INDEX    = 0x00000001, /*!< Inodes point to index blocks listing all data blocks */
+	FEATURE_ECC      = 0x00000002, /*!< Blocks carry Reed-Solomon parity to correct damaged bytes */
+	FEATURE_STRIPE   = 0x00000004, /*!< Files are split across data stripes, the other copies being parity (TAG_STRIPES) */
+	FEATURE_COMPRESS = 0x00000008, /*!< File data is compressed (a group at a time) before it's encrypted */
+	FEATURE_COPIES   = 0x00000010  /*!< Each file has its own number of copies, recorded in its inodes */
+}
+stegfs_feature_e;
+
 /*!
  * \brief  Initialisation enum
  *
@@ -160,44 +198,172 @@ typedef struct stegfs_file_t
 	char      *name;               /*!< The file name part of /path/file:password */
 	char      *pass;               /*!< Password component of /path/file:password */
 	uint64_t   size;               /*!< File size */
+	uint64_t   stored;             /*!< Bytes kept in the blocks (fewer than the size if compressed) */
 	time_t     time;               /*!< Last modified timestamp */
 	uint8_t   *data;               /*!< File data */
-	/* you can’t have more than 64 copies; you just can’t */
-	uint64_t   inodes[COPIES_MAX]; /*!< The available inodes */
-	uint64_t  *blocks[COPIES_MAX]; /*!< The complete list of used blocks */
+	/* one of each per copy; you can’t have more than 64 copies */
+	uint64_t  *inodes;             /*!< The available inodes */
+	uint64_t **blocks;             /*!< The complete list of used blocks */
+	uint64_t **index;              /*!< The list of index blocks (if FEATURE_INDEX) */
+	unsigned   copies;             /*!< How many copies the file has (0 until its inode is read, or it's created) */
 	bool       write;              /*!< Whether the file was opened for write access */
+	bool       walked;             /*!< Whether the block lists are known (not just the inode) */
+	bool       damaged;            /*!< Whether a copy (or inode) couldn't be read */
+	unsigned   copy;               /*!< The copy last read without error (tried first) */
+	time_t     scrubbed;           /*!< When every copy was last checked (cached files only) */
+	uint64_t   placed;             /*!< When its blocks were last placed (a count shared by every file) */
+	pthread_mutex_t lock;          /*!< Serialises access to the data and block lists (cached files only) */
 }
 stegfs_file_t;
 
+/*!
+ * \brief  A write which has been placed but not yet stored
+ *
+ * What's to be written is kept apart from the plaintext (if it was asked
+ * to be copied, or is compressed) so the file may change in between.
+ */
+typedef struct
+{
+	uint8_t  *data;   /*!< Copy of the plaintext (or compressed data); NULL to use the file's own */
+	uint64_t  size;   /*!< File size when it was placed */
+	uint64_t  stored; /*!< Bytes kept in the blocks */
+	time_t    time;   /*!< Last modified timestamp when it was placed */
+	uint64_t  placed; /*!< Which placement of the file this is */
+	bool      lost;   /*!< The inodes couldn't be written, so the file should be deleted */
+}
+stegfs_write_t;
+
+/*!
+ * \brief  Cache index keys
+ */
+typedef enum
+{
+	CACHE_KEY_PATH, /*!< Full path, for the file system wide index */
+	CACHE_KEY_NAME, /*!< Name, for the parent directory's index */
+	CACHE_KEY_MAX   /*!< Number of keys an element is indexed by */
+}
+stegfs_cache_key_e;
+
+/*!
+ * \brief  Cache index
+ *
+ * A chained hash table of cache elements; used for the index of every
+ * element by full path and for each directory's index of its children.
+ */
+typedef struct
+{
+	struct _stegfs_cache **bucket; /*!< Chains of elements */
+	uint64_t size;                 /*!< Number of buckets (a power of 2) */
+	uint64_t used;                 /*!< Number of elements */
+}
+stegfs_cache_map_t;
+
 /*!
  * \brief  Cache structure
  *
  * A cache tree element. If the element represents a directory it will
  * have a name and number of entries, as well as pointers to all child
  * elements. Whereas a file will (mostly) just fill out the file
- * structure.
+ * structure. Removed children leave a NULL hole in the child array so
+ * that the remaining children keep their position (and so directory
+ * offsets remain valid between readdir calls).
  */
 typedef struct _stegfs_cache
 {
 	char *name;                   /*!< The name of the directory/file */
-	uint64_t ents;                /*!< The number of child elements */
+	uint64_t ents;                /*!< The number of child elements (including holes) */
+	uint64_t room;                /*!< Space in the child array */
+	uint64_t holes;               /*!< Removed children not yet compacted away */
+	uint64_t files;               /*!< The number of child elements which are files */
+	ino_t ino;                    /*!< Inode number of a directory (0 until first stat) */
+	unsigned copies;              /*!< Copies new files in a directory have (0 for the file system's) */
+	uint64_t node;                /*!< Frontend node referring to the element (0 if none) */
 	struct _stegfs_cache **child; /*!< Array of pointers to child elements */
 	stegfs_file_t *file;          /*!< File details (if applicable) */
+	char *path;                   /*!< Full path (without password); name points into it */
+	struct _stegfs_cache *parent; /*!< Parent directory element */
+	uint64_t slot;                /*!< Position in parent's child array */
+	stegfs_cache_map_t children;  /*!< Child elements indexed by name */
+	uint64_t hash[CACHE_KEY_MAX]; /*!< Hash of each index key */
+	struct _stegfs_cache *next[CACHE_KEY_MAX]; /*!< Next element in each index chain */
+	uint32_t users;               /*!< Number of times the file is open */
+	uint64_t bytes;               /*!< Memory held while idle (on the LRU list) */
+	time_t used;                  /*!< When the file last became idle */
+	struct _stegfs_cache *newer;  /*!< More recently used idle file */
+	struct _stegfs_cache *older;  /*!< Less recently used idle file */
+	struct _stegfs_cache *pending_next; /*!< Next file with only its inode read */
+	struct _stegfs_cache *pending_prev; /*!< Previous file with only its inode read */
 }
 stegfs_cache_t;
 
+/*!
+ * \brief  Cache statistics
+ */
+typedef struct
+{
+	uint64_t hits;      /*!< Opens which found the plaintext already cached */
+	uint64_t misses;    /*!< Opens which had to read the file */
+	uint64_t evictions; /*!< Idle files whose data and block lists were dropped */
+	uint64_t bytes;     /*!< Memory currently held by idle files */
+}
+stegfs_cache_stats_t;
+
+/*!
+ * \brief  Scrub statistics
+ */
+typedef struct
+{
+	uint64_t files;    /*!< Cached files whose every copy has been checked */
+	uint64_t repaired; /*!< Damaged copies written again */
+	uint64_t failed;   /*!< Damaged copies which couldn't be written again */
+}
+stegfs_scrub_stats_t;
+
+/*!
+ * \brief  Slab allocator
+ *
+ * Objects of a single size are carved out of SLAB_CHUNK sized chunks;
+ * freed objects are kept for reuse, and every chunk is released at once
+ * when the file system is unmounted.
+ */
+typedef struct
+{
+	size_t   size;  /*!< Size of each object */
+	uint8_t *chunk; /*!< Most recent chunk; each starts with a link to the previous */
+	size_t   used;  /*!< Bytes used in the most recent chunk */
+	void    *free;  /*!< Freed objects (linked through their first bytes) */
+}
+stegfs_slab_t;
+
+/*!
+ * \brief  Negative look-up cache entry
+ *
+ * Remembers that a path (including its password) wasn't found. Only
+ * digests of the path are kept. Entries are indexed by the path without
+ * the password, so creating a file clears the entry for any password.
+ */
+typedef struct stegfs_negative_t
+{
+	uint8_t name[SIZE_BYTE_HASH]; /*!< Digest of the path without the password */
+	uint8_t path[SIZE_BYTE_HASH]; /*!< Digest of the full path (with password) */
+	time_t  time;                 /*!< When the look-up failed; 0 if unused */
+}
+stegfs_negative_t;
+
 /*!
  * \brief  A "bitmap" of in-use blocks
  *
  * A structure to keep track of blocks currently in use by files on the
  * file system. When debugging, keep track of which file a particular
- * block is being used by.
+ * block is being used by. Blocks are claimed and released atomically, as
+ * files can be stat'd by several threads at once.
  */
 typedef struct stegfs_blocks_t
 {
-	uint64_t used; /*!< Count of used blocks */
-	bool *in_use;  /*!< Used block tracker */
-	char **file;   /*!< File using the given block */
+	uint64_t used;      /*!< Count of used blocks (as of stegfs_info) */
+	uint64_t corrected; /*!< Count of blocks read with damaged bytes corrected (as of stegfs_info) */
+	bool *in_use;       /*!< Used block tracker */
+	char **file;        /*!< File using the given block */
 }
 stegfs_blocks_t;
 
@@ -217,10 +383,26 @@ typedef struct stegfs_t
 	enum gcry_md_algos     hash;        /*!< Hash algorithm used by the file system */
 	enum gcry_mac_algos    mac;         /*!< MAC algorithm used by the file system */
 	uint32_t               copies;      /*!< File duplication */
+	uint32_t               stripes;     /*!< How many of the copies hold a share of the data, the rest being parity (1 when each holds all of it) */
+	uint32_t               features;    /*!< Optional format features (stegfs_feature_e) */
 	size_t                 blocksize;   /*!< File system block size; if it needs to be bigger than 4,294,967,295 we have issues */
+	size_t                 datasize;    /*!< Bytes of data in each block (the block size less its path, hash, next and any parity) */
 	off_t                  head_offset; /*!< Start location of file data in header blocks; only 32 bits (like blocksize) */
 	stegfs_blocks_t        blocks;      /*!< In use block tracker */
 	stegfs_cache_t         cache;       /*!< File cache version 2 */
+	stegfs_cache_map_t     cache_index; /*!< Cache elements by full path */
+	stegfs_cache_t        *cache_newest; /*!< Most recently used idle file */
+	stegfs_cache_t        *cache_oldest; /*!< Least recently used idle file */
+	stegfs_cache_t        *cache_pending; /*!< Cached files which have only had their inode read */
+	uint64_t               cache_budget; /*!< Memory idle files may use */
+	time_t                 cache_ttl;   /*!< How long idle files stay cached; 0 for ever */
+	stegfs_cache_stats_t   cache_stats; /*!< Cache hit/miss/eviction counters */
+	stegfs_scrub_stats_t   scrub_stats; /*!< Scrub check/repair counters */
+	void                 (*cache_watch)(stegfs_cache_t *); /*!< Told of dropped elements which have a node */
+	stegfs_negative_t     *negative;    /*!< Recently failed look-ups */
+	stegfs_slab_t          slab_cache;  /*!< Cache elements */
+	stegfs_slab_t          slab_file;   /*!< Cached files (and their per-copy lists) */
+	stegfs_slab_t          slab_string[SLAB_STRINGS]; /*!< Short cached names */
 	version_e              version;     /*!< File system version */
 	bool                   show_bloc;   /*!< Expose the /bloc/ block list */
 }
@@ -230,17 +412,35 @@ stegfs_t;
  * \brief  Structure for each file system block
  *
  * Simple structure which represents an individual file system data
- * block.
+ * block. The data is sized for the largest block size, but only the
+ * first datasize bytes are used; on disk the hash and next address
+ * follow straight after them.
  */
 typedef struct stegfs_block_t
 {
-	uint64_t path[SIZE_LONG_PATH]; /*!< Hash of block path    */
-	uint8_t  data[SIZE_BYTE_DATA]; /*!< Block data (1,976 bytes or 247 64-bit words */
-	uint64_t hash[SIZE_LONG_HASH]; /*!< Hash of block data    */
-	uint64_t next;                 /*!< Address of next block */
+	uint64_t path[SIZE_LONG_PATH];     /*!< Hash of block path    */
+	uint8_t  data[SIZE_BYTE_DATA_MAX]; /*!< Block data (datasize bytes used) */
+	uint64_t hash[SIZE_LONG_HASH];     /*!< Hash of block data    */
+	uint64_t next;                     /*!< Address of next block */
 } __attribute__((packed))
 stegfs_block_t;
 
+/*!
+ * \brief  Structure for the superblock
+ *
+ * The superblock keeps the original 2,048 byte layout whatever the
+ * block size of the file system, so it can be read before the block
+ * size is known.
+ */
+typedef struct stegfs_superblock_t
+{
+	uint64_t path[SIZE_LONG_PATH]; /*!< Magic numbers         */
+	uint8_t  data[SIZE_BYTE_DATA]; /*!< Tags (1,976 bytes)    */
+	uint64_t hash[SIZE_LONG_HASH]; /*!< Magic numbers         */
+	uint64_t next;                 /*!< Number of blocks      */
+} __attribute__((packed))
+stegfs_superblock_t;
+
 /*!
  * \brief         Initialise stegfs library, set internal data structures
  * \param[in]  f  Name and path to file system
@@ -250,6 +450,9 @@ stegfs_block_t;
  * \param[in]  h  Hash algorithm
  * \param[in]  a  MAC algorithm
  * \param[in]  x  Duplication copies
+ * \param[in]  k  Data stripes (with FEATURE_STRIPE)
+ * \param[in]  e  Format features (stegfs_feature_e)
+ * \param[in]  s  Block size
  * \param[in]  b  Expose the /bloc/ block list
  * \returns       The initialisation status
  *
@@ -261,7 +464,7 @@ extern stegfs_init_e stegfs_init(const char * const restrict f, bool p,
 		enum gcry_cipher_modes m,
 		enum gcry_md_algos h,
 		enum gcry_mac_algos a,
-		uint32_t x, bool b);
+		uint32_t x, uint32_t k, uint32_t e, size_t s, bool b);
 
 /*!
  * \brief         Retrieve information about the file system
@@ -280,16 +483,62 @@ extern stegfs_t stegfs_info(void);
  */
 extern void stegfs_deinit(void);
 
+/*!
+ * \brief         Lock the file system namespace
+ * \param[in]  e  Whether the lock is needed exclusively
+ *
+ * The cache tree (and anything found through it) is shared by every FUSE
+ * thread. Looking things up, reading open files and opening files only
+ * need a shared lock; anything which adds to or removes from the cache,
+ * or writes to the file system, needs an exclusive lock. A cached file's
+ * own lock is only ever taken while holding this one, and the lock must
+ * not be taken recursively.
+ */
+extern void stegfs_lock(bool e);
+
+/*!
+ * \brief         Try to lock the file system namespace
+ * \param[in]  e  Whether the lock is needed exclusively
+ * \return        True if the lock was taken
+ *
+ * As stegfs_lock, but gives up rather than wait; for background work
+ * which should give way to FUSE requests.
+ */
+extern bool stegfs_trylock(bool e);
+
+/*!
+ * \brief         Unlock the file system namespace
+ */
+extern void stegfs_unlock(void);
+
+/*!
+ * \brief         Lock a cached file
+ * \param[in]  f  The file (which must be a cache entry)
+ *
+ * Serialise access to the data and block lists of a file between threads
+ * which only share the namespace lock.
+ */
+extern void stegfs_file_lock(stegfs_file_t *f) __attribute__((nonnull(1)));
+
+/*!
+ * \brief         Unlock a cached file
+ * \param[in]  f  The file (which must be a cache entry)
+ */
+extern void stegfs_file_unlock(stegfs_file_t *f) __attribute__((nonnull(1)));
+
 /*!
  * \brief         Check if a file will fit
  * \param[in]  f  File info structure
+ * \param[in]  e  Whether to compress the file to find exactly how much it needs
  * \return        True if the file will fit
  *
  * Check if there is likely enough remaining capacity of the file system
  * for the given file to fit. It takes in to account the size of the
- * file, duplicated and all known files and their duplicates.
+ * file, duplicated and all known files and their duplicates. Unless e is
+ * set, a compressed file is only checked against the least room it could
+ * need. A file which won't fit is deleted.
  */
-extern bool stegfs_file_will_fit(stegfs_file_t *f);
+extern bool stegfs_file_will_fit(stegfs_file_t *f, bool e);
 
 /*!
  * \brief         Create a new file
@@ -301,6 +550,20 @@ extern bool stegfs_file_will_fit(stegfs_file_t *f);
  */
 extern void stegfs_file_create(const char * const restrict p, bool w);
 
+/*!
+ * \brief         Choose how many copies new files in a directory have
+ * \param[in]  c  The directory's cache element
+ * \param[in]  n  The number of copies; 0 for the file system's
+ * \returns       Whether it was chosen; errno is ENOTSUP if the file
+ *                system doesn't have FEATURE_COPIES, or EINVAL if a file
+ *                can't have that many
+ *
+ * Files keep the number they were created with. Directories created in
+ * it afterwards start with the same number. Like the directories
+ * themselves, it's only kept while the file system is mounted.
+ */
+extern bool stegfs_directory_copies(stegfs_cache_t *c, unsigned n);
+
 #define STEGFS_FILE_STAT_ARGS_COUNT(...) STEGFS_FILE_STAT_ARGS_COUNT2(__VA_ARGS__, 2, 1) /*!< Function overloading argument count (part 1) */
 #define STEGFS_FILE_STAT_ARGS_COUNT2(_1, _2, _, ...) _                                   /*!< Function overloading argument count (part 2) */
 
@@ -321,6 +584,20 @@ extern void stegfs_file_create(const char * const restrict p, bool w);
  */
 extern bool stegfs_file_stat_aux(stegfs_file_t *f, bool q);
 
+/*!
+ * \brief         Metadata only stat function
+ * \param[in]  f  File structure for the file being stat'd
+ * \return        True if the file was found
+ *
+ * Find the size and modification time of a file by reading only the
+ * first valid inode. The block lists of each copy aren't read; that is
+ * left until the file is opened or written, so the cost doesn't depend
+ * on the size of the file. Unlike the other stat functions the file isn't
+ * added to the cache, so this needs no more than a shared lock; that is
+ * left to the caller.
+ */
+extern bool stegfs_file_stat_meta(stegfs_file_t *f);
+
 /*!
  * \brief         Read a file from the file system
  * \param[in]  f  File structure for the file being read
@@ -338,6 +615,35 @@ extern bool stegfs_file_read(stegfs_file_t *f);
  */
 extern bool stegfs_file_write(stegfs_file_t *f);
 
+/*!
+ * \brief         Find room for a file to be written
+ * \param[in]  f  File structure for the file being written
+ * \param[out] w  What's to be written, for stegfs_file_store()
+ * \param[in]  c  Whether to copy the plaintext (so it may change before it's stored)
+ * \return        True if there was room
+ *
+ * The first half of stegfs_file_write(): claim the blocks of the file
+ * (and of any others which have only had their inode read) and update
+ * its block lists. The caller must hold the namespace lock exclusively,
+ * so should first call stegfs_cache_settle() until stegfs_cache_pending()
+ * is false, taking the lock for each, rather than leaving them all to
+ * be claimed here at once.
+ */
+extern bool stegfs_file_place(stegfs_file_t *f, stegfs_write_t *w, bool c) __attribute__((nonnull(1, 2)));
+
+/*!
+ * \brief         Write what was placed
+ * \param[in]  f  File structure for the file being written (or NULL if it's gone)
+ * \param[in]  w  What stegfs_file_place() found room for
+ * \return        True if it was written (or there was no need)
+ *
+ * The second half of stegfs_file_write(): encrypt and write every copy
+ * and the inodes. Nothing is written if the file has been placed again
+ * since. The caller must hold the namespace lock, shared is enough, and
+ * the file's lock. Any copied data is wiped either way.
+ */
+extern bool stegfs_file_store(stegfs_file_t *f, stegfs_write_t *w) __attribute__((nonnull(2)));
+
 /*!
  * \brief         Delete a file from the file system
  * \param[in]  f  File structure for the file being deleted
@@ -346,15 +652,28 @@ extern bool stegfs_file_write(stegfs_file_t *f);
  */
 extern void stegfs_file_delete(stegfs_file_t *f);
 
+/*!
+ * \brief         Release the per-copy lists of a file
+ * \param[in]  f  The file (which isn't a cache entry)
+ *
+ * Files declared by callers (rather than those owned by the cache) have
+ * their per-copy inode and block lists allocated when first stat'd; this
+ * frees them. Path, name and password are left for the caller.
+ */
+extern void stegfs_file_release(stegfs_file_t *f) __attribute__((nonnull(1)));
+
 /*!
  * \brief         Add a entry to the cache
  * \param[in]  p  The path of the file to add
  * \param[in]  f  The file info structure of the file to add
+ * \return        The cache entry (NULL for the root)
  *
  * Add an entry to the in-memory file system cache. This allows things
- * like directory look-ups to work.
+ * like directory look-ups to work. Any data and block lists of f are
+ * handed over to the cache entry (and cleared from f) rather than
+ * copied; use the returned entry to get at them.
  */
-extern void stegfs_cache_add(const char * const restrict p, stegfs_file_t *f);
+extern stegfs_cache_t *stegfs_cache_add(const char * const restrict p, stegfs_file_t *f);
 
 /*!
  * \brief         Check the cache for an particular entry
@@ -363,12 +682,112 @@ extern void stegfs_cache_add(const char * const restrict p, stegfs_file_t *f);
  * \return        Pointer to the cache entry (do not modify)
  *
  * Check whether a particular path exists in the file systems in-memory
- * cache. If you want a modifiable cache structure use the parameter f
+ * cache (the root is always there). If you want a modifiable cache structure use the parameter f
  * as the return value points to the one used by the caching code - do
  * not modify.
  */
 extern stegfs_cache_t *stegfs_cache_exists(const char * const restrict p, stegfs_cache_t *f) __attribute__((nonnull(1)));
 
+/*!
+ * \brief         Be told when cache entries are dropped
+ * \param[in]  f  Function to call with each dropped entry that has a node
+ *
+ * A frontend which refers to cache entries by node id (and notes the id
+ * in the entry) is called as each such entry is removed from the cache,
+ * so it can forget it. The namespace is exclusively locked at the time.
+ */
+extern void stegfs_cache_watch(void (*f)(stegfs_cache_t *));
+
+/*!
+ * \brief         Set the limits of the cache
+ * \param[in]  b  Memory (in bytes) idle files may use
+ * \param[in]  t  Seconds an idle file stays cached (0 for no limit)
+ *
+ * Once a file is closed its plaintext and block lists are kept, so it can
+ * be opened again without being read; the least recently used are
+ * wiped and forgotten once either limit is reached.
+ */
+extern void stegfs_cache_limit(uint64_t b, time_t t);
+
+/*!
+ * \brief         Mark a cached file as open
+ * \param[in]  c  The cache entry of the file
+ * \param[in]  p  The password it's being opened with (or NULL)
+ * \return        True if the plaintext is cached and needn't be read
+ *
+ * An open file is never evicted. A NULL password (as for newly created
+ * files) doesn't count as a cache hit or miss.
+ */
+extern bool stegfs_cache_open(stegfs_cache_t *c, const char * const restrict p) __attribute__((nonnull(1)));
+
+/*!
+ * \brief         Mark a cached file as closed
+ * \param[in]  c  The cache entry of the file
+ *
+ * When it's no longer open (and has been written) the file becomes idle
+ * and can be evicted to stay within the cache limits.
+ */
+extern void stegfs_cache_close(stegfs_cache_t *c) __attribute__((nonnull(1)));
+
+/*!
+ * \brief         Check (and repair) the copies of one cached file
+ * \param[in]  a  Seconds before a file is checked again
+ * \return        Bytes read while checking; 0 if no file needed it
+ *
+ * Pick an idle cached file whose copies couldn't all be read, or else the
+ * one which has gone longest without being checked (if more than a
+ * seconds ago), and read every block of every copy. Copies which fail
+ * are written again, from the cached block lists and a good copy, on to
+ * newly allocated blocks, and the inodes rewritten to point at them.
+ * Files whose plaintext isn't cached are left alone, and nothing is
+ * written while stegfs_cache_pending() is true. The caller must hold the
+ * namespace lock, shared is enough.
+ */
+extern uint64_t stegfs_cache_scrub(time_t a);
+
+/*!
+ * \brief         Check whether any cached files have only had their inode read
+ * \return        True if there are any
+ *
+ * The blocks of such files aren't known to be in use yet, so damaged
+ * copies aren't written again until they've been claimed.
+ */
+extern bool stegfs_cache_pending(void);
+
+/*!
+ * \brief         Claim the blocks of one cached file which has only had its inode read
+ *
+ * Reads the rest of the file's block lists, so that nothing else is
+ * written on top of them. The caller must hold the namespace lock
+ * exclusively, but only needs it for the one file.
+ */
+extern void stegfs_cache_settle(void);
+
+/*!
+ * \brief         Remember that a path wasn't found
+ * \param[in]  p  The full path (including password) which wasn't found
+ *
+ * Add a path to the bounded negative look-up cache, so that another look
+ * up within NEGATIVE_TTL seconds can fail without reading any inodes.
+ */
+extern void stegfs_negative_add(const char * const restrict p) __attribute__((nonnull(1)));
+
+/*!
+ * \brief         Check whether a path is known not to exist
+ * \param[in]  p  The full path (including password) to look for
+ * \return        True if the path recently failed to be found
+ */
+extern bool stegfs_negative_exists(const char * const restrict p) __attribute__((nonnull(1)));
+
+/*!
+ * \brief         Forget that a path wasn't found
+ * \param[in]  p  The path (with or without password) which now exists
+ *
+ * Remove any negative look-up cache entry for the path, whatever the
+ * password; called whenever a file or directory is created or written.
+ */
+extern void stegfs_negative_remove(const char * const restrict p) __attribute__((nonnull(1)));
+
 /*!
  * \brief         Remove an entry from the cache
  * \param[in]  p  The path of the entry to remove